@@ -23,7 +23,20 @@ int main(int argc, char* argv[]) {
 
     auto files = std::vector<std::string>{};
     for (auto i = 1; i < argc; i++) {
-        files.emplace_back(argv[i]);
+        auto arg = std::string_view { argv[i] };
+        if (arg == "--optimizer-report") {
+            vm->set_optimizer_report(&std::cerr);
+        } else if (arg == "--bytecode-cache") {
+            vm->set_bytecode_cache(true);
+        } else if (arg.starts_with("--bytecode-cache=")) {
+            vm->set_bytecode_cache(true, std::string(arg.substr(arg.find('=') + 1)));
+        } else if (arg == "--lazy-compile") {
+            vm->set_lazy_compile(true);
+        } else if (arg.starts_with("--load-threads=")) {
+            vm->set_load_threads((uint32_t)std::stoul(std::string(arg.substr(arg.find('=') + 1))));
+        } else {
+            files.emplace_back(argv[i]);
+        }
     }
 
     std::ios::sync_with_stdio(false);
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <memory>
+#include <algorithm>
 
 #include "../src/khash2.h"
 
@@ -20,7 +22,8 @@ enum class TackType : uint64_t {
     Array              = 0x00'0a'00'00'00'00'00'00,
     Object             = 0x00'09'00'00'00'00'00'00,
     Function           = 0x00'0c'00'00'00'00'00'00,
-    // CFunction          = 0x00'0d'00'00'00'00'00'00
+    WeakMap            = 0x00'0d'00'00'00'00'00'00,
+    WeakRef            = 0x00'0e'00'00'00'00'00'00,
 };
 
 enum class TackGCState : uint8_t {
@@ -28,6 +31,91 @@ enum class TackGCState : uint8_t {
     Enabled = 1,
 };
 
+/// @brief Snapshot of the state of the heap, see `TackVM::get_heap_stats()`
+struct TackHeapStats {
+    struct TypeStats {
+        uint32_t count = 0; // number of values, including garbage that hasn't been swept yet
+        size_t bytes = 0;   // bytes held by those values, including the contents of strings, arrays, etc
+    };
+    TypeStats strings;
+    TypeStats arrays;
+    TypeStats objects;
+    TypeStats functions;
+    TypeStats boxes;            // captured variables
+    TypeStats weakrefs;
+    TypeStats weakmaps;
+
+    size_t live_bytes = 0;      // live data found by the last collection
+    size_t gc_threshold = 0;    // heap size (live bytes at the last collection plus allocations since) at which the next collection runs
+    uint64_t bytes_allocated = 0;
+    uint64_t bytes_reclaimed = 0;
+    uint32_t collections = 0;
+    double total_pause_ms = 0.0;
+    double max_pause_ms = 0.0;
+};
+
+/// @brief Allocations made at one source line, see `TackVM::get_alloc_profile()`
+struct TackAllocProfileEntry {
+    std::string function;   // name of the function, or "(host)" for allocations made outside of tack code
+    uint32_t line = 0;
+    std::string type;       // "string", "array", "object", "function" or "box" (captured variable)
+    uint64_t samples = 0;
+    double objects = 0.0;   // estimated number of allocations
+    double bytes = 0.0;     // estimated bytes allocated
+};
+
+/// @brief Interface for supplying the memory a VM uses, see `TackVM::create(TackHostAllocator*)`
+/// @details Both functions are called with the same size and alignment for a given block. Alignments are powers of two,
+/// up to the size of a heap page (64KiB). Allocation failures should throw (e.g. std::bad_alloc) rather than return nullptr
+struct TackHostAllocator {
+    inline virtual ~TackHostAllocator() {}
+    virtual void* allocate(size_t size, size_t alignment) = 0;
+    virtual void free(void* ptr, size_t size, size_t alignment) = 0;
+};
+
+/// @brief Running byte counts for a group of container allocations
+struct TackMemoryAccount {
+    int64_t bytes = 0;      // bytes currently allocated
+    uint64_t allocated = 0; // bytes allocated in total; only ever increases
+    TackHostAllocator* host = nullptr; // where the memory comes from; nullptr for the global operator new
+};
+
+/// @brief Allocator for the containers inside heap values (array elements, object buckets, closure captures)
+/// @details Charges every allocation to a `TackMemoryAccount`, so the garbage collector knows how much memory the heap really holds,
+/// and takes the memory from the account's host allocator if it has one.
+/// A default-constructed allocator charges nothing and uses the global operator new, so containers created by the host work as usual
+template<typename T>
+struct TackAllocator {
+    using value_type = T;
+    TackMemoryAccount* account = nullptr;
+
+    TackAllocator() = default;
+    TackAllocator(TackMemoryAccount* account) : account(account) {}
+    template<typename U> TackAllocator(const TackAllocator<U>& a) : account(a.account) {}
+
+    T* allocate(std::size_t n) {
+        if (account) {
+            account->bytes += n * sizeof(T);
+            account->allocated += n * sizeof(T);
+            if (account->host) {
+                return (T*)account->host->allocate(n * sizeof(T), alignof(T));
+            }
+        }
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p, std::size_t n) {
+        if (account) {
+            account->bytes -= n * sizeof(T);
+            if (account->host) {
+                account->host->free(p, n * sizeof(T), alignof(T));
+                return;
+            }
+        }
+        std::allocator<T>().deallocate(p, n);
+    }
+    template<typename U> bool operator==(const TackAllocator<U>& a) const { return account == a.account; }
+};
+
 struct TackValue {
     union {
         // TODO: undefined behaviour
@@ -39,35 +127,24 @@ struct TackValue {
     /// @brief Underlying representation for strings
     struct StringType {
         std::string data;
-        uint32_t refcount = 0;
-        bool marker = false;
     };
 
     /// @brief Underlying representation for Arrays
     struct ArrayType {
-        std::vector<TackValue> data;
-        uint32_t refcount = 0;
-        bool marker = false;
+        std::vector<TackValue, TackAllocator<TackValue>> data;
     };
 
     /// @brief Underlying representation for Objects
     struct ObjectType {
-        KHash<std::string, TackValue> data;
-        uint32_t refcount = 0;
-        bool marker = false;
+        KHash<std::string, TackValue, std::hash<std::string>, TackAllocator<TackValue>> data;
     };
     
     /// @brief Function signature for c functions which can be called by the VM through tack code
     using CFunctionType = TackValue(*)(class TackVM*, int, TackValue*);
 
-    /// @brief Underlying representation for closures
-    struct FunctionType {
-        void* code_ptr; // pointer to CodeFragment, or pointer to CFunctionType
-        bool is_cfunction = false;
-        std::vector<TackValue> captures; // contains boxes
-        uint32_t refcount = 0;
-        bool marker = false;
-    };
+    struct FunctionType;
+    struct WeakRefType;
+    struct WeakMapType;
 
 
 
@@ -115,6 +192,12 @@ struct TackValue {
     /// @brief Check if this value is of type Array
     /// @return 
     inline bool is_array()     const                    { return (_i & type_bits) == (uint64_t)TackType::Array; }
+    /// @brief Check if this value is of type WeakRef
+    /// @return 
+    inline bool is_weakref()   const                    { return (_i & type_bits) == (uint64_t)TackType::WeakRef; }
+    /// @brief Check if this value is of type WeakMap
+    /// @return 
+    inline bool is_weakmap()   const                    { return (_i & type_bits) == (uint64_t)TackType::WeakMap; }
 
 
     /// @brief Get the underlying representation. UB if not string
@@ -137,6 +220,16 @@ struct TackValue {
     /// Undefined behaviour (most likely segfault/exception) if the value is not of this type, so check first
     /// @return  
     inline FunctionType*    function()  const           { return (FunctionType*)(_i & pointer_bits); }
+    /// @brief Get the underlying representation. UB if not weakref
+    /// @details Convert to actual type.
+    /// Undefined behaviour (most likely segfault/exception) if the value is not of this type, so check first
+    /// @return  
+    inline WeakRefType*     weakref()   const           { return (WeakRefType*)(_i & pointer_bits); }
+    /// @brief Get the underlying representation. UB if not weakmap
+    /// @details Convert to actual type.
+    /// Undefined behaviour (most likely segfault/exception) if the value is not of this type, so check first
+    /// @return  
+    inline WeakMapType*     weakmap()   const           { return (WeakMapType*)(_i & pointer_bits); }
     
     /// @brief Get the underlying representation. UB if not cfunction
     /// @details Convert to actual type.
@@ -202,6 +295,14 @@ struct TackValue {
     /// @param arr 
     /// @return 
     static inline TackValue array(ArrayType* arr)       { return { nan_bits | (uint64_t)TackType::Array | uint64_t(arr) }; }
+    /// @brief Construct a new weak reference value from the given underlying weak reference
+    /// @param ref 
+    /// @return 
+    static inline TackValue weakref(WeakRefType* ref)   { return { nan_bits | (uint64_t)TackType::WeakRef | uint64_t(ref) }; }
+    /// @brief Construct a new weak-keyed map value from the given underlying map
+    /// @param map 
+    /// @return 
+    static inline TackValue weakmap(WeakMapType* map)   { return { nan_bits | (uint64_t)TackType::WeakMap | uint64_t(map) }; }
     // /// @brief Construct a new cfunction value from the given function
     // /// @param cf 
     // /// @return 
@@ -222,6 +323,56 @@ struct TackValue {
     }
 };
 
+/// @brief Underlying representation for closures
+/// @details The captured variables (boxes) are stored in the function itself, unless there are more than `INLINE_CAPTURES`
+/// of them, in which case they get an allocation of their own
+struct TackValue::FunctionType {
+    static constexpr uint32_t INLINE_CAPTURES = 4;
+    void* code_ptr; // pointer to CodeFragment, or pointer to CFunctionType
+    bool is_cfunction = false;
+    uint32_t num_captures = 0;
+    union {
+        TackValue inline_captures[INLINE_CAPTURES];
+        struct {
+            TackValue* data;
+            TackMemoryAccount* account;
+        } spilled;
+    };
+
+    FunctionType(void* code_ptr, bool is_cfunction, uint32_t num_captures, TackMemoryAccount* account)
+        : code_ptr(code_ptr), is_cfunction(is_cfunction), num_captures(num_captures) {
+        if (num_captures > INLINE_CAPTURES) {
+            spilled.data = TackAllocator<TackValue>(account).allocate(num_captures);
+            spilled.account = account;
+        }
+        std::fill_n(captures(), num_captures, TackValue::null());
+    }
+    ~FunctionType() {
+        if (num_captures > INLINE_CAPTURES) {
+            TackAllocator<TackValue>(spilled.account).deallocate(spilled.data, num_captures);
+        }
+    }
+    FunctionType(const FunctionType&) = delete;
+    FunctionType& operator=(const FunctionType&) = delete;
+
+    inline TackValue* captures() { return num_captures > INLINE_CAPTURES ? spilled.data : inline_captures; }
+};
+
+/// @brief Underlying representation for weak references
+/// @details A weak reference doesn't keep its target alive; once the target is collected, the garbage collector sets it to null
+struct TackValue::WeakRefType {
+    TackValue target;
+};
+
+/// @brief Underlying representation for weak-keyed maps
+/// @details Keys are arrays, objects or functions, compared by identity. The map doesn't keep its keys alive, and keeps a value
+/// alive only as long as its key is reachable from somewhere else (so an entry whose value refers back to its own key can still
+/// be collected). Entries are removed by the garbage collector once their key is collected
+struct TackValue::WeakMapType {
+    struct KeyHash { uint32_t operator()(uint64_t k) const { return uint32_t((k * 0x9e3779b97f4a7c15ull) >> 32); } };
+    KHash<uint64_t, TackValue, KeyHash, TackAllocator<TackValue>> data; // raw bits of the key -> value
+};
+
 class TackVM {
 public:
     /// @brief Create a new TackVM. 
@@ -229,6 +380,15 @@ public:
     /// You should deallocate the return value with `delete` once it is no longer needed, it can also be stored safely inside a `unique_ptr`
     /// @return Pointer to a new VM instance
     static TackVM* create();
+
+    /// @brief Create a new TackVM which gets its memory from a host allocator
+    /// @details The allocator is used for the garbage-collected heap (cells and the contents of arrays, objects and closures),
+    /// compiled code, and the table of interned strings. The characters of long strings are held in a std::string,
+    /// so they still come from the global operator new, as does the VM object itself.
+    /// The allocator must outlive the VM
+    /// @param allocator 
+    /// @return Pointer to a new VM instance
+    static TackVM* create(TackHostAllocator* allocator);
     inline virtual ~TackVM() {}
 
     /// @brief Get the user pointer attached to this VM, or nullptr
@@ -248,6 +408,126 @@ public:
     /// @param state 
     virtual void set_gc_state(TackGCState state) = 0;
 
+    /// @brief Get the heap growth factor
+    /// @return 
+    virtual double get_gc_growth_factor() const = 0;
+
+    /// @brief Set how much the heap may grow between collections
+    /// @details After each collection, the next one is scheduled for when the heap reaches `factor` times the size of the live data.
+    /// Smaller values use less memory but collect more often. Default is 2, minimum is 1
+    /// @param factor 
+    virtual void set_gc_growth_factor(double factor) = 0;
+
+    /// @brief Get the soft heap limit in bytes, or 0 if there isn't one
+    /// @return 
+    virtual size_t get_gc_soft_limit() const = 0;
+
+    /// @brief Set a heap size (in bytes, including the contents of strings, arrays and objects) that the collector tries to stay under
+    /// @details When the growth factor would take the heap past the limit, collections are run more often instead.
+    /// This is a soft limit: the heap can still go over it if there's that much live data. 0 means no limit (the default)
+    /// @param bytes 
+    virtual void set_gc_soft_limit(size_t bytes) = 0;
+
+    /// @brief Get the maximum heap size in bytes, or 0 if there isn't one
+    /// @return 
+    virtual size_t get_max_heap_size() const = 0;
+
+    /// @brief Set a hard limit on the heap size (in bytes, including the contents of strings, arrays and objects)
+    /// @details When an instruction takes the heap over the limit, a full collection is run straight away (even if the garbage
+    /// collector is disabled) and if the heap is still over the limit, an "out of memory" error is raised in the script,
+    /// which call() throws as a std::runtime_error like any other error. The check happens between instructions, so
+    /// a single allocation can go over the limit by its own size; allocations made inside a cfunction are checked when it
+    /// returns. 0 means no limit (the default)
+    /// @param bytes 
+    virtual void set_max_heap_size(size_t bytes) = 0;
+
+    /// @brief Start a scratch scope: until `end_scratch()`, new values are allocated from a bump arena
+    /// @details Meant for temporaries that are created and thrown away together, like everything a script allocates during
+    /// one frame of a game loop. Allocating in the scope is cheaper than usual, and garbage from it is freed in bulk rather
+    /// than one value at a time. Scopes can't be nested
+    virtual void begin_scratch() = 0;
+
+    /// @brief End the scratch scope started by `begin_scratch()`
+    /// @details Runs a collection, then anything allocated in the scope that's still reachable (from globals, the stack,
+    /// or pinned values) is kept as an ordinary value; the rest of the scope's memory is reset without visiting the dead values
+    /// (except strings and objects, whose destructors still run). As with any collection, values the host holds on to
+    /// must be pinned
+    virtual void end_scratch() = 0;
+
+    /// @brief Get statistics about the heap and the garbage collector
+    /// @return 
+    virtual TackHeapStats get_heap_stats() const = 0;
+
+    /// @brief Write garbage collector events to a stream, in the Chrome trace event format
+    /// @details Each collection is written as a "gc" event containing a "mark" event and a "sweep" event for each type that
+    /// had pages left to sweep; pages swept lazily between collections get their own "sweep" events. The output can be opened
+    /// in chrome://tracing or Perfetto. Timestamps are std::chrono::steady_clock in microseconds, so they can be lined up
+    /// with events from other profilers using the same clock.
+    /// Pass nullptr to stop tracing, which also closes the JSON array; the stream must stay valid until then
+    /// @param stream 
+    virtual void set_gc_trace(std::ostream* stream) = 0;
+
+    /// @brief Start or stop sampling allocations to find out where in the code they come from
+    /// @details On average one allocation is sampled for every `bytes_per_sample` bytes allocated (1 samples every allocation,
+    /// 0 turns sampling off). Changing the rate clears the profile collected so far. Sizes are taken when the value is
+    /// allocated, so an array that grows afterwards is only counted at its initial size
+    /// @param bytes_per_sample 
+    virtual void set_alloc_sampling(size_t bytes_per_sample) = 0;
+
+    /// @brief Get the allocations sampled so far, grouped by source line and type, largest first
+    /// @details The counts are scaled up from the samples, so they estimate all allocations and not just the sampled ones
+    /// @return 
+    virtual std::vector<TackAllocProfileEntry> get_alloc_profile() const = 0;
+
+    /// @brief Write a line to a stream for each function compiled from now on, with its size before and after optimization
+    /// @details The line is "<function>: <before> -> <after> instructions", for comparing the effect of optimizer changes
+    /// on real code. Pass nullptr to stop; the stream must stay valid until then
+    /// @param stream 
+    virtual void set_optimizer_report(std::ostream* stream) = 0;
+
+    /// @brief Cache compiled modules in .tackc files, so loading them again skips parsing and compiling
+    /// @details A module's file goes in dir, or next to its source if dir is empty ("foo.tack" -> "foo.tackc"). It's used
+    /// while the source is unchanged (same size, and the same modification time or contents) and the bytecode format is the
+    /// same, otherwise the module is compiled and the file written again. Off by default
+    /// @param enabled 
+    /// @param dir 
+    virtual void set_bytecode_cache(bool enabled, const std::string& dir = "") = 0;
+
+    /// @brief Leave function bodies to be parsed and compiled when each function is first called
+    /// @details Loading a module only skims each function body for the names it uses, so code that's never called costs
+    /// little. The catch is that syntax errors in a function body (and uses of undefined variables) are only reported when
+    /// it's first called. Small functions are compiled straight away, and modules are compiled in full while the bytecode
+    /// cache is on. Applies to modules loaded afterwards. Off by default
+    /// @param enabled 
+    virtual void set_lazy_compile(bool enabled) = 0;
+
+    /// @brief Parse modules on a pool of threads, ahead of them being imported
+    /// @details When a module has been parsed, the modules it imports are read and parsed on the threads while it's
+    /// compiled, and so on down the imports. Compiling and running modules still happens on the calling thread, in the
+    /// same order as without threads. Errors are reported when the module is imported, as usual. 0 (the default) turns it
+    /// off, and parses each module as it's imported
+    /// @param threads 
+    virtual void set_load_threads(uint32_t threads) = 0;
+
+    /// @brief Write a snapshot of everything reachable from the GC roots (globals, the stack and pinned values) to a file
+    /// @details The snapshot is JSON: nodes and edges are flat arrays of numbers described by the "meta" section, names are
+    /// indices into "strings". Each node has its type, size (including contents), the size it retains (everything that would be
+    /// freed if it were) and its immediate dominator; functions also have the line they were defined on. A "summary" section
+    /// lists the totals per type and the largest retainers. Raises an error if the file can't be written
+    /// @param path 
+    virtual void write_heap_snapshot(const std::string& path) = 0;
+
+    /// @brief Keep a value, and everything reachable from it, alive until it is unpinned
+    /// @details Pins are counted, so every call to `pin()` must be balanced by a call to `unpin()`. Prefer `TackHandle`, which does this automatically.
+    /// Values which aren't garbage collected (numbers, booleans, null, pointers) are ignored
+    /// @param value 
+    virtual void pin(TackValue value) = 0;
+
+    /// @brief Release a pin previously taken with `pin()`
+    /// @details Once a value has been unpinned as many times as it was pinned, it is eligible for garbage collection again
+    /// @param value 
+    virtual void unpin(TackValue value) = 0;
+
     // set a global variable
 
     /// @brief Set a global variable
@@ -310,6 +590,17 @@ public:
     /// @brief Allocate a new object and return a pointer to it.
     /// @details The VM is responsible for deallocation
     virtual TackValue::ObjectType* alloc_object() = 0;
+
+    /// @brief Allocate a new weak reference to target and return a pointer to it.
+    /// @details The VM is responsible for deallocation
+    /// @param target 
+    /// @return 
+    virtual TackValue::WeakRefType* alloc_weakref(TackValue target) = 0;
+
+    /// @brief Allocate a new, empty weak-keyed map and return a pointer to it.
+    /// @details The VM is responsible for deallocation
+    /// @return 
+    virtual TackValue::WeakMapType* alloc_weakmap() = 0;
     
     /// @brief Allocate a new string which will be garbage collected
     /// @details Use it for temp strings
@@ -323,3 +614,30 @@ public:
     /// @return 
     virtual TackValue::StringType* intern_string(const std::string& data) = 0;
 };
+
+/// @brief Pins a value for as long as the handle is alive
+/// @details RAII wrapper around `TackVM::pin()` and `TackVM::unpin()`. Copying a handle takes another pin, moving it does not.
+/// The handle must not outlive the VM
+class TackHandle {
+    TackVM* vm = nullptr;
+    TackValue value = TackValue::null();
+
+public:
+    TackHandle() = default;
+    TackHandle(TackVM* vm, TackValue value) : vm(vm), value(value) { vm->pin(value); }
+    TackHandle(const TackHandle& h) : vm(h.vm), value(h.value) { if (vm) vm->pin(value); }
+    TackHandle(TackHandle&& h) noexcept : vm(h.vm), value(h.value) { h.vm = nullptr; }
+    TackHandle& operator=(TackHandle h) noexcept { std::swap(vm, h.vm); std::swap(value, h.value); return *this; }
+    ~TackHandle() { reset(); }
+
+    /// @brief Unpin the value early. The handle will then be empty
+    inline void reset() {
+        if (vm) {
+            vm->unpin(value);
+            vm = nullptr;
+        }
+    }
+    /// @brief Get the pinned value, or null if the handle is empty
+    /// @return 
+    inline TackValue get() const { return vm ? value : TackValue::null(); }
+};
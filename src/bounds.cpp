@@ -0,0 +1,130 @@
+#include "compiler.h"
+#include "parsing.h"
+
+// Bounds check elimination for loops over an array
+// In "for i in 0, #a { ... a[i] ... }" the index is always a number in range, as long as the body doesn't change a or i
+// and can't make a shorter: elements are removed by a function (pop etc) or by ">>", on a or on anything else that
+// could be the same array, so the body can't call anything or use ">>" at all. Then a[i] compiles to LOAD_ARRAY_NUM,
+// which only has to check that a is an array (#a works on strings and objects too) rather than the type of the index
+// and the bounds.
+// The start of the range has to be a literal whole number >= 0 so i is too, and a[i] inside a closure is left alone,
+// since the closure could run after the loop.
+
+namespace {
+
+struct BoundsAnalysis {
+    const std::string& array;
+    const std::string& index;
+    std::unordered_set<const AstNode*> accesses = {};
+    bool ok = true;
+
+    bool is_name(const AstNode& node, const std::string& name) const {
+        return node.type == AstType::Identifier && node.data_s == name;
+    }
+
+    void visit(const AstNode& node, bool in_function) {
+        if (!ok) {
+            return;
+        }
+        switch (node.type) {
+            case AstType::CallExp:
+            case AstType::ShiftRightExp: // pops an array
+                ok = false;
+                return;
+            case AstType::ImportStat:
+                return;
+
+            // a new variable with either name would hide the one the loop is about; not worth tracking
+            case AstType::ConstDeclStat:
+            case AstType::VarDeclStat:
+            case AstType::FuncDeclStat:
+            case AstType::ForStat:
+            case AstType::ForStatInt:
+                ok = node.children[0].data_s != array && node.children[0].data_s != index;
+                for (auto i = 1u; i < node.children.size(); i++) {
+                    visit(node.children[i], in_function);
+                }
+                return;
+            case AstType::ForStat2:
+            case AstType::MultiDeclStat: {
+                auto names = node.type == AstType::ForStat2 ? 2u : (uint32_t)node.children.size() - 1;
+                for (auto i = 0u; i < node.children.size(); i++) {
+                    if (i < names) {
+                        ok = ok && node.children[i].data_s != array && node.children[i].data_s != index;
+                    } else {
+                        visit(node.children[i], in_function);
+                    }
+                }
+                return;
+            }
+            case AstType::ParamDef:
+                for (auto& param : node.children) {
+                    ok = ok && param.data_s != array && param.data_s != index;
+                }
+                return;
+            case AstType::FuncLiteral:
+                for (auto& c : node.children) {
+                    visit(c, true);
+                }
+                return;
+            case AstType::LazyBlock:
+                // a body that isn't parsed yet (see lazy.cpp) could assign to either name
+                for (auto& c : node.children) {
+                    ok = ok && c.data_s != array && c.data_s != index;
+                }
+                return;
+
+            case AstType::AssignStat:
+                if (is_name(node.children[0], array) || is_name(node.children[0], index)) {
+                    ok = false;
+                    return;
+                }
+                visit(node.children[0], in_function);
+                visit(node.children[1], in_function);
+                return;
+            case AstType::IndexExp:
+                if (!in_function && is_name(node.children[0], array) && is_name(node.children[1], index)) {
+                    accesses.insert(&node);
+                    return;
+                }
+                visit(node.children[0], in_function);
+                visit(node.children[1], in_function);
+                return;
+            case AstType::AccessExp:
+                visit(node.children[0], in_function); // children[1] is the key, not a variable
+                return;
+            case AstType::ObjectLiteral:
+                for (auto& field : node.children) {
+                    visit(field.children[1], in_function); // field.children[0] is the key
+                }
+                return;
+
+            default:
+                for (auto& c : node.children) {
+                    visit(c, in_function);
+                }
+                return;
+        }
+    }
+};
+
+}
+
+void find_in_range_indexes(const AstNode* loop, std::unordered_set<const AstNode*>& out) {
+    auto& start = loop->children[1];
+    auto& end = loop->children[2];
+    if (start.type != AstType::NumLiteral || start.data_d < 0 || start.data_d != (double)(uint32_t)start.data_d) {
+        return;
+    }
+    if (end.type != AstType::LenExp || end.children[0].type != AstType::Identifier) {
+        return;
+    }
+    auto analysis = BoundsAnalysis { .array = end.children[0].data_s, .index = loop->children[0].data_s };
+    if (analysis.array == analysis.index) {
+        return;
+    }
+    analysis.visit(loop->children[3], false);
+    if (analysis.ok) {
+        out.insert(analysis.accesses.begin(), analysis.accesses.end());
+    }
+}
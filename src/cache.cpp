@@ -0,0 +1,463 @@
+#include "interpreter.h"
+#include "parsing.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Bytecode cache
+// A compiled module is written out as a .tackc file with everything needed to run it without the source: the import
+// statements (which load other modules while compiling), the globals its code reads and writes, and its code fragments
+// Global ids depend on the order modules are loaded in, so globals are written by module and name and given new ids on
+// loading; if one of them is no longer there (an imported module changed), the module is compiled from source instead
+// The file is only good for the tack that wrote it: instructions are written as they are in memory, and the version
+// below changes with the opcodes
+
+std::optional<std::string> read_text_file(const std::string& fname);
+
+namespace {
+
+const uint32_t CACHE_MAGIC = 0x43424b54; // "TKBC"
+const uint32_t CACHE_FORMAT = 1;
+const uint32_t CACHE_VERSION = (CACHE_FORMAT << 16) | (uint32_t)Opcode::OPCODE_MAX;
+
+enum StorageKind : uint8_t { StorageValue = 0, StorageString, StorageFragment };
+
+static_assert(sizeof(Instruction) == 4);
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_time;
+    uint64_t source_hash;
+    uint64_t contents_hash; // everything after the header, to catch a corrupt file
+};
+
+// FNV-1a
+uint64_t hash_bytes(const char* data, size_t size) {
+    auto h = 0xcbf29ce484222325ull;
+    for (auto i = 0u; i < size; i++) {
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+uint64_t hash_source(const std::string& source) {
+    return hash_bytes(source.data(), source.size());
+}
+
+// a file's contents, mapped into memory where that's possible
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    std::string contents;
+
+    explicit MappedFile(const std::string& path) {
+        auto file = std::ifstream(path, std::ios::binary);
+        if (file.is_open()) {
+            contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            data = contents.data();
+            size = contents.size();
+        }
+    }
+#else
+    explicit MappedFile(const std::string& path) {
+        auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            auto* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const char*)p;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (data) {
+            munmap((void*)data, size);
+        }
+    }
+#endif
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+struct Writer {
+    std::string buf;
+
+    template<typename T> void write(const T& value) {
+        buf.append((const char*)&value, sizeof(T));
+    }
+    template<typename T> void write_array(const T* values, uint32_t count) {
+        write(count);
+        buf.append((const char*)values, sizeof(T) * count);
+    }
+    void write_string(const std::string& s) {
+        write_array(s.data(), (uint32_t)s.size());
+    }
+};
+
+// reading past the end (a truncated or corrupt file) sets ok to false and reads zeroes
+struct Reader {
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+    bool ok = true;
+
+    bool has(size_t n) {
+        ok = ok && n <= size - pos;
+        return ok;
+    }
+    template<typename T> T read() {
+        auto value = T {};
+        if (has(sizeof(T))) {
+            std::memcpy(&value, data + pos, sizeof(T));
+            pos += sizeof(T);
+        }
+        return value;
+    }
+    template<typename T, typename V> void read_array(V& out) {
+        auto count = read<uint32_t>();
+        if (has(size_t(count) * sizeof(T))) {
+            out.resize(count);
+            std::memcpy((void*)out.data(), data + pos, size_t(count) * sizeof(T));
+            pos += size_t(count) * sizeof(T);
+        }
+    }
+    // a count of things that each take at least a byte
+    uint32_t read_count() {
+        auto count = read<uint32_t>();
+        return has(count) ? count : 0;
+    }
+    std::string read_string() {
+        auto s = std::string {};
+        read_array<char>(s);
+        return s;
+    }
+};
+
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t time = 0;
+    bool ok = false;
+};
+SourceStamp stamp_source(const std::string& path) {
+    auto ec = std::error_code {};
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return {};
+    }
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return {};
+    }
+    return { size, (int64_t)time.time_since_epoch().count(), true };
+}
+
+}
+
+void Interpreter::set_bytecode_cache(bool enabled, const std::string& dir) {
+    bytecode_cache = enabled;
+    bytecode_cache_dir = dir;
+}
+
+std::string Interpreter::cache_path(const std::string& source_path) const {
+    auto source = std::filesystem::path(source_path);
+    if (bytecode_cache_dir.empty()) {
+        return source.replace_extension(".tackc").string();
+    }
+    // modules with the same name in different directories mustn't share a file
+    auto ec = std::error_code {};
+    auto absolute = std::filesystem::absolute(source, ec).string();
+    auto name = source.stem().string() + "-" + std::to_string(hash_source(absolute)) + ".tackc";
+    return (std::filesystem::path(bytecode_cache_dir) / name).string();
+}
+
+CodeFragment* Interpreter::load_cached_module(const std::string& module_name, const std::string& source_path) {
+    auto file = MappedFile(cache_path(source_path));
+    if (!file.data) {
+        return nullptr;
+    }
+    auto in = Reader { .data = file.data, .size = file.size };
+
+    // fresh if the source is the same size and either hasn't been touched or still hashes the same
+    auto header = in.read<CacheHeader>();
+    auto stamp = stamp_source(source_path);
+    if (!in.ok || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || !stamp.ok || header.source_size != stamp.size) {
+        return nullptr;
+    }
+    if (header.source_time != stamp.time) {
+        auto source = read_text_file(source_path);
+        if (!source.has_value() || hash_source(source.value()) != header.source_hash) {
+            return nullptr;
+        }
+    }
+    if (hash_bytes(file.data + in.pos, file.size - in.pos) != header.contents_hash) {
+        return nullptr;
+    }
+    if (in.read_string() != module_name) {
+        return nullptr; // fragment names start with the module name
+    }
+
+    // imports are loaded before anything runs, as they would be by compiling (and can import this one back)
+    module_scope(module_name);
+    auto num_imports = in.read_count();
+    for (auto i = 0u; i < num_imports && in.ok; i++) {
+        load_module_s(in.read_string());
+    }
+
+    // find the globals again; the module's own exports are created as compiling would
+    struct GlobalRef {
+        uint16_t id;
+        std::string module;
+        std::string name;
+        bool is_const;
+    };
+    auto refs = std::vector<GlobalRef>(in.read_count());
+    for (auto& ref : refs) {
+        ref.id = in.read<uint16_t>();
+        ref.module = in.read_string();
+        ref.name = in.read_string();
+        ref.is_const = in.read<uint8_t>();
+    }
+    if (!in.ok) {
+        return nullptr;
+    }
+    auto global_ids = std::unordered_map<uint16_t, uint16_t> {};
+    for (auto& ref : refs) {
+        if (ref.module.empty()) {
+            continue;
+        }
+        auto m = modules.find(ref.module);
+        if (m == modules.end()) {
+            return nullptr;
+        }
+        auto& bindings = modules.value_at(m)->bindings;
+        auto var = bindings.find(ref.name);
+        if (var == bindings.end() || !var->second.is_global || var->second.is_const != ref.is_const) {
+            return nullptr;
+        }
+        global_ids[ref.id] = var->second.g_id;
+    }
+
+    // read the fragments into temporaries first, so a bad file doesn't leave half of them behind
+    struct CachedFragment {
+        std::string name;
+        uint32_t max_register;
+        std::vector<Instruction> instructions;
+        std::vector<uint32_t> line_numbers;
+        std::vector<std::pair<StorageKind, uint64_t>> storage; // value bits, or an index into strings or fragments
+        std::vector<CaptureInfo> capture_info;
+    };
+    auto strings = std::vector<std::string> {};
+    auto cached = std::vector<CachedFragment>(in.read_count());
+    for (auto& c : cached) {
+        c.name = in.read_string();
+        c.max_register = in.read<uint32_t>();
+        in.read_array<Instruction>(c.instructions);
+        in.read_array<uint32_t>(c.line_numbers);
+        c.storage.resize(in.read_count());
+        for (auto& [kind, value] : c.storage) {
+            kind = (StorageKind)in.read<uint8_t>();
+            if (kind == StorageString) {
+                value = strings.size();
+                strings.emplace_back(in.read_string());
+            } else {
+                value = in.read<uint64_t>();
+                in.ok = in.ok && (kind == StorageValue || (kind == StorageFragment && value < cached.size()));
+            }
+        }
+        c.capture_info.resize(in.read_count());
+        for (auto& capture : c.capture_info) {
+            capture.name = in.read_string();
+            capture.source_register = in.read<uint8_t>();
+            capture.dest_register = in.read<uint8_t>();
+        }
+        in.ok = in.ok && c.line_numbers.size() == c.instructions.size();
+    }
+    if (!in.ok || in.pos != in.size || cached.empty()) {
+        return nullptr;
+    }
+
+    for (auto& ref : refs) {
+        if (ref.module.empty()) {
+            global_ids[ref.id] = set_global_v(ref.name, module_name, TackValue::null(), ref.is_const)->g_id;
+        }
+    }
+    auto fragments = std::vector<CodeFragment*>(cached.size());
+    for (auto& f : fragments) {
+        f = create_fragment();
+    }
+    for (auto i = 0u; i < cached.size(); i++) {
+        auto& c = cached[i];
+        auto* f = fragments[i];
+        f->name = c.name;
+        f->max_register = c.max_register;
+        f->instructions.assign(c.instructions.begin(), c.instructions.end());
+        f->line_numbers.assign(c.line_numbers.begin(), c.line_numbers.end());
+        f->capture_info.assign(c.capture_info.begin(), c.capture_info.end());
+        for (auto& ins : f->instructions) {
+            if (ins.opcode == Opcode::READ_GLOBAL || ins.opcode == Opcode::WRITE_GLOBAL) {
+                ins.u1 = global_ids[ins.u1];
+            }
+        }
+        for (auto& [kind, value] : c.storage) {
+            if (kind == StorageString) {
+                f->storage.emplace_back(TackValue::string(intern_string(strings[value])));
+            } else if (kind == StorageFragment) {
+                f->storage.emplace_back(TackValue::pointer(fragments[value]));
+            } else {
+                auto v = TackValue {};
+                v._i = value;
+                f->storage.emplace_back(v);
+            }
+        }
+    }
+    return fragments[0];
+}
+
+void Interpreter::write_cached_module(const std::string& module_name, const std::string& source_path, const std::string& source, const AstNode& ast, CodeFragment* root) {
+    // the source is read again after taking its stamp, in case it changed since it was compiled
+    auto stamp = stamp_source(source_path);
+    if (!stamp.ok || read_text_file(source_path) != source) {
+        return;
+    }
+    auto out = Writer {};
+    out.write(CacheHeader {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .source_size = stamp.size,
+        .source_time = stamp.time,
+        .source_hash = hash_source(source),
+        .contents_hash = 0 // filled in at the end
+    });
+    out.write_string(module_name);
+
+    // import statements, in the order they're compiled
+    auto imports = std::vector<std::string> {};
+    auto find_imports = [&](auto& self, const AstNode& node) -> void {
+        if (node.type == AstType::ImportStat) {
+            imports.emplace_back(node.children[0].data_s + ".tack");
+        }
+        for (auto& c : node.children) {
+            self(self, c);
+        }
+    };
+    find_imports(find_imports, ast);
+    out.write((uint32_t)imports.size());
+    for (auto& i : imports) {
+        out.write_string(i);
+    }
+
+    // every fragment, the root first; storage refers to nested ones by index
+    auto fragments = std::vector<CodeFragment*> { root };
+    auto fragment_index = std::unordered_map<CodeFragment*, uint32_t> { { root, 0 } };
+    for (auto i = 0u; i < fragments.size(); i++) {
+        for (auto& value : fragments[i]->storage) {
+            if (value.get_type() == TackType::Pointer && !fragment_index.contains((CodeFragment*)value.pointer())) {
+                fragment_index[(CodeFragment*)value.pointer()] = fragments.size();
+                fragments.emplace_back((CodeFragment*)value.pointer());
+            }
+        }
+    }
+
+    // the globals they use, by module and name
+    struct Global {
+        const std::string* module;
+        const std::string* name;
+        bool is_const;
+    };
+    auto globals_by_id = std::unordered_map<uint16_t, Global> {};
+    for (auto m = modules.begin(); m != modules.end(); m = modules.next(m)) {
+        for (auto& [name, var] : modules.value_at(m)->bindings) {
+            if (var.is_global) {
+                globals_by_id[var.g_id] = { &modules.key_at(m), &name, var.is_const };
+            }
+        }
+    }
+    auto used = std::vector<uint16_t> {};
+    for (auto* f : fragments) {
+        for (auto& ins : f->instructions) {
+            if ((ins.opcode == Opcode::READ_GLOBAL || ins.opcode == Opcode::WRITE_GLOBAL) && std::find(used.begin(), used.end(), ins.u1) == used.end()) {
+                if (!globals_by_id.contains(ins.u1)) {
+                    return;
+                }
+                used.emplace_back(ins.u1);
+            }
+        }
+    }
+    out.write((uint32_t)used.size());
+    for (auto id : used) {
+        auto& g = globals_by_id[id];
+        out.write(id);
+        out.write_string(*g.module == module_name ? "" : *g.module); // empty for the module's own exports
+        out.write_string(*g.name);
+        out.write((uint8_t)g.is_const);
+    }
+
+    out.write((uint32_t)fragments.size());
+    for (auto* f : fragments) {
+        out.write_string(f->name);
+        out.write(f->max_register);
+        out.write_array(f->instructions.data(), (uint32_t)f->instructions.size());
+        out.write_array(f->line_numbers.data(), (uint32_t)f->line_numbers.size());
+        out.write((uint32_t)f->storage.size());
+        for (auto& value : f->storage) {
+            // (is_pointer() and is_string() can be true of numbers)
+            auto type = value.get_type();
+            if (type == TackType::String) {
+                out.write(StorageString);
+                out.write_string(value.string()->data);
+            } else if (type == TackType::Pointer) {
+                out.write(StorageFragment);
+                out.write((uint64_t)fragment_index[(CodeFragment*)value.pointer()]);
+            } else {
+                out.write(StorageValue);
+                out.write(value._i);
+            }
+        }
+        out.write((uint32_t)f->capture_info.size());
+        for (auto& capture : f->capture_info) {
+            out.write_string(capture.name);
+            out.write(capture.source_register);
+            out.write(capture.dest_register);
+        }
+    }
+
+    auto contents_hash = hash_bytes(out.buf.data() + sizeof(CacheHeader), out.buf.size() - sizeof(CacheHeader));
+    std::memcpy(out.buf.data() + offsetof(CacheHeader, contents_hash), &contents_hash, sizeof(contents_hash));
+
+    // written to the side and renamed over the old file, so another process never reads half of it; failing is fine,
+    // the module is just compiled again next time
+    auto path = cache_path(source_path);
+    auto temp = path + ".tmp";
+    auto ec = std::error_code {};
+    if (!bytecode_cache_dir.empty()) {
+        std::filesystem::create_directories(bytecode_cache_dir, ec);
+    }
+    {
+        auto file = std::ofstream(temp, std::ios::binary);
+        if (!file.is_open() || !file.write(out.buf.data(), out.buf.size())) {
+            return;
+        }
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+    }
+}
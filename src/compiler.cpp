@@ -1,7 +1,9 @@
 #include "compiler.h"
 #include "parsing.h"
 #include "interpreter.h"
+#include "optimizer.h"
 
+#include <cmath>
 #include <sstream>
 
 using namespace std::string_literals;
@@ -21,8 +23,12 @@ using namespace std::string_literals;
 // rewrite an instruction with 3 8-bit operands
 #define rewrite(pos, type, _0, _1, _2)  rewrite_ins(pos, Opcode::type, _0, _1, _2);
 
-// rewrite an instruction with 1 u8 operand r and 1 u16 operand u
-#define rewrite_u(pos, type, r, u)      rewrite_u_ins(pos, Opcode::type, r, u);
+// emit / rewrite a jump (JUMPF, JUMPB) by offset instructions
+#define emit_jump(op, offset)           emit_jump_ins(Opcode::op, uint32_t(offset), node);
+#define rewrite_jump(pos, op, offset)   rewrite_jump_ins(pos, Opcode::op, uint32_t(offset), node);
+
+// emit an instruction with 1 u8 operand r and an index in storage, with an EXTEND first if it doesn't fit in u1
+#define emit_storage(op, r, index)      emit_storage_ins(Opcode::op, r, index, node->line_number);
 
 #define label(name)                     auto name = output->instructions.size();
 #define should_allocate(n)
@@ -33,24 +39,59 @@ using namespace std::string_literals;
 
 bool is_small_integer(double d, int16_t& out_si) {
     auto td = trunc(d);
-    if (td == d && td < INT16_MAX && td > INT16_MIN) {
+    if (td == d && !(d == 0 && std::signbit(d)) /* -0 isn't an int16 */ && td < INT16_MAX && td > INT16_MIN) {
         out_si = (int16_t)td;
         return true;
     }
     return false;
 }
 
-uint16_t CodeFragment::store_number(double d) {
-    storage.emplace_back(TackValue::number(d));
-    return (uint16_t)(storage.size() - 1);
+// the registers the variables declared in a function body could take, not counting nested functions
+uint32_t count_variables(const AstNode& node) {
+    auto is_export = !node.children.empty() && node.children[0].data_d != 0;
+    switch (node.type) {
+        case AstType::VarDeclStat:
+        case AstType::ConstDeclStat:
+            return is_export ? 0 : 1 + count_variables(node.children[1]);
+        case AstType::MultiDeclStat:
+            return (is_export ? 0 : (uint32_t)node.children.size() - 1) + count_variables(node.children.back());
+        case AstType::FuncDeclStat:
+            return is_export ? 0 : 1;
+        case AstType::FuncLiteral:
+        case AstType::LazyBlock:
+            return 0;
+        case AstType::ForStat: return 3 + count_variables(node.children[1]) + count_variables(node.children[2]); // and the iterator state
+        case AstType::ForStat2: return 4 + count_variables(node.children[2]) + count_variables(node.children[3]);
+        case AstType::ForStatInt: return 2 + count_variables(node.children[1]) + count_variables(node.children[2]) + count_variables(node.children[3]);
+        default: {
+            auto n = 0u;
+            for (auto& c : node.children) {
+                n += count_variables(c);
+            }
+            return n;
+        }
+    }
+}
+
+uint32_t CodeFragment::store_number(double d) {
+    // reuse the slot if the number is already there, so constant operands (which only have 8 bits) go further;
+    // only those first slots are searched, so big tables of numbers don't take quadratic time
+    auto value = TackValue::number(d);
+    for (auto i = 0u; i < storage.size() && i <= UINT8_MAX; i++) {
+        if (storage[i]._i == value._i) {
+            return i;
+        }
+    }
+    storage.emplace_back(value);
+    return (uint32_t)(storage.size() - 1);
 }
-uint16_t CodeFragment::store_string(TackValue::StringType* str) {
+uint32_t CodeFragment::store_string(TackValue::StringType* str) {
     storage.emplace_back(TackValue::string(str));
-    return (uint16_t)(storage.size() - 1);
+    return (uint32_t)(storage.size() - 1);
 }
-uint16_t CodeFragment::store_fragment(CodeFragment* fragment) {
+uint32_t CodeFragment::store_fragment(CodeFragment* fragment) {
     storage.emplace_back(TackValue::pointer(fragment));
-    return (uint16_t)(storage.size() - 1);
+    return (uint32_t)(storage.size() - 1);
 }
 std::string CodeFragment::str() {
     auto s = std::stringstream {};
@@ -99,8 +140,24 @@ void Compiler::emit_s_ins(Opcode op, uint8_t r0, int16_t s, uint32_t ln) {
 void Compiler::rewrite_ins(uint32_t pos, Opcode op, uint8_t r0, uint8_t r1, uint8_t r2) {
     output->instructions[pos] = Instruction { .opcode = op, .r0 = r0, .u8 = { r1, r2 } };
 }
-void Compiler::rewrite_u_ins(uint32_t pos, Opcode op, uint8_t r0, uint16_t u) {
-    output->instructions[pos] = Instruction { .opcode = op, .r0 = r0, .u1 = u};
+void Compiler::emit_storage_ins(Opcode op, uint8_t r0, uint32_t index, uint32_t ln) {
+    if (index > UINT16_MAX) {
+        emit_u_ins(Opcode::EXTEND, 0, uint16_t(index >> 16), ln);
+    }
+    emit_u_ins(op, r0, uint16_t(index), ln);
+}
+void Compiler::emit_jump_ins(Opcode op, uint32_t offset, const AstNode* node) {
+    if (offset > MAX_JUMP) {
+        compile_error("block too long");
+    }
+    output->instructions.emplace_back(make_jump(op, offset));
+    output->line_numbers.emplace_back(node->line_number);
+}
+void Compiler::rewrite_jump_ins(uint32_t pos, Opcode op, uint32_t offset, const AstNode* node) {
+    if (offset > MAX_JUMP) {
+        compile_error("block too long");
+    }
+    output->instructions[pos] = make_jump(op, offset);
 }
 
 Compiler::VariableContext* Compiler::lookup(const std::string& name) {
@@ -116,6 +173,7 @@ uint8_t Compiler::allocate_register() {
             return (uint8_t)i;
         }
     }
+    auto node = current_node;
     compile_error("Ran out of registers!");
     return 0xff;
 }
@@ -130,6 +188,7 @@ uint8_t Compiler::allocate_register2() {
             return (uint8_t)i;
         }
     }
+    auto node = current_node;
     compile_error("Ran out of registers!");
     return 0xff;
 }
@@ -167,6 +226,54 @@ void Compiler::free_all_registers() {
     }
 }
 
+bool Compiler::should_spill() {
+    if (spill_array == 0xff) {
+        return false;
+    }
+    auto free = 0u;
+    for (auto r : registers) {
+        free += r == RegisterState::FREE;
+    }
+    return free < MIN_FREE_REGISTERS;
+}
+Compiler::VariableContext* Compiler::spill_variable(const AstNode* node, const std::string& binding, uint8_t reg, bool is_const) {
+    // same as bind_name, a variable declared twice in a scope keeps the first binding
+    auto [iter, added] = scopes.back().bindings.try_emplace(binding, VariableContext {
+        .reg = spill_array, .is_const = is_const, .spill = (int32_t)num_spilled, .in_loop = loop_depth > 0 });
+    if (added) {
+        num_spilled++;
+        if (reg != 0xff) {
+            store_spilled(node, &iter->second, reg);
+        }
+    }
+    if (reg != 0xff) {
+        free_register(reg);
+    }
+    return &iter->second;
+}
+void Compiler::store_spilled(const AstNode* node, const VariableContext* var, uint8_t reg) {
+    auto index = allocate_register();
+    auto si = int16_t{0};
+    if (is_small_integer(var->spill, si)) {
+        emit_s(LOAD_I_SN, index, si);
+    } else {
+        emit_storage(LOAD_CONST, index, output->store_number(var->spill));
+    }
+    emit(STORE_ARRAY, reg, var->reg, index);
+    free_register(index);
+}
+uint8_t Compiler::load_spilled(const AstNode* node, const VariableContext* var) {
+    auto out = allocate_register();
+    auto si = int16_t{0};
+    if (is_small_integer(var->spill, si)) {
+        emit_s(LOAD_I_SN, out, si);
+    } else {
+        emit_storage(LOAD_CONST, out, output->store_number(var->spill));
+    }
+    emit(LOAD_ARRAY, out, var->reg, out);
+    return out;
+}
+
 void Compiler::push_scope(ScopeContext* parent_scope, bool is_top_level) {
     scopes.emplace_back(ScopeContext { this, parent_scope, is_top_level });
 }
@@ -177,7 +284,8 @@ void Compiler::pop_scope() {
         // and there's currently no way to know at compile time whether a variable is boxed or not-boxed
         // registers[b.second.reg] = RegisterState::FREE;
         if (b.second.is_capture || b.second.is_mirror) {
-            // HACK: zero out all mirror variables and variables that were captured in this scope
+            // HACK: zero out all mirror variables, and close the boxes of variables that were captured in this scope
+            // (so each iteration of a loop captures a fresh variable)
             // if there;s a loop then READ_CAPTURE will be run again which is a bit inefficient
             emit_z(ZERO_CAPTURE, b.second.reg, 0, 0);
         }
@@ -187,6 +295,11 @@ void Compiler::pop_scope() {
 
 
 void Compiler::compile_func(const AstNode* node, CodeFragment* output, ScopeContext* parent_scope) {
+    if (node->children[1].type == AstType::LazyBlock) {
+        compile_stub(node, output, parent_scope);
+        return;
+    }
+
     // compile function literal
     this->output = output;
     this->node = node;
@@ -200,12 +313,93 @@ void Compiler::compile_func(const AstNode* node, CodeFragment* output, ScopeCont
         // NOTE: impossible to be global
     }
 
+    // if the variables might not all fit in registers, make the spill array up front, so it's there whichever
+    // variables end up in it; its size is only known at the end
+    label(alloc_spill);
+    if (nargs + count_variables(node->children[1]) + MIN_FREE_REGISTERS > MAX_REGISTERS) {
+        spill_array = allocate_register();
+        registers[spill_array] = RegisterState::BOUND;
+        emit_u(ALLOC_SPILL, spill_array, 0);
+    }
+
     child(1);
     pop_scope();
     emit_z(RET, 0, 0, 0);
+    if (num_spilled > UINT16_MAX) {
+        compile_error("too many variables");
+    }
+    if (spill_array != 0xff) {
+        output->instructions[alloc_spill].u1 = (uint16_t)num_spilled;
+    }
+
+    // clean up the bytecode now that every nested function (and what it captures) is known (see optimizer.h)
+    auto variables = RegisterSet {};
+    for (auto r = 0u; r < MAX_REGISTERS; r++) {
+        variables[r] = registers[r] == RegisterState::BOUND;
+    }
+    auto unoptimized = output->instructions.size();
+    optimize(output, variables);
+    if (auto* report = interpreter->get_optimizer_report()) {
+        *report << output->name << ": " << unoptimized << " -> " << output->instructions.size() << " instructions\n";
+    }
 }
 
 
+void Compiler::compile_aggregate(const AstNode* node) {
+    auto& literal = node->children[1];
+    auto free = 0u;
+    for (auto r : registers) {
+        free += r == RegisterState::FREE;
+    }
+    if (free < literal.children.size() + MIN_FREE_REGISTERS) {
+        // the element registers stay bound for the rest of the function, so don't use them up
+        compile(node);
+        return;
+    }
+
+    // evaluate the elements in order, same as ALLOC_ARRAY/ALLOC_OBJECT would, and give each one a register of its own
+    auto aggregate = Aggregate { .is_object = literal.type == AstType::ObjectLiteral };
+    for (auto& elem : literal.children) {
+        auto reg = compile(aggregate.is_object ? &elem.children[1] : &elem);
+        if (registers[reg] == RegisterState::BOUND) {
+            auto new_reg = allocate_register();
+            emit(MOVE, new_reg, reg, 0);
+            reg = new_reg;
+        }
+        registers[reg] = RegisterState::BOUND;
+        aggregate.registers.push_back(reg);
+        if (aggregate.is_object) {
+            aggregate.keys.push_back(elem.children[0].data_s);
+        }
+    }
+
+    auto var = bind_name(node->children[0].data_s, aggregate.registers[0], node->type == AstType::ConstDeclStat);
+    var->aggregate = (int32_t)aggregates.size();
+    aggregates.emplace_back(std::move(aggregate));
+}
+
+uint8_t Compiler::aggregate_element(const AstNode* node) {
+    if ((node->type != AstType::IndexExp && node->type != AstType::AccessExp) || node->children[0].type != AstType::Identifier) {
+        return 0xff;
+    }
+    auto var = lookup(node->children[0].data_s);
+    if (!var || var->aggregate < 0) {
+        return 0xff;
+    }
+    auto& aggregate = aggregates[var->aggregate];
+    if (aggregate.is_object) {
+        for (auto i = 0u; i < aggregate.keys.size(); i++) {
+            if (aggregate.keys[i] == node->children[1].data_s) {
+                return aggregate.registers[i];
+            }
+        }
+    } else if (node->children[1].type == AstType::NumLiteral) {
+        return aggregate.registers[(uint32_t)node->children[1].data_d];
+    }
+    compile_error("bad element access on scalar-replaced variable: " + node->children[0].data_s); // escape analysis should prevent this
+    return 0xff;
+}
+
 Compiler::VariableContext* Compiler::ScopeContext::lookup(const std::string& name) {
     // lookup local
     if (auto iter = bindings.find(name); iter != bindings.end()) {
@@ -217,19 +411,33 @@ Compiler::VariableContext* Compiler::ScopeContext::lookup(const std::string& nam
         if (auto var = parent_scope->lookup(name)) {
             // lookup came from a parent function, so it's a capture (unless global)
             if (is_function_scope && !var->is_global) {
+                // a spilled variable is captured as its spill array, which every iteration of a loop shares
+                if (var->spill >= 0 && var->in_loop) {
+                    compiler->interpreter->error("compile error: can't capture " + name + ", which is declared in a loop in a function with too many variables; line: "s + std::to_string(compiler->current_node->line_number) + "in "s);
+                }
+
                 // create a mirroring local variable (impossible to be global)
                 auto mirror_reg = compiler->allocate_register();
                 auto mirror = compiler->bind_name(name, mirror_reg, var->is_const);
+                mirror->spill = var->spill;
 
-                var->is_capture = true;
+                var->is_capture = var->spill < 0; // the spill array's box is closed when the function returns
                 mirror->is_mirror = true;
 
-                // record necessary capture into mirror variable
-                compiler->output->capture_info.emplace_back(CaptureInfo { .name = name, .source_register = var->reg, .dest_register = mirror_reg });
+                // record necessary capture into mirror variable, unless the function already captures it (from another
+                // scope, or before it was compiled if it's lazy)
+                auto& captures = compiler->output->capture_info;
+                auto index = 0u;
+                while (index < captures.size() && captures[index].name != name) {
+                    index++;
+                }
+                if (index == captures.size()) {
+                    captures.emplace_back(CaptureInfo { .name = name, .source_register = var->reg, .dest_register = mirror_reg });
+                }
 
                 // read into mirror variable
                 // TODO: would be optimal to READ_CAPTURE once per function instead of every scope used
-                compiler->emit_z(READ_CAPTURE, mirror_reg, uint8_t(compiler->output->capture_info.size() - 1), 0);
+                compiler->emit_z(READ_CAPTURE, mirror_reg, uint8_t(index), 0);
 
                 // return the MIRROR variable not the original!
                 return mirror;
@@ -250,8 +458,137 @@ Compiler::VariableContext* Compiler::ScopeContext::lookup(const std::string& nam
     return nullptr;
 }
 
+Compiler::VariableContext* Compiler::ScopeContext::find(const std::string& name) {
+    // same order as lookup()
+    if (auto iter = bindings.find(name); iter != bindings.end()) {
+        return &iter->second;
+    }
+    if (parent_scope) {
+        if (auto var = parent_scope->find(name)) {
+            return var;
+        }
+    }
+    for (auto i : imports) {
+        if (auto v = i->find(name)) {
+            return v;
+        }
+    }
+    return nullptr;
+}
+
+
+uint8_t Compiler::compile_binary(const AstNode* node, Opcode op, Opcode op_k, Opcode op_k_swapped) {
+    // a number literal operand that fits in the 8 bit storage index is read straight from storage,
+    // saving the instruction and the register that would load it
+    auto constant_index = [&](const AstNode& operand) -> int32_t {
+        if (operand.type != AstType::NumLiteral) {
+            return -1;
+        }
+        auto index = output->store_number(operand.data_d);
+        return index <= UINT8_MAX ? index : -1;
+    };
+    if (auto k = constant_index(node->children[1]); k >= 0) {
+        auto in = child(0);
+        auto out = allocate_register();
+        emit_ins(op_k, out, in, (uint8_t)k, node->line_number);
+        free_register(in);
+        return out;
+    }
+    if (op_k_swapped != Opcode::UNKNOWN) {
+        if (auto k = constant_index(node->children[0]); k >= 0) {
+            auto in = child(1);
+            auto out = allocate_register();
+            emit_ins(op_k_swapped, out, in, (uint8_t)k, node->line_number);
+            free_register(in);
+            return out;
+        }
+    }
+
+    auto in1 = child(0);
+    auto in2 = child(1);
+    auto out = allocate_register();
+    emit_ins(op, out, in1, in2, node->line_number);
+    free_register(in1);
+    free_register(in2);
+    return out;
+}
+
+uint8_t Compiler::compile_call(const AstNode* node, uint32_t nresults) {
+    auto nargs = (uint8_t)node->children[1].children.size();
+
+    // calling a small const function by name; find() rather than lookup() so it isn't captured just to be inlined
+    if (auto& callee = node->children[0]; nresults == 1 && callee.type == AstType::Identifier) {
+        auto var = scopes.back().find(callee.data_s);
+        if (var && var->inline_func && var->inline_func->children[0].children.size() == nargs) {
+            return compile_inline(node, var->inline_func);
+        }
+    }
+
+    // compile the arguments first and remember which registers they are in
+    auto arg_regs = std::vector<uint8_t> {};
+    for (auto i = 0u; i < nargs; i++) {
+        arg_regs.emplace_back(compile(&node->children[1].children[i]));
+    }
+    auto func_reg = child(0); // LHS evaluates to function
+
+    // copy arguments to top of stack in sequence
+    auto return_reg = get_end_register();
+    if (return_reg + nresults > MAX_REGISTERS) {
+        compile_error("Ran out of registers!");
+    }
+    for (auto i = 0u; i < nargs; i++) {
+        emit(MOVE, uint8_t(return_reg + i + STACK_FRAME_OVERHEAD), arg_regs[i], 0);
+    }
+
+    if (nresults == 1) {
+        emit(CALL, func_reg, nargs, return_reg);
+    } else {
+        // the function goes in the return register, to make room for the number of results
+        emit(MOVE, return_reg, func_reg, 0);
+        emit(CALL_MULTI, (uint8_t)nresults, nargs, return_reg);
+    }
+
+    // return values go in end-reg onwards so mark them as used
+    for (auto i = 0u; i < nresults; i++) {
+        registers[return_reg + i] = RegisterState::BUSY;
+    }
+    output->max_register = std::max(output->max_register, return_reg + nresults - 1);
+    return return_reg; // return value copied to end register
+}
+
+uint8_t Compiler::compile_inline(const AstNode* node, const AstNode* func) {
+    auto& params = func->children[0].children;
+
+    // evaluate the arguments, same as for a call
+    auto arg_regs = std::vector<uint8_t> {};
+    for (auto& arg : node->children[1].children) {
+        arg_regs.emplace_back(compile(&arg));
+    }
+
+    // the body can only see its parameters; their registers are held as bound while it compiles,
+    // so the first use of a parameter doesn't free it for the next
+    auto arg_states = std::vector<RegisterState> {};
+    push_scope(nullptr);
+    for (auto i = 0u; i < params.size(); i++) {
+        arg_states.emplace_back(registers[arg_regs[i]]);
+        registers[arg_regs[i]] = RegisterState::BOUND; // HACK: like the loop registers, but not a variable
+        scopes.back().bindings.insert_or_assign(params[i].data_s, VariableContext { .reg = arg_regs[i], .is_const = true });
+    }
+    auto out = compile(&func->children[1].children[0].children[0]); // "return <expression>"
+    pop_scope();
+    for (auto i = params.size(); i-- > 0;) {
+        registers[arg_regs[i]] = arg_states[i]; // backwards, in case an argument register is there twice
+    }
+    for (auto reg : arg_regs) {
+        if (reg != out) {
+            free_register(reg);
+        }
+    }
+    return out;
+}
 
 uint8_t Compiler::compile(const AstNode* node) {
+    current_node = node;
     switch (node->type) {
     case AstType::Unknown: {} break;
         // statements
@@ -266,8 +603,13 @@ uint8_t Compiler::compile(const AstNode* node) {
         handle(StatList) {
             should_allocate(0);
             push_scope(&scopes.back());
+            auto* end = node->children.data() + node->children.size();
             for (auto& c : node->children) {
-                compile(&c);
+                if (can_scalar_replace(&c, &c + 1, end)) {
+                    compile_aggregate(&c);
+                } else {
+                    compile(&c);
+                }
             }
             pop_scope();
             free_all_registers();
@@ -280,13 +622,17 @@ uint8_t Compiler::compile(const AstNode* node) {
             if (is_export) {
                 auto var = bind_export(node->children[0].data_s, output->name, true);
                 emit_u(WRITE_GLOBAL, reg, var->g_id);
+            } else if (should_spill()) {
+                spill_variable(node, node->children[0].data_s, reg, true);
             } else {
                 if (registers[reg] == RegisterState::BOUND) {
                     auto new_reg = allocate_register();
                     emit(MOVE, new_reg, reg, 0);
-                    bind_name(node->children[0].data_s, new_reg, true);
-                } else {
-                    bind_name(node->children[0].data_s, reg, true);
+                    reg = new_reg;
+                }
+                auto var = bind_name(node->children[0].data_s, reg, true);
+                if (var->reg == reg && node->children[1].type == AstType::FuncLiteral && can_inline(&node->children[1])) {
+                    var->inline_func = &node->children[1];
                 }
             }
             return 0xff;
@@ -298,6 +644,8 @@ uint8_t Compiler::compile(const AstNode* node) {
             if (is_export) {
                 auto var = bind_export(node->children[0].data_s, output->name, false);
                 emit_u(WRITE_GLOBAL, reg, var->g_id);
+            } else if (should_spill()) {
+                spill_variable(node, node->children[0].data_s, reg, false);
             } else {
                 if (registers[reg] == RegisterState::BOUND) {
                     // if reg was already bound, bind to a new register and MOVE to it
@@ -323,29 +671,90 @@ uint8_t Compiler::compile(const AstNode* node) {
             auto index = output->store_fragment(func);
             
             /* interleaved from ConstDeclStat */ auto is_export = node->children[0].data_d;
-            /* interleaved from ConstDeclStat */ auto var = is_export ? bind_export(ident, output->name, true) : bind_name(ident, out, true);
+            /* interleaved from ConstDeclStat */ auto var = is_export ? bind_export(ident, output->name, true)
+            /* interleaved from ConstDeclStat */     : should_spill() ? spill_variable(node, ident, 0xff, true) : bind_name(ident, out, true);
+            if (!is_export && var->reg == out && can_inline(&node->children[1])) {
+                var->inline_func = &node->children[1];
+            }
             
             auto compiler = Compiler { .interpreter = interpreter };
             compiler.compile_func(&node->children[1], func, &scopes.back());
-            emit_u(ALLOC_FUNC, out, index);
+            emit_storage(ALLOC_FUNC, out, index);
             
             /* interleaved from ConstDeclStat */ if (is_export) {
             /* interleaved from ConstDeclStat */    emit_u(WRITE_GLOBAL, out, var->g_id);
+            /* interleaved from ConstDeclStat */ } else if (var->spill >= 0) {
+            /* interleaved from ConstDeclStat */    store_spilled(node, var, out);
+            /* interleaved from ConstDeclStat */    free_register(out);
             /* interleaved from ConstDeclStat */ }
 
             return 0xff;
         }
+        handle(MultiDeclStat) {
+            should_allocate(0);
+            auto nvars = (uint32_t)node->children.size() - 1;
+            auto& rhs = node->children.back();
+            auto is_const = node->data_d != 0;
+            auto is_export = node->children[0].data_d != 0;
+            if (nvars > MAX_RESULTS) {
+                compile_error("too many variables in declaration");
+            }
+
+            // a call fills all the variables; anything else just the first, and the rest are null
+            auto regs = std::vector<uint8_t> {};
+            if (rhs.type == AstType::CallExp) {
+                auto first = compile_call(&rhs, nvars);
+                for (auto i = 0u; i < nvars; i++) {
+                    regs.emplace_back(uint8_t(first + i));
+                }
+            } else {
+                auto reg = compile(&rhs);
+                if (registers[reg] == RegisterState::BOUND) {
+                    auto new_reg = allocate_register();
+                    emit(MOVE, new_reg, reg, 0);
+                    reg = new_reg;
+                }
+                regs.emplace_back(reg);
+                for (auto i = 1u; i < nvars; i++) {
+                    regs.emplace_back(allocate_register());
+                    emit(LOAD_I_NULL, regs.back(), 0, 0);
+                }
+            }
+
+            for (auto i = 0u; i < nvars; i++) {
+                auto& name = node->children[i].data_s;
+                if (is_export) {
+                    auto var = bind_export(name, output->name, is_const);
+                    emit_u(WRITE_GLOBAL, regs[i], var->g_id);
+                } else if (should_spill()) {
+                    spill_variable(node, name, regs[i], is_const);
+                } else {
+                    bind_name(name, regs[i], is_const);
+                }
+            }
+            return 0xff;
+        }
         handle(AssignStat) {
             should_allocate(0);
             auto source_reg = child(1);
+            label(source_end);
             auto& lhs = node->children[0];
             if (lhs.type == AstType::Identifier) {
                 if (auto var = lookup(node->children[0].data_s)) {
                     if (var->is_const) {
                         compile_error("can't reassign const variable");
                     } else {
+                        auto& rhs = node->children[1];
+                        auto is_literal = rhs.type == AstType::NumLiteral || rhs.type == AstType::BoolLiteral
+                            || rhs.type == AstType::NullLiteral || rhs.type == AstType::StringLiteral;
                         if (var->is_global) {
                             emit_u(WRITE_GLOBAL, source_reg, var->g_id);
+                        } else if (var->spill >= 0) {
+                            store_spilled(node, var, source_reg);
+                        } else if (is_literal && output->instructions.size() == source_end) {
+                            // a literal is a single load instruction; load it straight into the variable instead
+                            // (unless the lookup had to capture the variable first)
+                            output->instructions.back().r0 = var->reg;
                         } else {
                             emit(MOVE, var->reg, source_reg, 0);
                         }
@@ -353,6 +762,8 @@ uint8_t Compiler::compile(const AstNode* node) {
                 } else {
                     compile_error("can't find variable: " + node->children[0].data_s);
                 }
+            } else if (auto element_reg = aggregate_element(&lhs); element_reg != 0xff) {
+                emit(MOVE, element_reg, source_reg, 0);
             } else if (lhs.type == AstType::IndexExp) {
                 auto array_reg = compile(&lhs.children[0]);
                 auto index_reg = compile(&lhs.children[1]);
@@ -365,7 +776,7 @@ uint8_t Compiler::compile(const AstNode* node) {
                 auto key_reg = allocate_register();
                 auto key = interpreter->intern_string(lhs.children[1].data_s.c_str());
                 auto index = output->store_string(key);
-                emit_u(LOAD_CONST, key_reg, index);
+                emit_storage(LOAD_CONST, key_reg, index);
                 emit(STORE_OBJECT, source_reg, obj_reg, key_reg);
                 free_register(obj_reg);
                 free_register(key_reg);
@@ -390,24 +801,34 @@ uint8_t Compiler::compile(const AstNode* node) {
                 child(2); // else body
                 label(endelse);
 
-                rewrite_u(skip_if,   JUMPF, 0, uint16_t((skip_else+1) - skip_if));
-                rewrite_u(skip_else, JUMPF, 0, uint16_t(endelse - skip_else));
+                rewrite_jump(skip_if, JUMPF, (skip_else+1) - skip_if);
+                rewrite_jump(skip_else, JUMPF, endelse - skip_else);
             } else {
-                rewrite_u(skip_if, JUMPF, 0, uint16_t(endif - skip_if));
+                rewrite_jump(skip_if, JUMPF, endif - skip_if);
             }
             return 0xff;
         }
         handle(WhileStat) {
-            label(condeval);
+            // the condition is tested once up front and then again at the bottom (so it's compiled twice), so the top
+            // of the block is only reached if the loop runs (see ForStatInt)
             auto cond_reg = child(0);
             emit(CONDSKIP, cond_reg, 0, 0);
             free_register(cond_reg);
             label(skip_loop);
             emit(JUMPF, 0, 0, 0);
+            label(loop_top);
+            loop_depth++;
             child(1); // block
-            label(jumpback);
-            emit_u(JUMPB, 0, uint16_t(jumpback - condeval));
-            rewrite_u(skip_loop, JUMPF, 0, uint16_t((jumpback + 1) - skip_loop));
+            loop_depth--;
+            cond_reg = child(0);
+            emit(CONDSKIP, cond_reg, 0, 0);
+            free_register(cond_reg);
+            label(exit_loop);
+            emit(JUMPF, 0, 0, 0);
+            label(loop_bottom);
+            emit_jump(JUMPB, loop_bottom - loop_top);
+            rewrite_jump(skip_loop, JUMPF, (loop_bottom + 1) - skip_loop);
+            rewrite_jump(exit_loop, JUMPF, (loop_bottom + 1) - exit_loop);
             return 0xff;
         }
         handle(ForStat) {
@@ -427,12 +848,14 @@ uint8_t Compiler::compile(const AstNode* node) {
             emit(FOR_ITER, reg_ptr, reg_iter, reg_var);
             label(skip_loop);
             emit(JUMPF, 0, 0, 0);
+            loop_depth++;
             child(2); // block
+            loop_depth--;
             label(loop_bottom);
             emit(FOR_ITER_NEXT, reg_ptr, reg_iter, 0);
 
-            emit_u(JUMPB, 0, uint16_t((loop_bottom + 1) - forloop));
-            rewrite_u(skip_loop, JUMPF, 0, uint16_t((loop_bottom + 2) - skip_loop));
+            emit_jump(JUMPB, (loop_bottom + 1) - forloop);
+            rewrite_jump(skip_loop, JUMPF, (loop_bottom + 2) - skip_loop);
             pop_scope();
             registers[reg_iter] = reg_iter_state;
             registers[reg_ptr] = reg_ptr_state;
@@ -458,12 +881,14 @@ uint8_t Compiler::compile(const AstNode* node) {
             emit(FOR_ITER2, reg_ptr, reg_iter, r1);
             label(skip_loop);
             emit(JUMPF, 0, 0, 0);
+            loop_depth++;
             child(3);
+            loop_depth--;
             label(loop_bottom);
             emit(FOR_ITER_NEXT, reg_ptr, reg_iter, 0);
 
-            emit_u(JUMPB, 0, uint16_t((loop_bottom + 1) - forloop));
-            rewrite_u(skip_loop, JUMPF, 0, uint16_t((loop_bottom + 2) - skip_loop));
+            emit_jump(JUMPB, (loop_bottom + 1) - forloop);
+            rewrite_jump(skip_loop, JUMPF, (loop_bottom + 2) - skip_loop);
             pop_scope();
             registers[reg_iter] = reg_iter_state;
             registers[reg_ptr] = reg_ptr_state;
@@ -477,23 +902,49 @@ uint8_t Compiler::compile(const AstNode* node) {
             auto reg_b_state = registers[reg_b];
             registers[reg_b] = RegisterState::BOUND; // HACK: the block might try and free this register
             bind_name(ident, reg_a, false);
-            label(forloop);
-            
+            find_in_range_indexes(node, in_range_indexes);
+
+            // the loop is tested once up front and then at the bottom, so the top of the block is only reached
+            // if the loop runs, and code that's the same every iteration can go there (see hoist_loop_invariants)
             emit(FOR_INT, reg_a, reg_b, 0);
             label(skip_loop);
             emit(JUMPF, 0, 0, 0);
+            label(loop_top);
+            loop_depth++;
             child(3); // block
-            label(loop_bottom);
+            loop_depth--;
             emit(INCREMENT, reg_a, 0, 0);
-
-            emit_u(JUMPB, 0, uint16_t((loop_bottom + 1) - forloop));
-            rewrite_u(skip_loop, JUMPF, 0, uint16_t((loop_bottom + 2) - skip_loop));
+            emit(FOR_INT, reg_a, reg_b, 0);
+            label(exit_loop);
+            emit(JUMPF, 0, 0, 0);
+            label(loop_bottom);
+            emit_jump(JUMPB, loop_bottom - loop_top);
+            rewrite_jump(skip_loop, JUMPF, (loop_bottom + 1) - skip_loop);
+            rewrite_jump(exit_loop, JUMPF, (loop_bottom + 1) - exit_loop);
             pop_scope();
             registers[reg_b] = reg_b_state; // HACK
             return 0xff;
         }
         handle(ReturnStat) {
-            if (node->children.size()) {
+            if (node->children.size() > 1) {
+                if (node->children.size() > MAX_RESULTS) {
+                    compile_error("too many return values");
+                }
+                // RET takes several values from consecutive registers
+                auto value_regs = std::vector<uint8_t> {};
+                for (auto& c : node->children) {
+                    value_regs.emplace_back(compile(&c));
+                }
+                auto first = get_end_register();
+                if (first + value_regs.size() > MAX_REGISTERS) {
+                    compile_error("Ran out of registers!");
+                }
+                for (auto i = 0u; i < value_regs.size(); i++) {
+                    emit(MOVE, uint8_t(first + i), value_regs[i], 0);
+                }
+                output->max_register = std::max(output->max_register, uint32_t(first + value_regs.size() - 1));
+                emit(RET, 1, first, (uint8_t)value_regs.size());
+            } else if (node->children.size()) {
                 auto return_register = child(0);
                 if (return_register == 0xff) {
                     compile_error("return value incorrect register");
@@ -510,10 +961,15 @@ uint8_t Compiler::compile(const AstNode* node) {
         handle(Identifier) {
             should_allocate(0);
             if (auto v = lookup(node->data_s)) {
+                if (v->aggregate >= 0) {
+                    compile_error("scalar-replaced variable used as a value: " + node->data_s); // escape analysis should prevent this
+                }
                 if (v->is_global) {
                     auto reg = allocate_register();
                     emit_u(READ_GLOBAL, reg, v->g_id);
                     return reg;
+                } else if (v->spill >= 0) {
+                    return load_spilled(node, v);
                 } else {
                     return v->reg;
                 }
@@ -551,58 +1007,22 @@ uint8_t Compiler::compile(const AstNode* node) {
         }
 
         handle(EqExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(EQUAL, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::EQUAL, Opcode::EQUALK, Opcode::EQUALK);
         }
         handle(NotEqExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(NEQUAL, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::NEQUAL, Opcode::NEQUALK, Opcode::NEQUALK);
         }
         handle(LessExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(LESS, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::LESS, Opcode::LESSK, Opcode::GREATERK);
         }
         handle(GreaterExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(GREATER, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::GREATER, Opcode::GREATERK, Opcode::LESSK);
         }
         handle(LessEqExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(LESSEQ, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::LESSEQ, Opcode::LESSEQK, Opcode::GREATEREQK);
         }
         handle(GreaterEqExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(GREATEREQ, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::GREATEREQ, Opcode::GREATEREQK, Opcode::LESSEQK);
         }
         
         // handle(BitOrExp)
@@ -628,49 +1048,19 @@ uint8_t Compiler::compile(const AstNode* node) {
         }
         
         handle(AddExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(ADD, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::ADD, Opcode::ADDK);
         }
         handle(SubExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(SUB, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::SUB, Opcode::SUBK);
         }
         handle(MulExp) { // 1 out
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(MUL, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::MUL, Opcode::MULK, Opcode::MULK);
         }
         handle(DivExp) { // 1 out
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(DIV, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::DIV, Opcode::DIVK);
         }
         handle(ModExp) {
-            auto in1 = child(0);
-            auto in2 = child(1);
-            auto out = allocate_register();
-            emit(MOD, out, in1, in2);
-            free_register(in1);
-            free_register(in2);
-            return out;
+            return compile_binary(node, Opcode::MOD, Opcode::MODK);
         }
         handle(PowExp) {
             auto in1 = child(0);
@@ -704,6 +1094,13 @@ uint8_t Compiler::compile(const AstNode* node) {
             return out;
         }
         handle(LenExp) {
+            if (auto& arg = node->children[0]; arg.type == AstType::Identifier) {
+                if (auto v = lookup(arg.data_s); v && v->aggregate >= 0) {
+                    auto out = allocate_register();
+                    emit_s(LOAD_I_SN, out, (int16_t)aggregates[v->aggregate].registers.size());
+                    return out;
+                }
+            }
             auto in = child(0);
             auto out = allocate_register();
             emit(LEN, out, in, 0);
@@ -720,7 +1117,7 @@ uint8_t Compiler::compile(const AstNode* node) {
                 emit_s(LOAD_I_SN, out, si);
             } else {
                 auto index = output->store_number(n);
-                emit_u(LOAD_CONST, out, index);
+                emit_storage(LOAD_CONST, out, index);
             }
             return out;
         }
@@ -741,7 +1138,7 @@ uint8_t Compiler::compile(const AstNode* node) {
             auto out = allocate_register();
             auto str = interpreter->intern_string(node->data_s.c_str());
             auto index = output->store_string(str);
-            emit_u(LOAD_CONST, out, index);
+            emit_storage(LOAD_CONST, out, index);
             return out;
         }
         handle(FuncLiteral) {
@@ -757,94 +1154,118 @@ uint8_t Compiler::compile(const AstNode* node) {
             compiler.compile_func(node, func, &scopes.back());
 
             // allocate new closure into new register
-            emit_u(ALLOC_FUNC, out, index);
+            emit_storage(ALLOC_FUNC, out, index);
 
             return out;
         }
 
         handle(ArrayLiteral) {
             auto array_reg = allocate_register();
-            auto n_elems = (uint8_t)node->children.size();
+            auto n_elems = (uint32_t)node->children.size();
+            auto n_first = std::min(n_elems, MAX_LITERAL_ELEMENTS); // the rest are appended one at a time
             auto elem_regs = std::vector<uint8_t>{};
-            for (auto n = 0; n < n_elems; n++) {
+            for (auto n = 0u; n < n_first; n++) {
                 auto r = child(n);
                 elem_regs.emplace_back(r);
             }
 
             auto end_reg = get_end_register();
-            for (auto n = 0; n < n_elems; n++) {
+            if (end_reg + n_first > MAX_REGISTERS) {
+                compile_error("Ran out of registers!");
+            }
+            for (auto n = 0u; n < n_first; n++) {
                 emit(MOVE, uint8_t(end_reg + n), elem_regs[n], 0);
             }
+            if (n_first) {
+                output->max_register = std::max(output->max_register, end_reg + n_first - 1);
+            }
 
             // TODO: inefficient use of registers
             // would be better to have a "target register" approach when evaluating expressions
             // and then MOVE can be emitted for variable reads, everything else can be inlined
-            emit(ALLOC_ARRAY, array_reg, n_elems, end_reg);
+            emit(ALLOC_ARRAY, array_reg, (uint8_t)n_first, end_reg);
+            for (auto r : elem_regs) {
+                free_register(r);
+            }
+            for (auto n = n_first; n < n_elems; n++) {
+                auto r = child(n);
+                emit(SHL, r, array_reg, r); // r0 gets the appended value, which r already is
+                free_register(r);
+            }
             return array_reg;
         }
         handle(ObjectLiteral) {
             auto obj_reg = allocate_register();
-            auto n_elems = (uint8_t)node->children.size();
-            auto key_indices = std::vector<uint8_t>{};
+            auto n_elems = (uint32_t)node->children.size();
+            auto n_first = std::min(n_elems, MAX_LITERAL_ELEMENTS); // the rest are stored one at a time
+            auto key_indices = std::vector<uint32_t>{};
             auto val_regs = std::vector<uint8_t>{};
-            for (auto n = 0; n < n_elems; n++) {
+            for (auto n = 0u; n < n_elems; n++) {
                 // each child node is an AssignStat
                 auto str = interpreter->intern_string(node->children[n].children[0].data_s.c_str());
-                auto key = output->store_string(str);
-                auto val = compile(&node->children[n].children[1]);
-                key_indices.emplace_back(key);
-                val_regs.emplace_back(val);
+                key_indices.emplace_back(output->store_string(str));
+                if (n < n_first) {
+                    val_regs.emplace_back(compile(&node->children[n].children[1]));
+                }
             }
 
             auto end_reg = get_end_register();
-            for (auto n = 0; n < n_elems; n++) {
-                emit_u(LOAD_CONST, uint8_t(end_reg + n * 2), key_indices[n]);
+            if (end_reg + n_first * 2 > MAX_REGISTERS) {
+                compile_error("Ran out of registers!");
+            }
+            for (auto n = 0u; n < n_first; n++) {
+                emit_storage(LOAD_CONST, uint8_t(end_reg + n * 2), key_indices[n]);
                 emit(MOVE, uint8_t(end_reg + n * 2 + 1), val_regs[n], 0);
             }
+            if (n_first) {
+                output->max_register = std::max(output->max_register, end_reg + n_first * 2 - 1);
+            }
 
-            emit(ALLOC_OBJECT, obj_reg, n_elems, end_reg);
+            emit(ALLOC_OBJECT, obj_reg, (uint8_t)n_first, end_reg);
+            for (auto r : val_regs) {
+                free_register(r);
+            }
+            for (auto n = n_first; n < n_elems; n++) {
+                auto val = compile(&node->children[n].children[1]);
+                auto key = allocate_register();
+                emit_storage(LOAD_CONST, key, key_indices[n]);
+                emit(STORE_OBJECT, val, obj_reg, key);
+                free_register(key);
+                free_register(val);
+            }
             return obj_reg;
         }
         handle(CallExp) {
             should_allocate(1);
-            auto nargs = (uint8_t)node->children[1].children.size();
-
-            // compile the arguments first and remember which registers they are in
-            auto arg_regs = std::vector<uint8_t> {};
-            for (auto i = 0u; i < nargs; i++) {
-                arg_regs.emplace_back(compile(&node->children[1].children[i]));
-            }
-            auto func_reg = child(0); // LHS evaluates to function
-
-            // copy arguments to top of stack in sequence
-            auto return_reg = get_end_register();
-            for (auto i = 0u; i < nargs; i++) {
-                emit(MOVE, uint8_t(return_reg + i + STACK_FRAME_OVERHEAD), arg_regs[i], 0);
-            }
-
-            emit(CALL, func_reg, nargs, return_reg);
-
-            // return value goes in end-reg so mark it as used
-            registers[return_reg] = RegisterState::BUSY;
-            return return_reg; // return value copied to end register
+            return compile_call(node, 1);
         }
         handle(IndexExp) {
+            if (auto element_reg = aggregate_element(node); element_reg != 0xff) {
+                return element_reg;
+            }
             auto arr = child(0);
             auto ind = child(1);
             auto out = allocate_register();
-            emit(LOAD_ARRAY, out, arr, ind);
+            if (in_range_indexes.contains(node)) {
+                emit(LOAD_ARRAY_NUM, out, arr, ind);
+            } else {
+                emit(LOAD_ARRAY, out, arr, ind);
+            }
             free_register(arr);
             free_register(ind);
             return out;
         }
         handle(AccessExp) {
+            if (auto element_reg = aggregate_element(node); element_reg != 0xff) {
+                return element_reg;
+            }
             auto obj = child(0);
 
             // save identifier as string and load it
             auto key = allocate_register();
             auto str = interpreter->intern_string(node->children[1].data_s.c_str());
             auto index = output->store_string(str);
-            emit_u(LOAD_CONST, key, index);
+            emit_storage(LOAD_CONST, key, index);
 
             // load from object
             auto out = allocate_register();
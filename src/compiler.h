@@ -4,6 +4,8 @@
 #include <list>
 #include <array>
 #include <vector>
+#include <memory>
+#include <unordered_set>
 
 #include "instructions.h"
 #include "../include/tack.h"
@@ -11,7 +13,12 @@
 static const uint32_t MAX_REGISTERS = 256;
 static const uint32_t STACK_FRAME_OVERHEAD = 3;
 static const uint32_t MAX_STACK = 4096;
-static const uint32_t MIN_GC_ALLOCATIONS = 1024; // min allocations before GC will run; don't make it too small
+static const uint32_t MAX_LITERAL_ELEMENTS = 64; // most elements an array/object literal is created with; any more are added after
+static const uint32_t MAX_SCALAR_ELEMENTS = 8; // largest array/object literal that will be broken up into registers
+static const uint32_t MIN_FREE_REGISTERS = 64; // leave at least this many registers free when breaking up literals or binding variables that could be spilled
+static const uint32_t MAX_RESULTS = 16; // most values a function can return at once ("return a, b"; "let x, y = f()")
+static const uint32_t MAX_INLINE_SIZE = 24; // largest function body (in AST nodes) that will be inlined at its call sites
+static const uint32_t MIN_LAZY_BODY = 128; // shortest function body (in characters) that's compiled on its first call, with lazy compilation on
 
 enum class RegisterState {
     FREE = 0,
@@ -20,24 +27,45 @@ enum class RegisterState {
 };
 
 struct AstNode;
+struct LazyFunction;
 class Interpreter;
 
+// true if the array/object literal in a local variable declaration doesn't escape the statements that follow it,
+// so it can be kept in registers instead of being allocated (see escape.cpp)
+bool can_scalar_replace(const AstNode* decl, const AstNode* rest_begin, const AstNode* rest_end);
+
+// true if calls to the function literal can be replaced with its body, ie. it's a small "return <expression>" that only
+// uses its parameters (see inline.cpp)
+bool can_inline(const AstNode* func);
+
+// add the index expressions a[i] in the body of the loop "for i in 0, #a" that are always in range (see bounds.cpp)
+void find_in_range_indexes(const AstNode* loop, std::unordered_set<const AstNode*>& out);
+
+// evaluate operators on literals, substitute literal consts and drop branches that can never run, in place (see fold.cpp)
+void fold_constants(AstNode& node);
+
 struct CaptureInfo {
-    std::string name; // for debug
+    std::string name; // a function captures each name once
     uint8_t source_register;
     uint8_t dest_register;
 };
 struct CodeFragment {
+    template<typename T> using Vector = std::vector<T, TackAllocator<T>>;
     std::string name;
-    std::vector<Instruction> instructions;
-    std::vector<uint32_t> line_numbers;
-    std::vector<TackValue> storage; // program constant storage goes at the bottom of the stack for now
-    std::vector<CaptureInfo> capture_info;
+    Vector<Instruction> instructions;
+    Vector<uint32_t> line_numbers;
+    Vector<TackValue> storage; // program constant storage goes at the bottom of the stack for now
+    Vector<CaptureInfo> capture_info;
     uint32_t max_register = 0;
+    std::shared_ptr<LazyFunction> lazy; // until the first call, if the body hasn't been compiled (see lazy.cpp)
 
-    uint16_t store_number(double d);
-    uint16_t store_string(TackValue::StringType* str);
-    uint16_t store_fragment(CodeFragment* ptr);
+    // the vectors are allocated from account (see Interpreter::create_fragment)
+    explicit CodeFragment(TackMemoryAccount* account = nullptr)
+        : instructions(account), line_numbers(account), storage(account), capture_info(account) {}
+
+    uint32_t store_number(double d);
+    uint32_t store_string(TackValue::StringType* str);
+    uint32_t store_fragment(CodeFragment* ptr);
     std::string str();
 };
 struct Compiler {
@@ -48,6 +76,16 @@ struct Compiler {
         bool is_capture = false;
         bool is_mirror = false;
         uint16_t g_id = 0;
+        int32_t aggregate = -1; // index into aggregates if the variable holds a scalar-replaced literal
+        int32_t spill = -1; // index in the function's spill array if the variable didn't get a register; reg holds the array
+        bool in_loop = false; // for a spilled variable, whether it was declared inside a loop
+        const AstNode* inline_func = nullptr; // the function literal, if the variable is a const function that can be inlined
+    };
+    // a non-escaping array/object literal, with each element in its own register
+    struct Aggregate {
+        bool is_object = false;
+        std::vector<std::string> keys = {};
+        std::vector<uint8_t> registers = {};
     };
     struct ScopeContext {
         Compiler* compiler;
@@ -59,17 +97,26 @@ struct Compiler {
         // lookup a variable
         // if it lives in a parent function, code will be emitted to capture it
         VariableContext* lookup(const std::string& name);
+        // lookup a variable without capturing it, for what's known about it at compile time
+        VariableContext* find(const std::string& name);
     };
     Interpreter* interpreter = nullptr;
     // root AST node from last compile_func() call
     const AstNode* node = nullptr;
     // current output as of last compile_func() call, included here for convenience
     CodeFragment* output = nullptr;
+    // last node passed to compile(), for the line number of errors that aren't about a particular node
+    const AstNode* current_node = nullptr;
 
     // compiler state
     std::array<RegisterState, MAX_REGISTERS> registers = {};
     std::list<ScopeContext> scopes = {};
     std::vector<CaptureInfo> captures = {};
+    std::vector<Aggregate> aggregates = {};
+    std::unordered_set<const AstNode*> in_range_indexes = {}; // a[i] that can skip the bounds check (see bounds.cpp)
+    uint8_t spill_array = 0xff; // register holding the spill array, if the function has more variables than fit in registers
+    uint32_t num_spilled = 0;
+    uint32_t loop_depth = 0;
 
     // lookup a variable in the current scope stack
     VariableContext* lookup(const std::string& name);
@@ -91,6 +138,14 @@ struct Compiler {
     // free a register if it's not bound
     void free_register(uint8_t reg);
 
+    // a function with too many variables for its registers keeps the ones declared once registers are running out in
+    // an array instead, its spill array; reads and writes are LOAD_ARRAY/STORE_ARRAY, and closures capture the array
+    bool should_spill();
+    // bind a variable to a slot in the spill array, storing reg there unless it's 0xff (the value comes later)
+    VariableContext* spill_variable(const AstNode* node, const std::string& binding, uint8_t reg, bool is_const);
+    void store_spilled(const AstNode* node, const VariableContext* var, uint8_t reg);
+    uint8_t load_spilled(const AstNode* node, const VariableContext* var);
+
     // free all unbound registers
     void free_all_registers();
 
@@ -98,13 +153,30 @@ struct Compiler {
     void pop_scope();
 
     void compile_func(const AstNode* node, CodeFragment* output, ScopeContext* parent_scope = nullptr);
+    // compile a function whose body hasn't been parsed yet (LazyBlock) as a stub that compiles it on the first call,
+    // capturing everything the body might use (see lazy.cpp)
+    void compile_stub(const AstNode* node, CodeFragment* output, ScopeContext* parent_scope);
     uint8_t compile(const AstNode* node);
+    // compile a binary operation, using the constant-operand form op_k if the right operand is a number literal,
+    // or op_k_swapped with the operands swapped if the left one is (UNKNOWN if the operation can't be swapped)
+    uint8_t compile_binary(const AstNode* node, Opcode op, Opcode op_k, Opcode op_k_swapped = Opcode::UNKNOWN);
+    // compile a call whose first nresults results are wanted; they go in consecutive registers starting at the one returned
+    uint8_t compile_call(const AstNode* node, uint32_t nresults);
+    // compile a call to a function that can be inlined as its body, with the parameters bound to the arguments
+    uint8_t compile_inline(const AstNode* node, const AstNode* func);
+
+    // declare a variable holding a non-escaping literal, putting each element in its own register
+    void compile_aggregate(const AstNode* node);
+    // if node is an element access (p[0], p.x) on a scalar-replaced variable, get the register holding the element
+    uint8_t aggregate_element(const AstNode* node);
 
     void emit_ins(Opcode op, uint8_t r0, uint8_t r1, uint8_t r2, uint32_t ln = 0);
     void emit_u_ins(Opcode op, uint8_t r0, uint16_t u, uint32_t ln = 0);
     void emit_s_ins(Opcode op, uint8_t r0, int16_t s, uint32_t ln = 0);
     void rewrite_ins(uint32_t pos, Opcode op, uint8_t r0, uint8_t r1, uint8_t r2);
-    void rewrite_u_ins(uint32_t pos, Opcode op, uint8_t r0, uint16_t u);
+    void emit_storage_ins(Opcode op, uint8_t r0, uint32_t index, uint32_t ln = 0);
+    void emit_jump_ins(Opcode op, uint32_t offset, const AstNode* node);
+    void rewrite_jump_ins(uint32_t pos, Opcode op, uint32_t offset, const AstNode* node);
 };
 
 
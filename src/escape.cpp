@@ -0,0 +1,139 @@
+#include "compiler.h"
+#include "parsing.h"
+
+#include <unordered_set>
+
+// Escape analysis for array and object literals
+// A literal bound to a local variable doesn't escape if, for the rest of the block, the variable is only used to read or
+// write its elements with a constant index or key (p[0], p.x, p[1] = y, p.x = y) or to take the length of an array (#p).
+// Then the literal never has to exist as an actual heap value; the compiler keeps each element in its own register instead.
+// Anything else (passing it to a function, returning it, comparing it, capturing it in a closure, reassigning the
+// variable, etc) counts as an escape and the literal is allocated as usual.
+
+namespace {
+
+struct EscapeAnalysis {
+    const std::string& name;
+    const AstNode& literal;
+    bool escaped = false;
+
+    bool is_variable(const AstNode& node) const {
+        return node.type == AstType::Identifier && node.data_s == name;
+    }
+    bool is_element(const AstNode& index) const {
+        if (literal.type == AstType::ArrayLiteral) {
+            return index.type == AstType::NumLiteral && index.data_d >= 0 && index.data_d < literal.children.size()
+                && index.data_d == (double)(uint32_t)index.data_d;
+        }
+        for (auto& field : literal.children) {
+            if (field.children[0].data_s == index.data_s) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void visit(const AstNode& node, bool in_function) {
+        if (escaped) {
+            return;
+        }
+        switch (node.type) {
+            case AstType::Identifier:
+                escaped = node.data_s == name;
+                return;
+            case AstType::ImportStat:
+                return;
+
+            // a new variable with the same name would hide this one; not worth tracking, so just give up
+            case AstType::ConstDeclStat:
+            case AstType::VarDeclStat:
+            case AstType::FuncDeclStat:
+            case AstType::ForStat:
+            case AstType::ForStatInt:
+                escaped = node.children[0].data_s == name;
+                for (auto i = 1u; i < node.children.size(); i++) {
+                    visit(node.children[i], in_function);
+                }
+                return;
+            case AstType::ForStat2:
+                escaped = node.children[0].data_s == name || node.children[1].data_s == name;
+                for (auto i = 2u; i < node.children.size(); i++) {
+                    visit(node.children[i], in_function);
+                }
+                return;
+            case AstType::ParamDef:
+                for (auto& param : node.children) {
+                    escaped = escaped || param.data_s == name;
+                }
+                return;
+
+            // any mention of the variable inside a function would capture it
+            case AstType::FuncLiteral:
+                for (auto& c : node.children) {
+                    visit(c, true);
+                }
+                return;
+
+            // element access with a constant index/key doesn't escape
+            case AstType::IndexExp:
+                if (!in_function && is_variable(node.children[0]) && literal.type == AstType::ArrayLiteral && is_element(node.children[1])) {
+                    return;
+                }
+                visit(node.children[0], in_function);
+                visit(node.children[1], in_function);
+                return;
+            case AstType::AccessExp:
+                if (!in_function && is_variable(node.children[0]) && literal.type == AstType::ObjectLiteral && is_element(node.children[1])) {
+                    return;
+                }
+                visit(node.children[0], in_function); // children[1] is the key, not a variable
+                return;
+            case AstType::LenExp:
+                if (!in_function && is_variable(node.children[0]) && literal.type == AstType::ArrayLiteral) {
+                    return;
+                }
+                visit(node.children[0], in_function);
+                return;
+            case AstType::ObjectLiteral:
+                for (auto& field : node.children) {
+                    visit(field.children[1], in_function); // field.children[0] is the key
+                }
+                return;
+
+            default:
+                for (auto& c : node.children) {
+                    visit(c, in_function);
+                }
+                return;
+        }
+    }
+};
+
+}
+
+bool can_scalar_replace(const AstNode* decl, const AstNode* rest_begin, const AstNode* rest_end) {
+    if ((decl->type != AstType::ConstDeclStat && decl->type != AstType::VarDeclStat) || decl->children[0].data_d) {
+        return false; // not a local variable
+    }
+    auto& literal = decl->children[1];
+    if (literal.type != AstType::ArrayLiteral && literal.type != AstType::ObjectLiteral) {
+        return false;
+    }
+    if (literal.children.empty() || literal.children.size() > MAX_SCALAR_ELEMENTS) {
+        return false;
+    }
+    if (literal.type == AstType::ObjectLiteral) {
+        auto keys = std::unordered_set<std::string> {};
+        for (auto& field : literal.children) {
+            if (!keys.insert(field.children[0].data_s).second) {
+                return false; // duplicate keys
+            }
+        }
+    }
+
+    auto analysis = EscapeAnalysis { .name = decl->children[0].data_s, .literal = literal };
+    for (auto* stat = rest_begin; stat != rest_end && !analysis.escaped; stat++) {
+        analysis.visit(*stat, false);
+    }
+    return !analysis.escaped;
+}
@@ -0,0 +1,261 @@
+#include "compiler.h"
+#include "parsing.h"
+
+#include <cmath>
+#include <unordered_map>
+
+// Constant folding for the AST, run on each module between parsing and compiling
+// - operators whose operands are all literals are evaluated (1 + 2, "a" + "b", 2 ** 8 < 300, !true, #"abc")
+// - a const declared with a literal value is substituted into the statements after it (const N = 16; N - 4 -> 12)
+// - if/while statements with a literal condition lose the branch that can never run
+// Only operations that would succeed at runtime are folded, so type errors (1 + "a") still happen at runtime, with
+// the same message; same for anything whose result depends on more than the literal values (NaN, out of range shifts)
+
+namespace {
+
+bool is_literal(const AstNode& node) {
+    return node.type == AstType::NumLiteral || node.type == AstType::BoolLiteral
+        || node.type == AstType::NullLiteral || node.type == AstType::StringLiteral;
+}
+
+// same as TackValue::get_truthy
+bool truthy(const AstNode& node) {
+    switch (node.type) {
+        case AstType::NumLiteral: return node.data_d != 0.0;
+        case AstType::BoolLiteral: return node.data_d != 0.0;
+        case AstType::NullLiteral: return false;
+        default: return true;
+    }
+}
+
+// same as TackValue::operator==: numbers and strings by value, bools by value, different types never equal
+bool equal(const AstNode& a, const AstNode& b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    return a.type == AstType::StringLiteral ? a.data_s == b.data_s : a.data_d == b.data_d;
+}
+
+// a uint32 shift operand that the runtime would treat the same way
+bool is_shift_operand(double d, double limit) {
+    return d >= 0 && d < limit && d == trunc(d);
+}
+
+// literal consts visible at the current point, by name
+using Constants = std::unordered_map<std::string, AstNode>;
+
+struct ConstantFolder {
+    // replace node with a literal, keeping the line number for errors further up
+    void replace(AstNode& node, AstNode literal) {
+        literal.line_number = node.line_number;
+        node = std::move(literal);
+    }
+    void replace_number(AstNode& node, double d) {
+        if (!std::isnan(d)) { // NaN doesn't survive being a literal the same way it does a runtime value
+            replace(node, AstNode(d));
+        }
+    }
+    void replace_string(AstNode& node, std::string s) {
+        replace(node, AstNode(AstType::StringLiteral, s));
+    }
+
+    void fold_binary(AstNode& node) {
+        auto& l = node.children[0];
+        auto& r = node.children[1];
+        if (!is_literal(l) || !is_literal(r)) {
+            return;
+        }
+        auto numbers = l.type == AstType::NumLiteral && r.type == AstType::NumLiteral;
+        auto a = l.data_d;
+        auto b = r.data_d;
+        switch (node.type) {
+            case AstType::OrExp: replace(node, AstNode(truthy(l) || truthy(r))); return;
+            case AstType::AndExp: replace(node, AstNode(truthy(l) && truthy(r))); return;
+            case AstType::EqExp: replace(node, AstNode(equal(l, r))); return;
+            case AstType::NotEqExp: replace(node, AstNode(!equal(l, r))); return;
+            case AstType::AddExp:
+                if (l.type == AstType::StringLiteral && r.type == AstType::StringLiteral) {
+                    replace_string(node, l.data_s + r.data_s);
+                    return;
+                }
+                break;
+            default: break;
+        }
+        if (!numbers) {
+            return;
+        }
+        switch (node.type) {
+            case AstType::LessExp: replace(node, AstNode(a < b)); return;
+            case AstType::GreaterExp: replace(node, AstNode(a > b)); return;
+            case AstType::LessEqExp: replace(node, AstNode(a <= b)); return;
+            case AstType::GreaterEqExp: replace(node, AstNode(a >= b)); return;
+            case AstType::AddExp: replace_number(node, a + b); return;
+            case AstType::SubExp: replace_number(node, a - b); return;
+            case AstType::MulExp: replace_number(node, a * b); return;
+            case AstType::DivExp: replace_number(node, a / b); return;
+            case AstType::ModExp: replace_number(node, fmod(a, b)); return;
+            case AstType::PowExp: replace_number(node, pow(a, b)); return;
+            case AstType::ShiftLeftExp:
+                if (is_shift_operand(a, 4294967296.0) && is_shift_operand(b, 32)) {
+                    replace_number(node, (uint32_t)a << (uint32_t)b);
+                }
+                return;
+            case AstType::ShiftRightExp:
+                if (is_shift_operand(a, 4294967296.0) && is_shift_operand(b, 32)) {
+                    replace_number(node, (uint32_t)a >> (uint32_t)b);
+                }
+                return;
+            default: return;
+        }
+    }
+
+    void fold_unary(AstNode& node) {
+        auto& operand = node.children[0];
+        if (node.type == AstType::NotExp && is_literal(operand)) {
+            replace(node, AstNode(!truthy(operand)));
+        } else if (node.type == AstType::NegateExp && operand.type == AstType::NumLiteral) {
+            replace_number(node, -operand.data_d);
+        } else if (node.type == AstType::LenExp && operand.type == AstType::StringLiteral) {
+            replace_number(node, (double)operand.data_s.size());
+        }
+    }
+
+    // the statements of a block, in order, so each const is only substituted after its declaration
+    void visit_block(AstNode& node, Constants constants) {
+        for (auto& stat : node.children) {
+            visit(stat, constants);
+        }
+    }
+
+    void visit(AstNode& node, Constants& constants) {
+        switch (node.type) {
+            case AstType::Identifier:
+                if (auto c = constants.find(node.data_s); c != constants.end()) {
+                    replace(node, c->second);
+                }
+                return;
+            case AstType::ImportStat:
+            case AstType::ParamDef:
+                return;
+            case AstType::StatList:
+                visit_block(node, constants);
+                return;
+
+            // declarations: the value is evaluated before the name is bound, then the name hides any outer const
+            case AstType::ConstDeclStat:
+                visit(node.children[1], constants);
+                if (is_literal(node.children[1])) {
+                    constants.insert_or_assign(node.children[0].data_s, node.children[1]);
+                } else {
+                    constants.erase(node.children[0].data_s);
+                }
+                return;
+            case AstType::VarDeclStat:
+                visit(node.children[1], constants);
+                constants.erase(node.children[0].data_s);
+                return;
+            case AstType::MultiDeclStat:
+                visit(node.children.back(), constants);
+                for (auto i = 0u; i + 1 < node.children.size(); i++) {
+                    constants.erase(node.children[i].data_s);
+                }
+                return;
+            case AstType::FuncDeclStat:
+                constants.erase(node.children[0].data_s); // bound before the body so it can call itself
+                visit(node.children[1], constants);
+                return;
+            case AstType::FuncLiteral: {
+                auto inner = constants;
+                for (auto& param : node.children[0].children) {
+                    inner.erase(param.data_s);
+                }
+                if (node.children[1].type == AstType::LazyBlock) {
+                    // not parsed yet: keep the consts it uses, to substitute when it is (see lazy.cpp)
+                    auto& body = node.children[1];
+                    for (auto i = 0u, n = (uint32_t)body.children.size(); i < n; i++) {
+                        if (auto c = inner.find(body.children[i].data_s); c != inner.end()) {
+                            body.children.emplace_back(AstType::ConstDeclStat, AstNode(AstType::Identifier, c->first), c->second);
+                        }
+                    }
+                    return;
+                }
+                visit(node.children[1], inner);
+                return;
+            }
+
+            // loop variables are only in scope in the loop
+            case AstType::ForStat:
+            case AstType::ForStatInt:
+            case AstType::ForStat2: {
+                auto first_exp = node.type == AstType::ForStat2 ? 2u : 1u;
+                for (auto i = first_exp; i + 1 < node.children.size(); i++) {
+                    visit(node.children[i], constants);
+                }
+                auto inner = constants;
+                for (auto i = 0u; i < first_exp; i++) {
+                    inner.erase(node.children[i].data_s);
+                }
+                visit(node.children.back(), inner);
+                return;
+            }
+
+            // a const can't be assigned to, but leave the name so the compiler reports it
+            case AstType::AssignStat:
+                visit(node.children[1], constants);
+                if (node.children[0].type != AstType::Identifier) {
+                    visit(node.children[0], constants);
+                }
+                return;
+            case AstType::AccessExp:
+                visit(node.children[0], constants); // children[1] is the key, not a variable
+                return;
+            case AstType::ObjectLiteral:
+                for (auto& field : node.children) {
+                    visit(field.children[1], constants); // field.children[0] is the key
+                }
+                return;
+
+            // branches that can never run
+            case AstType::IfStat:
+                for (auto& c : node.children) {
+                    visit(c, constants);
+                }
+                if (is_literal(node.children[0])) {
+                    if (truthy(node.children[0])) {
+                        replace(node, std::move(node.children[1]));
+                    } else if (node.children.size() == 3) {
+                        replace(node, std::move(node.children[2]));
+                    } else {
+                        replace(node, AstNode(AstType::StatList));
+                    }
+                }
+                return;
+            case AstType::WhileStat:
+                for (auto& c : node.children) {
+                    visit(c, constants);
+                }
+                if (is_literal(node.children[0]) && !truthy(node.children[0])) {
+                    replace(node, AstNode(AstType::StatList));
+                }
+                return;
+
+            default:
+                for (auto& c : node.children) {
+                    visit(c, constants);
+                }
+                if (node.children.size() == 2) {
+                    fold_binary(node);
+                } else if (node.children.size() == 1) {
+                    fold_unary(node);
+                }
+                return;
+        }
+    }
+};
+
+}
+
+void fold_constants(AstNode& node) {
+    auto constants = Constants {};
+    ConstantFolder {}.visit(node, constants);
+}
@@ -1,9 +1,92 @@
 #include "interpreter.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <tuple>
+
 // TODO: proper debug logging / diagnostics / monitoring system
 #define debug(...)
 #define dump(...)
 
+ScratchArena::~ScratchArena() {
+    for (auto& chunk : chunks) {
+        if (host) {
+            host->free(chunk.data, chunk.size, CHUNK_ALIGNMENT);
+        } else {
+            ::operator delete(chunk.data, std::align_val_t(CHUNK_ALIGNMENT));
+        }
+    }
+}
+void* ScratchArena::allocate(size_t size, size_t alignment) {
+    while (current < chunks.size()) {
+        auto& chunk = chunks[current];
+        auto address = ((uintptr_t)chunk.data + used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        auto start = (size_t)(address - (uintptr_t)chunk.data);
+        if (start + size <= chunk.size) {
+            used = start + size;
+            return chunk.data + start;
+        }
+        current++;
+        used = 0;
+    }
+    // chunks are kept across scopes, so a scope that allocates as much as the last one doesn't need any more
+    auto chunk_size = std::max(CHUNK_SIZE, size + alignment);
+    auto* data = host
+        ? host->allocate(chunk_size, CHUNK_ALIGNMENT)
+        : ::operator new(chunk_size, std::align_val_t(CHUNK_ALIGNMENT));
+    chunks.push_back(Chunk { (unsigned char*)data, chunk_size });
+    return allocate(size, alignment);
+}
+void ScratchArena::reset() {
+    current = 0;
+    used = 0;
+}
+
+void GCTrace::start(std::ostream* stream) {
+    stop();
+    out = stream;
+    num_events = 0;
+    if (out) {
+        *out << "[\n";
+    }
+}
+void GCTrace::stop() {
+    if (out) {
+        *out << "\n]\n";
+        out->flush();
+        out = nullptr;
+    }
+}
+void GCTrace::event(const char* name, const char* type, Clock::time_point start, Clock::time_point end,
+    std::initializer_list<std::pair<const char*, double>> args) {
+    // format numbers by hand, so the stream's own formatting settings don't matter (and timestamps keep their precision)
+    char buf[64];
+    auto num = [&](double d) { std::snprintf(buf, sizeof(buf), "%.15g", d); return buf; };
+    auto us = [](Clock::duration d) { return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0; };
+    if (num_events++) {
+        *out << ",\n";
+    }
+    *out << "{\"name\":\"" << name;
+    if (type) {
+        *out << " " << type;
+    }
+    *out << "\",\"cat\":\"gc\",\"ph\":\"X\",\"pid\":1,\"tid\":1";
+    *out << ",\"ts\":" << num(us(start.time_since_epoch()));
+    *out << ",\"dur\":" << num(us(end - start));
+    *out << ",\"args\":{";
+    auto first = true;
+    for (auto& [key, value] : args) {
+        *out << (first ? "" : ",") << "\"" << key << "\":" << num(value);
+        first = false;
+    }
+    *out << "}}";
+}
+
+void Heap::trace_to(std::ostream* stream) {
+    trace.start(stream);
+}
+
 void Heap::gc_state(TackGCState new_state) {
     state = new_state;
 }
@@ -11,80 +94,290 @@ TackGCState Heap::gc_state() const {
     return state;
 }
 
-TackValue::ArrayType* Heap::alloc_array() {
-    alloc_count++;
-    return &arrays.emplace_back();
+Heap::Heap(TackHostAllocator* host) {
+    arrays.payload.host = host;
+    objects.payload.host = host;
+    functions.payload.host = host;
+    boxes.payload.host = host;
+    strings.payload.host = host;
+    weakrefs.payload.host = host;
+    weakmaps.payload.host = host;
+    scratch_arena.host = host;
+    for_each_pool([this](auto& pool) { pool.scratch_payload.host = &scratch_arena; });
+}
+
+TackValue::ArrayType* Heap::alloc_array(uint32_t reserve) {
+    auto* arr = arrays.alloc(decltype(TackValue::ArrayType::data)(arrays.account()));
+    if (arrays.scratch || !arrays.spare_buffers.take(reserve, arr->data)) {
+        arr->data.reserve(reserve);
+    }
+    sampling_point("array", sizeof(*arr) + payload_size(*arr));
+    return arr;
 }
 
 TackValue::ObjectType* Heap::alloc_object() {
-    alloc_count++;
-    return &objects.emplace_back();
+    auto* obj = objects.alloc(TackAllocator<TackValue>(objects.account()));
+    sampling_point("object", sizeof(*obj));
+    return obj;
 }
 
 TackValue::FunctionType* Heap::alloc_function(CodeFragment* code) {
-    alloc_count++;
-    return &functions.emplace_back(TackValue::FunctionType {
-        .code_ptr = (void*)code,
-        .is_cfunction = false,
-        .captures = {}
-    });
+    auto* func = functions.alloc((void*)code, false, (uint32_t)code->capture_info.size(), functions.account());
+    sampling_point("function", sizeof(*func) + payload_size(*func));
+    return func;
 }
 TackValue::FunctionType* Heap::alloc_function(TackValue::CFunctionType cfunction) {
-    alloc_count++;
-    return &functions.emplace_back(TackValue::FunctionType {
-        .code_ptr = (void*)cfunction,
-        .is_cfunction = true,
-        .captures = {}
-    });
+    auto* func = functions.alloc((void*)cfunction, true, 0u, functions.account());
+    sampling_point("function", sizeof(*func));
+    return func;
+}
+
+BoxType* Heap::capture(TackValue* slot) {
+    // the slot almost always belongs to the running function, whose boxes are at the end
+    auto i = open_boxes.size();
+    for (; i > 0 && open_boxes[i - 1]->location >= slot; i--) {
+        if (open_boxes[i - 1]->location == slot) {
+            return open_boxes[i - 1];
+        }
+    }
+    auto* box = boxes.alloc(BoxType { .location = slot, .value = TackValue::null() });
+    sampling_point("box", sizeof(*box));
+    open_boxes.insert(open_boxes.begin() + i, box);
+    return box;
+}
+void Heap::close_box_at(TackValue* slot) {
+    for (auto i = open_boxes.size(); i > 0 && open_boxes[i - 1]->location >= slot; i--) {
+        auto* box = open_boxes[i - 1];
+        if (box->location == slot) {
+            box->value = *slot;
+            box->location = &box->value;
+            open_boxes.erase(open_boxes.begin() + (i - 1));
+            return;
+        }
+    }
+}
+
+TackValue::WeakRefType* Heap::alloc_weakref(TackValue target) {
+    auto* ref = weakrefs.alloc(TackValue::WeakRefType { .target = target });
+    sampling_point("weakref", sizeof(*ref));
+    return ref;
 }
 
-BoxType* Heap::alloc_box(TackValue val) {
-    alloc_count++;
-    return &boxes.emplace_back(BoxType { .value = val });
+TackValue::WeakMapType* Heap::alloc_weakmap() {
+    auto* map = weakmaps.alloc(TackAllocator<TackValue>(weakmaps.account()));
+    sampling_point("weakmap", sizeof(*map));
+    return map;
 }
 
 TackValue::StringType* Heap::alloc_string(const std::string& data) {
-    alloc_count++;
-    return &strings.emplace_back(TackValue::StringType { data });
+    auto* str = strings.alloc(TackValue::StringType { data });
+    auto size = payload_size(*str);
+    strings.payload.bytes += size;
+    strings.payload.allocated += size;
+    sampling_point("string", sizeof(*str) + size);
+    return str;
 }
 
-void gc_visit(TackValue value);
+size_t Heap::alloc_sampling() const {
+    return sample_interval;
+}
+void Heap::alloc_sampling(size_t bytes_per_sample) {
+    sample_interval = bytes_per_sample;
+    samples.clear();
+    next_sample();
+}
+void Heap::next_sample() {
+    // exponentially distributed, so sampling is a Poisson process over the bytes allocated
+    sample_rng ^= sample_rng >> 12;
+    sample_rng ^= sample_rng << 25;
+    sample_rng ^= sample_rng >> 27;
+    auto u = (double)((sample_rng * 0x2545f4914f6cdd1dull) >> 11) / (double)(1ull << 53); // [0, 1)
+    bytes_until_sample = (int64_t)(-std::log(1.0 - u) * (double)sample_interval) + 1;
+}
+void Heap::sample(const char* type, size_t bytes) {
+    // an allocation of this size had probability 1 - e^(-bytes/interval) of being sampled; scale up by the inverse
+    auto weight = 1.0 / (1.0 - std::exp(-(double)bytes / (double)sample_interval));
+    auto& stats = samples[SampleKey { site.code, site.pc, type }];
+    stats.samples++;
+    stats.objects += weight;
+    stats.bytes += weight * (double)bytes;
+    next_sample();
+}
+std::vector<TackAllocProfileEntry> Heap::alloc_profile() const {
+    auto profile = std::vector<TackAllocProfileEntry> {};
+    for (auto& [key, stats] : samples) {
+        auto line = key.code && key.pc < key.code->line_numbers.size() ? key.code->line_numbers[key.pc] : 0;
+        profile.emplace_back(TackAllocProfileEntry {
+            .function = key.code ? key.code->name : "(host)",
+            .line = line,
+            .type = key.type,
+            .samples = stats.samples,
+            .objects = stats.objects,
+            .bytes = stats.bytes
+        });
+    }
+    // the same line can appear at more than one pc
+    std::sort(profile.begin(), profile.end(), [](auto& a, auto& b) {
+        return std::tie(a.function, a.line, a.type) < std::tie(b.function, b.line, b.type);
+    });
+    auto merged = std::vector<TackAllocProfileEntry> {};
+    for (auto& entry : profile) {
+        if (merged.size() && merged.back().function == entry.function && merged.back().line == entry.line && merged.back().type == entry.type) {
+            merged.back().samples += entry.samples;
+            merged.back().objects += entry.objects;
+            merged.back().bytes += entry.bytes;
+        } else {
+            merged.emplace_back(std::move(entry));
+        }
+    }
+    std::sort(merged.begin(), merged.end(), [](auto& a, auto& b) { return a.bytes > b.bytes; });
+    return merged;
+}
 
-void gc_visit(TackValue::StringType* str) {
-    str->marker = true;
+static bool is_collectable(TackValue value) {
+    switch ((uint64_t)value.get_type()) {
+        case (uint64_t)TackType::String:
+        case (uint64_t)TackType::Object:
+        case (uint64_t)TackType::Array:
+        case (uint64_t)TackType::Function:
+        case (uint64_t)TackType::WeakRef:
+        case (uint64_t)TackType::WeakMap: return true;
+        default: return false;
+    }
+}
+void Heap::pin(TackValue value) {
+    if (is_collectable(value)) {
+        auto ret = 0;
+        auto i = roots.put(value._i, &ret);
+        if (ret) {
+            roots.value_at(i) = 0;
+        }
+        roots.value_at(i)++;
+    }
 }
-void gc_visit(BoxType* box) {
-    if (!box->marker) {
-        box->marker = true;
-        gc_visit(box->value);
+void Heap::unpin(TackValue value) {
+    if (is_collectable(value)) {
+        auto i = roots.find(value._i);
+        if (i != roots.end() && --roots.value_at(i) == 0) {
+            roots.del(i);
+        }
     }
 }
-void gc_visit(TackValue::ObjectType* obj) {
-    if (!obj->marker) {
-        obj->marker = true;
+
+uint32_t Heap::alloc_count() const {
+    auto count = 0u;
+    for_each_pool([&](const auto& pool) { count += pool.num_live; });
+    return count;
+}
+uint64_t Heap::allocated_bytes() const {
+    auto bytes = uint64_t(0);
+    for_each_pool([&](const auto& pool) { bytes += pool.allocated_bytes(); });
+    return bytes;
+}
+size_t Heap::heap_bytes() const {
+    return live_bytes + (size_t)(allocated_bytes() - allocated_at_last_gc);
+}
+
+double Heap::gc_growth_factor() const {
+    return growth_factor;
+}
+void Heap::gc_growth_factor(double factor) {
+    growth_factor = std::max(factor, 1.0);
+    update_threshold();
+}
+size_t Heap::gc_soft_limit() const {
+    return soft_limit;
+}
+void Heap::gc_soft_limit(size_t bytes) {
+    soft_limit = bytes;
+    update_threshold();
+}
+size_t Heap::max_heap_size() const {
+    return max_bytes;
+}
+void Heap::max_heap_size(size_t bytes) {
+    max_bytes = bytes;
+    update_threshold();
+}
+void Heap::update_threshold() {
+    // grow in proportion to the live heap, but near the soft limit collect more often rather than exceed it
+    // (unless there's so much live data that collecting wouldn't free anything much)
+    gc_threshold = std::max((size_t)(live_bytes * growth_factor), MIN_GC_BYTES);
+    if (soft_limit) {
+        gc_threshold = std::min(gc_threshold, std::max(soft_limit, live_bytes + MIN_GC_BYTES));
+    }
+    if (max_bytes) {
+        gc_threshold = std::min(gc_threshold, max_bytes);
+    }
+}
+
+TackHeapStats Heap::stats() const {
+    auto reclaimed = uint64_t(0);
+    for_each_pool([&](const auto& pool) { reclaimed += pool.reclaimed_bytes; });
+    auto type_stats = [](const auto& pool) {
+        return TackHeapStats::TypeStats {
+            .count = pool.num_live,
+            .bytes = pool.current_bytes()
+        };
+    };
+    return TackHeapStats {
+        .strings = type_stats(strings),
+        .arrays = type_stats(arrays),
+        .objects = type_stats(objects),
+        .functions = type_stats(functions),
+        .boxes = type_stats(boxes),
+        .weakrefs = type_stats(weakrefs),
+        .weakmaps = type_stats(weakmaps),
+        .live_bytes = live_bytes,
+        .gc_threshold = gc_threshold,
+        .bytes_allocated = allocated_bytes(),
+        .bytes_reclaimed = reclaimed,
+        .collections = num_collections,
+        .total_pause_ms = total_pause_ms,
+        .max_pause_ms = max_pause_ms
+    };
+}
+
+void Heap::gc_visit(TackValue::StringType* str) {
+    strings.mark(str);
+}
+void Heap::gc_visit(BoxType* box) {
+    if (!boxes.mark(box)) {
+        gc_visit(*box->location);
+    }
+}
+void Heap::gc_visit(TackValue::ObjectType* obj) {
+    if (!objects.mark(obj)) {
         for (auto i = obj->data.begin(); i != obj->data.end(); i = obj->data.next(i)) {
             gc_visit(obj->data.value_at(i));
         }
     }
 }
-void gc_visit(TackValue::ArrayType* arr) {
-    if (!arr->marker) {
-        arr->marker = true;
+void Heap::gc_visit(TackValue::ArrayType* arr) {
+    if (!arrays.mark(arr)) {
         for (auto v : arr->data) {
             gc_visit(v);
         }
     }
 }
-void gc_visit(TackValue::FunctionType* func) {
-    if (!func->marker) {
-        func->marker = true;
-        for (auto v : func->captures) {
-            gc_visit(v);
+void Heap::gc_visit(TackValue::FunctionType* func) {
+    if (!functions.mark(func)) {
+        for (auto i = 0u; i < func->num_captures; i++) {
+            gc_visit(func->captures()[i]);
         }
     }
 }
 
-void gc_visit(TackValue value) {
+void Heap::gc_visit(TackValue::WeakRefType* ref) {
+    weakrefs.mark(ref); // but not the target
+}
+void Heap::gc_visit(TackValue::WeakMapType* map) {
+    if (!weakmaps.mark(map)) {
+        marked_weakmaps.push_back(map); // the values are marked later, depending on the keys
+    }
+}
+
+void Heap::gc_visit(TackValue value) {
     // dump("visit: ", value);
     switch ((uint64_t)value.get_type()) {
         case (uint64_t)TackType::String: return gc_visit(value.string());
@@ -92,26 +385,155 @@ void gc_visit(TackValue value) {
         case (uint64_t)TackType::Array: return gc_visit(value.array());
         case (uint64_t)TackType::Function: return gc_visit(value.function());
         case type_bits_boxed: return gc_visit(value_to_boxed(value));
+        case (uint64_t)TackType::WeakRef: return gc_visit(value.weakref());
+        case (uint64_t)TackType::WeakMap: return gc_visit(value.weakmap());
         default:break;
     }
 }
 
+// values that aren't in the heap count as marked
+bool Heap::is_marked(TackValue value) const {
+    switch ((uint64_t)value.get_type()) {
+        case (uint64_t)TackType::String: return strings.is_marked(value.string());
+        case (uint64_t)TackType::Object: return objects.is_marked(value.object());
+        case (uint64_t)TackType::Array: return arrays.is_marked(value.array());
+        case (uint64_t)TackType::Function: return functions.is_marked(value.function());
+        case (uint64_t)TackType::WeakRef: return weakrefs.is_marked(value.weakref());
+        case (uint64_t)TackType::WeakMap: return weakmaps.is_marked(value.weakmap());
+        default: return true;
+    }
+}
+size_t Heap::total_marked_bytes() const {
+    auto bytes = size_t(0);
+    for_each_pool([&](const auto& pool) { bytes += pool.marked_bytes; });
+    return bytes;
+}
+
+// Weak maps are ephemeron tables: a value is live only if its key is live through something other than the map itself.
+// Marking a value can make more keys live (or find more weak maps), so repeat until a pass doesn't mark anything new
+void Heap::mark_ephemerons() {
+    auto marked = total_marked_bytes();
+    while (true) {
+        for (auto m = 0u; m < marked_weakmaps.size(); m++) { // grows as values are marked
+            auto& data = marked_weakmaps[m]->data;
+            for (auto i = data.begin(); i != data.end(); i = data.next(i)) {
+                if (is_marked(TackValue { data.key_at(i) })) {
+                    gc_visit(data.value_at(i));
+                }
+            }
+        }
+        auto now_marked = total_marked_bytes(); // every cell has a size, so this only stays the same if nothing was marked
+        if (now_marked == marked) {
+            break;
+        }
+        marked = now_marked;
+    }
+}
+// after marking: the targets of weak references and the keys of weak maps that weren't marked are about to be freed
+void Heap::clear_weak_references() {
+    weakrefs.for_each([&](TackValue::WeakRefType* ref) {
+        if (!is_marked(ref->target)) {
+            ref->target = TackValue::null();
+        }
+    });
+    for (auto* map : marked_weakmaps) {
+        auto& data = map->data;
+        for (auto i = data.begin(); i != data.end(); i = data.next(i)) {
+            if (!is_marked(TackValue { data.key_at(i) })) {
+                data.del(i);
+            }
+        }
+    }
+    marked_weakmaps.clear();
+}
+
+bool Heap::scratch_active() const {
+    return in_scratch;
+}
+void Heap::begin_scratch() {
+    in_scratch = true;
+    for_each_pool([](auto& pool) { pool.scratch = true; });
+}
+void Heap::end_scratch(std::vector<TackValue>& globals, const Stack& stack, uint32_t stack_end) {
+    collect(globals, stack, stack_end, false);
+    auto start = GCTrace::Clock::now();
+    auto pages = 0u;
+    auto kept = 0u;
+    for_each_pool([&](auto& pool) {
+        pages += (uint32_t)pool.scratch_pages.size();
+        kept += pool.end_scratch([this](auto* cell) { rehome(cell); });
+    });
+    scratch_arena.reset();
+    in_scratch = false;
+    if (trace.out) {
+        trace.event("end_scratch", nullptr, start, GCTrace::Clock::now(), { { "pages", pages }, { "kept", kept } });
+    }
+}
+
+// move a container out of the scratch arena, by copying it into one that uses the regular account
+void Heap::rehome(TackValue::ArrayType* arr) {
+    using Data = decltype(arr->data);
+    auto data = Data(arr->data.begin(), arr->data.end(), TackAllocator<TackValue>(&arrays.payload));
+    std::destroy_at(&arr->data);
+    new (&arr->data) Data(std::move(data));
+}
+void Heap::rehome(TackValue::FunctionType* func) {
+    if (func->num_captures > TackValue::FunctionType::INLINE_CAPTURES) {
+        auto* data = TackAllocator<TackValue>(&functions.payload).allocate(func->num_captures);
+        std::copy_n(func->spilled.data, func->num_captures, data);
+        TackAllocator<TackValue>(func->spilled.account).deallocate(func->spilled.data, func->num_captures);
+        func->spilled = { data, &functions.payload };
+    }
+}
+void Heap::rehome(TackValue::ObjectType* obj) {
+    using Data = decltype(obj->data);
+    auto entries = std::vector<std::pair<std::string, TackValue>> {};
+    entries.reserve(obj->data.size());
+    for (auto i = obj->data.begin(); i != obj->data.end(); i = obj->data.next(i)) {
+        entries.emplace_back(std::move(obj->data.key_at(i)), obj->data.value_at(i));
+    }
+    std::destroy_at(&obj->data);
+    new (&obj->data) Data(TackAllocator<TackValue>(&objects.payload));
+    for (auto& [key, value] : entries) {
+        obj->data.set(key, value);
+    }
+}
+void Heap::rehome(TackValue::WeakMapType* map) {
+    using Data = decltype(map->data);
+    auto entries = std::vector<std::pair<uint64_t, TackValue>> {};
+    entries.reserve(map->data.size());
+    for (auto i = map->data.begin(); i != map->data.end(); i = map->data.next(i)) {
+        entries.emplace_back(map->data.key_at(i), map->data.value_at(i));
+    }
+    std::destroy_at(&map->data);
+    new (&map->data) Data(TackAllocator<TackValue>(&weakmaps.payload));
+    for (auto& [key, value] : entries) {
+        map->data.set(key, value);
+    }
+}
+
 void Heap::gc(std::vector<TackValue>& globals, const Stack &stack, uint32_t stackbase) {
-    // Basic mark-n-sweep garbage collector
+    // Mark-n-sweep garbage collector
+    // Marks live in per-page bitmaps; sweeping is deferred until the allocator needs the space
     // TODO: improve code style everywhere
-    if (state == TackGCState::Disabled
-        || alloc_count < prev_alloc_count * 2 
-        || alloc_count <= MIN_GC_ALLOCATIONS) {
+    if (state == TackGCState::Disabled || heap_bytes() < gc_threshold) {
         return;
     }
+    collect(globals, stack, stackbase, false);
+}
 
-    // gc every 1ms
+void Heap::collect(std::vector<TackValue>& globals, const Stack& stack, uint32_t stack_end, bool sweep_now) {
+    auto size = heap_bytes();
     auto before = std::chrono::steady_clock::now();
     debug("===== GC: START ===");
-    debug("  prev alloc count: ", prev_alloc_count);
-    debug("  cur alloc count:  ", alloc_count);
+    debug("  heap bytes:       ", size);
+    debug("  threshold:        ", gc_threshold);
     debug("  last gc:          ", last_gc.time_since_epoch().count());
-    auto num_collections = 0;
+
+    // any pages not swept since the last collection must be swept now, before their marks are cleared
+    for_each_pool([](auto& pool) { pool.begin_collection(); });
+
+    auto mark_start = std::chrono::steady_clock::now();
 
     // visit globals
     for (const auto& v: globals) {
@@ -121,117 +543,47 @@ void Heap::gc(std::vector<TackValue>& globals, const Stack &stack, uint32_t stac
     // visit stack
     // assume this is being called from a return site, so the contents of the stack above stackbase are no longer needed
     // visiting the stack frame data (return pc, etc) seems messy but is intentional - we should visit the functions in the call stack anyway
-    for (auto i = 0u; i < stackbase; i++) {
+    for (auto i = 0u; i < stack_end; i++) {
         gc_visit(stack[i]);
     }
 
-    // visit any refcounted functions, objects, arrays
-    // TODO: inefficient? might be better to have a separate list
-    // and transfer objects to it when refcount > 0
-    // can use std::list::splice for this
-    for (auto& o : objects) {
-        if (o.refcount) {
-            gc_visit(&o);
-        }
-    }
-    for (auto& a : arrays) {
-        if (a.refcount) {
-            gc_visit(&a);
-        }
-    }
-    for (auto& f : functions) {
-        if (f.refcount) {
-            gc_visit(&f);
-        }
+    // visit pinned values
+    for (auto i = roots.begin(); i != roots.end(); i = roots.next(i)) {
+        gc_visit(TackValue { roots.key_at(i) });
     }
 
-
-    // "sweep up" (ie deallocate) anything that wasn't visited
-    dump("sweeping strings");
-    {
-        auto i = strings.begin();
-        while (i != strings.end()) {
-            if (!i->marker && i->refcount == 0) {
-                dump("collected string: ", TackValue::string(&(*i)));
-                num_collections += 1;
-                i = strings.erase(i);
-            } else {
-                i->marker = false;
-                i++;
-            }
-        }
+    // visit open boxes (the variables themselves are on the stack)
+    for (auto* box : open_boxes) {
+        gc_visit(box);
     }
 
-    dump("sweeping objects");
-    {
-        auto i = objects.begin();
-        while (i != objects.end()) {
-            if (!i->marker && i->refcount == 0) {
-                dump("collected object: ", TackValue::object(&(*i)));
-                num_collections += 1;
-                i = objects.erase(i);
-            } else {
-                i->marker = false;
-                i++;
-            }
-        }
-    }
+    mark_ephemerons();
+    clear_weak_references();
 
-    dump("sweeping arrays");
-    {
-        auto i = arrays.begin();
-        while (i != arrays.end()) {
-            if (!i->marker && i->refcount == 0) {
-                dump("collected array: ", TackValue::array(&(*i)));
-                num_collections += 1;
-                i = arrays.erase(i);
-            } else {
-                i->marker = false;
-                i++;
-            }
-        }
-    }
+    auto mark_end = std::chrono::steady_clock::now();
 
-    dump("sweeping boxes");
-    {
-        auto i = boxes.begin();
-        while (i != boxes.end()) {
-            if (!i->marker) {
-                dump("collected box", i->value);
-                num_collections += 1;
-                i = boxes.erase(i);
-            } else {
-                i->marker = false;
-                i++;
-            }
-        }
+    // anything that wasn't visited is garbage, and will be "swept up" (ie deallocated) lazily
+    for_each_pool([](auto& pool) { pool.end_collection(); });
+    if (sweep_now) {
+        for_each_pool([](auto& pool) { pool.sweep_all(); });
     }
 
-    dump("sweeping functions");
-    {
-        auto i = functions.begin();
-        while (i != functions.end()) {
-            if (!i->marker && i->refcount == 0) {
-                // dump("collected function: ", i->bytecode->name);
-                num_collections += 1;
-                i = functions.erase(i);
-            } else {
-                i->marker = false;
-                i++;
-            }
-        }
-    }
+    live_bytes = total_marked_bytes();
+    allocated_at_last_gc = allocated_bytes();
+    update_threshold();
 
     auto after = std::chrono::steady_clock::now();
     last_gc = after;
     auto duration = after - before;
-    auto ms = (float)std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.f;
-    last_gc_ms = ms;
-    prev_alloc_count = alloc_count;
-    alloc_count -= num_collections;
+    auto ms = (double)std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.0;
+    num_collections++;
+    total_pause_ms += ms;
+    max_pause_ms = std::max(max_pause_ms, ms);
+    if (trace.out) {
+        trace.event("mark", nullptr, mark_start, mark_end, { { "live_bytes", (double)live_bytes } });
+        trace.event("gc", nullptr, before, after, { { "heap_bytes", (double)size }, { "next_threshold", (double)gc_threshold } });
+    }
     debug("===== GC: END =====");
-    debug("  collected:       ", num_collections);
-    debug("  new alloc count: ", alloc_count);
+    debug("  live bytes:       ", live_bytes);
     debug("  time taken (ms): ", ms);
-
 }
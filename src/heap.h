@@ -0,0 +1,612 @@
+#pragma once
+
+#include "../include/tack.h"
+
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#include <bit>
+#include <type_traits>
+#include <initializer_list>
+#include <ostream>
+#include <unordered_map>
+
+// Hidden box type: a variable captured by a closure
+// While the variable's register is still in scope the box is open, and location points at the register on the stack;
+// when the register goes out of scope the box is closed: the value is moved into the box and location points at it instead
+struct BoxType {
+    TackValue* location;
+    TackValue value; // boxes can't be pinned
+};
+#define type_bits_boxed (0x00'0b'00'00'00'00'00'00)
+static inline TackValue value_from_boxed(BoxType* box)             { return { nan_bits | type_bits_boxed | uint64_t(box) }; }
+static inline bool value_is_boxed(TackValue v)                     { return std::isnan(v._d) && (v._i & type_bits) == type_bits_boxed; }
+static inline BoxType* value_to_boxed(TackValue v)                 { return (BoxType*)(v._i & pointer_bits); }
+
+// Bytes a cell owns outside of the heap pages
+// Containers charge their TackMemoryAccount as they grow; strings are std::string, so they are charged by hand
+static inline size_t payload_size(const std::string& s) {
+    auto p = (const char*)s.data();
+    auto small = p >= (const char*)&s && p < (const char*)&s + sizeof(s); // short string stored inline
+    return small ? 0 : s.capacity() + 1;
+}
+static inline size_t payload_size(const TackValue::StringType& s)   { return payload_size(s.data); }
+static inline size_t payload_size(const TackValue::ArrayType& a)    { return a.data.capacity() * sizeof(TackValue); }
+static inline size_t payload_size(const TackValue::ObjectType& o)   { return o.data.memory_usage(); }
+static inline size_t payload_size(const TackValue::FunctionType& f) {
+    return f.num_captures > TackValue::FunctionType::INLINE_CAPTURES ? f.num_captures * sizeof(TackValue) : 0;
+}
+static inline size_t payload_size(const BoxType&)                   { return 0; }
+static inline size_t payload_size(const TackValue::WeakRefType&)    { return 0; }
+static inline size_t payload_size(const TackValue::WeakMapType& m)  { return m.data.memory_usage(); }
+
+// Bump allocator for the payloads of cells allocated in a scratch scope (see Heap::begin_scratch())
+// Freeing does nothing; reset() makes all the memory available again at once
+struct ScratchArena : TackHostAllocator {
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+    static constexpr size_t CHUNK_ALIGNMENT = 64;
+    struct Chunk {
+        unsigned char* data;
+        size_t size;
+    };
+    TackHostAllocator* host = nullptr; // where the chunks come from
+    std::vector<Chunk> chunks;
+    size_t current = 0; // chunk being allocated from
+    size_t used = 0;    // bytes used in the current chunk
+
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+    ~ScratchArena();
+
+    void* allocate(size_t size, size_t alignment) override;
+    void free(void*, size_t, size_t) override {}
+    void reset();
+};
+
+// Writes GC events in the Chrome trace event format (a JSON array of events)
+struct GCTrace {
+    using Clock = std::chrono::steady_clock;
+    std::ostream* out = nullptr;
+    uint64_t num_events = 0;
+
+    void start(std::ostream* stream);
+    void stop();
+    // a complete ("X") event; args is a list of key-value pairs
+    void event(const char* name, const char* type, Clock::time_point start, Clock::time_point end,
+        std::initializer_list<std::pair<const char*, double>> args = {});
+};
+
+static const size_t MIN_GC_BYTES = 1 << 20; // min heap size before GC will run; don't make it too small
+static const uint32_t HEAP_PAGE_SIZE = 1 << 16; // pages are aligned to their size, so the page of a cell is found by masking its address
+
+// A page of cells of a single type
+// Liveness and mark bits live in bitmaps in the page header instead of inline in each cell,
+// so clearing the marks is a memset and the sweep only touches cells that actually died
+template<typename T>
+struct HeapPage {
+    static constexpr uint32_t NUM_CELLS = ((HEAP_PAGE_SIZE - 64) * 8) / (sizeof(T) * 8 + 2) - 64;
+    static constexpr uint32_t NUM_WORDS = (NUM_CELLS + 63) / 64;
+
+    uint64_t live[NUM_WORDS] = {};
+    uint64_t marks[NUM_WORDS] = {};
+    uint32_t num_live = 0;
+    uint32_t free_hint = 0; // first word that might have a free cell
+    bool needs_sweep = false;
+    bool scratch = false;   // allocated in a scratch scope, see Heap::begin_scratch()
+    alignas(T) unsigned char storage[NUM_CELLS * sizeof(T)];
+
+    inline T* cell(uint32_t i) { return std::launder(reinterpret_cast<T*>(storage) + i); }
+
+    static inline HeapPage* of(const T* cell) {
+        return (HeapPage*)((uintptr_t)cell & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+    }
+    // set the mark bit for a cell; returns true if it was already marked
+    static inline bool mark(const T* cell) {
+        auto* page = of(cell);
+        auto i = (uint32_t)(((const unsigned char*)cell - page->storage) / sizeof(T));
+        auto bit = uint64_t(1) << (i % 64);
+        auto& word = page->marks[i / 64];
+        auto was_marked = (word & bit) != 0;
+        word |= bit;
+        return was_marked;
+    }
+    static inline bool is_marked(const T* cell) {
+        auto* page = of(cell);
+        auto i = (uint32_t)(((const unsigned char*)cell - page->storage) / sizeof(T));
+        return (page->marks[i / 64] & (uint64_t(1) << (i % 64))) != 0;
+    }
+};
+
+// Element buffers of arrays that died, kept so that small arrays which are created and thrown away all the time
+// (pairs, tuples, etc) can reuse them instead of going back to the allocator every time
+// Only buffers of up to MAX_CAPACITY elements are kept, and at most MAX_PER_CAPACITY of each size;
+// they stay charged to the pool's account while they're waiting to be reused
+struct ArrayBufferPool {
+    using Data = decltype(TackValue::ArrayType::data);
+    static constexpr uint32_t MAX_CAPACITY = 8;
+    static constexpr uint32_t MAX_PER_CAPACITY = 1024;
+    std::array<std::vector<Data>, MAX_CAPACITY + 1> buffers; // by capacity
+
+    // keep the buffer of a dying array if there's room for it; leaves data empty if it was kept
+    inline void put(Data& data) {
+        auto capacity = data.capacity();
+        if (capacity && capacity <= MAX_CAPACITY && buffers[capacity].size() < MAX_PER_CAPACITY) {
+            data.clear();
+            buffers[capacity].push_back(std::move(data));
+        }
+    }
+    // an empty buffer with room for exactly capacity elements, if one has been kept
+    inline bool take(uint32_t capacity, Data& out) {
+        if (capacity && capacity <= MAX_CAPACITY && !buffers[capacity].empty()) {
+            out = std::move(buffers[capacity].back());
+            buffers[capacity].pop_back();
+            return true;
+        }
+        return false;
+    }
+};
+
+// Allocates cells of a single type out of HeapPages
+// Sweeping is lazy: after a collection every page is flagged, and a page is only swept
+// when the allocator reaches it looking for space (or when the next collection starts)
+// In a scratch scope, cells are bumped out of pages of their own instead, and their payloads come from the ScratchArena
+template<typename T>
+struct HeapPool {
+    using Page = HeapPage<T>;
+    static_assert(sizeof(Page) <= HEAP_PAGE_SIZE);
+    const char* type_name;
+    GCTrace* trace;
+    std::vector<Page*> pages;
+    size_t cursor = 0; // allocation proceeds through the pages in order
+    uint32_t num_live = 0;
+    uint64_t num_allocated = 0; // cells allocated in total
+    TackMemoryAccount payload;  // container memory owned by the cells; payload.host also supplies the pages
+    struct NoBuffers {};
+    [[no_unique_address]] std::conditional_t<std::is_same_v<T, TackValue::ArrayType>, ArrayBufferPool, NoBuffers> spare_buffers;
+    size_t marked_bytes = 0;    // size of the cells (and their payloads) marked in the current collection
+    uint64_t reclaimed_bytes = 0;
+
+    // scratch scope
+    bool scratch = false;
+    TackMemoryAccount scratch_payload;  // scratch_payload.host is the ScratchArena
+    std::vector<Page*> scratch_pages;   // the last one is being filled
+    uint32_t scratch_top = 0;           // next cell in the last scratch page
+    std::vector<Page*> spare_pages;     // emptied scratch pages, to be reused by the next scope
+
+    HeapPool(const char* type_name, GCTrace* trace) : type_name(type_name), trace(trace) {}
+    HeapPool(const HeapPool&) = delete;
+    HeapPool& operator=(const HeapPool&) = delete;
+    ~HeapPool() {
+        for (auto* page : pages) {
+            for_each_in(page, [this](T* c) { destroy(c); });
+            free_page(page);
+        }
+        for (auto* page : spare_pages) {
+            free_page(page);
+        }
+    }
+
+    // the account that payloads of new cells should be charged to
+    inline TackMemoryAccount* account() {
+        return scratch ? &scratch_payload : &payload;
+    }
+
+    template<typename... Args>
+    T* alloc(Args&&... args) {
+        if (scratch) [[unlikely]] {
+            return alloc_scratch(std::forward<Args>(args)...);
+        }
+        while (true) {
+            if (cursor == pages.size()) {
+                pages.push_back(new_page());
+            }
+            auto* page = pages[cursor];
+            if (page->needs_sweep) {
+                lazy_sweep(page);
+            }
+            for (auto w = page->free_hint; w < Page::NUM_WORDS; w++) {
+                auto free_bits = ~page->live[w];
+                if (free_bits) {
+                    auto i = w * 64 + (uint32_t)std::countr_zero(free_bits);
+                    if (i >= Page::NUM_CELLS) {
+                        break;
+                    }
+                    page->live[w] |= uint64_t(1) << (i % 64);
+                    page->free_hint = w;
+                    page->num_live++;
+                    num_live++;
+                    num_allocated++;
+                    return new (page->storage + i * sizeof(T)) T { std::forward<Args>(args)... };
+                }
+            }
+            page->free_hint = Page::NUM_WORDS;
+            cursor++;
+        }
+    }
+    template<typename... Args>
+    T* alloc_scratch(Args&&... args) {
+        if (scratch_pages.empty() || scratch_top == Page::NUM_CELLS) {
+            auto* page = spare_pages.size() ? spare_pages.back() : new_page();
+            if (spare_pages.size()) {
+                spare_pages.pop_back();
+            }
+            page->scratch = true;
+            pages.push_back(page);
+            scratch_pages.push_back(page);
+            scratch_top = 0;
+        }
+        auto* page = scratch_pages.back();
+        if (page->needs_sweep) {
+            lazy_sweep(page); // a collection ran in the middle of the scope; freed cells aren't reused until it ends
+        }
+        auto i = scratch_top++;
+        page->live[i / 64] |= uint64_t(1) << (i % 64);
+        page->num_live++;
+        num_live++;
+        num_allocated++;
+        return new (page->storage + i * sizeof(T)) T { std::forward<Args>(args)... };
+    }
+
+    // after a collection: scratch pages with survivors become ordinary pages, rehome(cell) moving each survivor's payload
+    // out of the arena; the other pages are emptied without visiting the dead cells, unless they need destroying
+    // (strings and object keys can own memory from the global operator new); returns the number of pages kept
+    template<typename F>
+    uint32_t end_scratch(F&& rehome) {
+        static constexpr auto must_destroy = std::is_same_v<T, TackValue::StringType> || std::is_same_v<T, TackValue::ObjectType>;
+        auto kept = 0u;
+        for (auto* page : scratch_pages) {
+            auto survivors = false;
+            for (auto w = 0u; w < Page::NUM_WORDS && !survivors; w++) {
+                survivors = (page->live[w] & page->marks[w]) != 0;
+            }
+            if (survivors) {
+                lazy_sweep(page);
+                for_each_in(page, rehome);
+                page->scratch = false;
+                kept++;
+                continue;
+            }
+            if constexpr (must_destroy) {
+                for_each_in(page, [this](T* c) { reclaimed_bytes += payload_size(*c); destroy(c); });
+            }
+            reclaimed_bytes += page->num_live * sizeof(T);
+            num_live -= page->num_live;
+            page->num_live = 0;
+            page->free_hint = 0;
+            page->needs_sweep = false;
+            std::memset(page->live, 0, sizeof(page->live));
+            std::memset(page->marks, 0, sizeof(page->marks));
+            spare_pages.push_back(page);
+        }
+        if (!scratch_pages.empty()) {
+            std::erase_if(pages, [](Page* page) { return page->scratch; });
+            for (auto* page : spare_pages) {
+                page->scratch = false;
+            }
+            cursor = 0;
+        }
+        reclaimed_bytes += (uint64_t)scratch_payload.bytes; // payloads of the dead cells that weren't destroyed
+        scratch_payload.bytes = 0;
+        scratch_pages.clear();
+        scratch = false;
+        return kept;
+    }
+
+    // finish sweeping from the last collection and clear all the marks
+    void begin_collection() {
+        sweep_all();
+        for (auto* page : pages) {
+            std::memset(page->marks, 0, sizeof(page->marks));
+        }
+        marked_bytes = 0;
+    }
+    // sweep every page that still needs it, rather than waiting for the allocator
+    void sweep_all() {
+        auto start = GCTrace::Clock::now();
+        auto num_swept = 0u;
+        auto freed = 0u;
+        for (auto* page : pages) {
+            if (page->needs_sweep) {
+                freed += sweep(page);
+                num_swept++;
+            }
+        }
+        if (trace->out && num_swept) {
+            trace->event("sweep", type_name, start, GCTrace::Clock::now(), { { "pages", num_swept }, { "freed", freed } });
+        }
+    }
+    // set the mark bit for a cell and count it as live; returns true if it was already marked
+    bool mark(const T* cell) {
+        if (Page::mark(cell)) {
+            return true;
+        }
+        marked_bytes += sizeof(T) + payload_size(*cell);
+        return false;
+    }
+    bool is_marked(const T* cell) const {
+        return Page::is_marked(cell);
+    }
+    // bytes currently allocated, cells and payloads, including garbage that hasn't been swept yet
+    size_t current_bytes() const {
+        return num_live * sizeof(T) + (size_t)payload.bytes + (size_t)scratch_payload.bytes;
+    }
+    // bytes allocated in total, cells and payloads
+    uint64_t allocated_bytes() const {
+        return num_allocated * sizeof(T) + payload.allocated + scratch_payload.allocated;
+    }
+
+    // everything unmarked is now garbage; pages will be swept as the allocator reaches them
+    void end_collection() {
+        for (auto* page : pages) {
+            page->needs_sweep = true;
+        }
+        cursor = 0;
+    }
+
+    template<typename F>
+    void for_each(F f) {
+        for (auto* page : pages) {
+            for_each_in(page, f);
+        }
+    }
+
+private:
+    Page* new_page() {
+        auto* mem = payload.host
+            ? payload.host->allocate(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE)
+            : ::operator new(HEAP_PAGE_SIZE, std::align_val_t(HEAP_PAGE_SIZE));
+        return new (mem) Page();
+    }
+    void free_page(Page* page) {
+        page->~Page();
+        if (payload.host) {
+            payload.host->free(page, HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+        } else {
+            ::operator delete(page, std::align_val_t(HEAP_PAGE_SIZE));
+        }
+    }
+    void lazy_sweep(Page* page) {
+        if (trace->out) {
+            auto start = GCTrace::Clock::now();
+            auto freed = sweep(page);
+            trace->event("sweep", type_name, start, GCTrace::Clock::now(), { { "pages", 1 }, { "freed", freed } });
+        } else {
+            sweep(page);
+        }
+    }
+    template<typename F>
+    static void for_each_in(Page* page, F&& f) {
+        for (auto w = 0u; w < Page::NUM_WORDS; w++) {
+            for (auto bits = page->live[w]; bits; bits &= bits - 1) {
+                f(page->cell(w * 64 + (uint32_t)std::countr_zero(bits)));
+            }
+        }
+    }
+    void destroy(T* cell) {
+        if constexpr (std::is_same_v<T, TackValue::StringType>) {
+            payload.bytes -= payload_size(*cell);
+        }
+        if constexpr (std::is_same_v<T, TackValue::ArrayType>) {
+            if (cell->data.get_allocator().account == &payload) { // not from the scratch arena
+                spare_buffers.put(cell->data);
+            }
+        }
+        cell->~T();
+    }
+    // returns the number of cells freed
+    uint32_t sweep(Page* page) {
+        auto freed = 0u;
+        for (auto w = 0u; w < Page::NUM_WORDS; w++) {
+            auto dead = page->live[w] & ~page->marks[w];
+            for (auto bits = dead; bits; bits &= bits - 1) {
+                auto* cell = page->cell(w * 64 + (uint32_t)std::countr_zero(bits));
+                reclaimed_bytes += sizeof(T) + payload_size(*cell);
+                destroy(cell);
+            }
+            auto n = (uint32_t)std::popcount(dead);
+            page->num_live -= n;
+            num_live -= n;
+            page->live[w] &= ~dead;
+            freed += n;
+        }
+        page->free_hint = 0;
+        page->needs_sweep = false;
+        return freed;
+    }
+};
+
+struct Stack;
+struct CodeFragment;
+
+// where an allocation came from: the instruction being executed, or null code for the host
+struct AllocSite {
+    CodeFragment* code = nullptr;
+    uint32_t pc = 0;
+};
+
+struct Heap {
+private:
+    // heap
+    GCTrace trace;
+    HeapPool<TackValue::ArrayType> arrays { "array", &trace };
+    HeapPool<TackValue::ObjectType> objects { "object", &trace };
+    HeapPool<TackValue::FunctionType> functions { "function", &trace };
+    HeapPool<BoxType> boxes { "box", &trace };
+    HeapPool<TackValue::StringType> strings { "string", &trace }; // temp strings are garbage collected, interned strings are pinned
+    HeapPool<TackValue::WeakRefType> weakrefs { "weakref", &trace };
+    HeapPool<TackValue::WeakMapType> weakmaps { "weakmap", &trace };
+    template<typename F> void for_each_pool(F&& f) {
+        f(strings); f(objects); f(arrays); f(boxes); f(functions); f(weakrefs); f(weakmaps);
+    }
+    template<typename F> void for_each_pool(F&& f) const {
+        f(strings); f(objects); f(arrays); f(boxes); f(functions); f(weakrefs); f(weakmaps);
+    }
+
+    // pinned values (raw bits) -> pin count; these are the roots besides globals and the stack
+    struct RootHash { uint32_t operator()(uint64_t k) const { return uint32_t((k * 0x9e3779b97f4a7c15ull) >> 32); } };
+    KHash<uint64_t, uint32_t, RootHash> roots;
+
+    // pacing
+    // a collection starts once the heap (live bytes at the last collection plus everything allocated since)
+    // reaches gc_threshold, which is set from the live size after each collection
+    size_t live_bytes = 0;
+    uint64_t allocated_at_last_gc = 0;
+    size_t gc_threshold = MIN_GC_BYTES;
+    double growth_factor = 2.0;
+    size_t soft_limit = 0;
+    size_t max_bytes = 0;
+    void update_threshold();
+
+    // marking
+    void gc_visit(TackValue value);
+    void gc_visit(TackValue::StringType* str);
+    void gc_visit(TackValue::ObjectType* obj);
+    void gc_visit(TackValue::ArrayType* arr);
+    void gc_visit(TackValue::FunctionType* func);
+    void gc_visit(BoxType* box);
+    void gc_visit(TackValue::WeakRefType* ref);
+    void gc_visit(TackValue::WeakMapType* map);
+
+    // open boxes, ordered by the stack slot they point at; they're roots until they're closed
+    std::vector<BoxType*> open_boxes;
+
+    // scratch scope
+    ScratchArena scratch_arena;
+    bool in_scratch = false;
+    void rehome(TackValue::ArrayType* arr);
+    void rehome(TackValue::ObjectType* obj);
+    void rehome(TackValue::FunctionType* func);
+    void rehome(TackValue::WeakMapType* map);
+    void rehome(void*) {} // nothing to move
+
+    // weak references
+    // weak maps found while marking; afterwards their values are marked if their keys were (see mark_ephemerons())
+    std::vector<TackValue::WeakMapType*> marked_weakmaps;
+    bool is_marked(TackValue value) const;
+    size_t total_marked_bytes() const;
+    void mark_ephemerons();
+    void clear_weak_references();
+
+    // allocation sampling
+    // samples are taken at random intervals averaging sample_interval bytes, so every byte allocated is equally likely to be sampled
+    struct SampleKey {
+        CodeFragment* code;
+        uint32_t pc;
+        const char* type;
+        bool operator==(const SampleKey&) const = default;
+    };
+    struct SampleKeyHash {
+        size_t operator()(const SampleKey& k) const { return std::hash<void*>()(k.code) ^ (k.pc * 0x9e3779b9u) ^ std::hash<const void*>()(k.type); }
+    };
+    struct SampleStats {
+        uint64_t samples = 0;
+        double objects = 0.0;
+        double bytes = 0.0;
+    };
+    size_t sample_interval = 0;
+    int64_t bytes_until_sample = 0;
+    uint64_t sample_rng = 0x2545f4914f6cdd1dull;
+    std::unordered_map<SampleKey, SampleStats, SampleKeyHash> samples;
+    void next_sample();
+    void sample(const char* type, size_t bytes);
+    inline void sampling_point(const char* type, size_t bytes) {
+        if (sample_interval && (bytes_until_sample -= (int64_t)bytes) <= 0) {
+            sample(type, bytes);
+        }
+    }
+
+    // statistics
+    std::chrono::steady_clock::time_point last_gc = std::chrono::steady_clock::now();
+    uint32_t num_collections = 0;
+    double total_pause_ms = 0.0;
+    double max_pause_ms = 0.0;
+    TackGCState state = TackGCState::Enabled;
+
+public:
+    AllocSite site; // kept up to date by the interpreter when it executes an instruction that allocates
+
+    // pages and container payloads come from host, or the global operator new if it's null
+    explicit Heap(TackHostAllocator* host = nullptr);
+
+    // reserve is the expected number of elements
+    TackValue::ArrayType* alloc_array(uint32_t reserve = 0);
+    TackValue::ObjectType* alloc_object();
+    TackValue::FunctionType* alloc_function(CodeFragment* code);
+    TackValue::FunctionType* alloc_function(TackValue::CFunctionType cfunction);
+    TackValue::WeakRefType* alloc_weakref(TackValue target);
+    TackValue::WeakMapType* alloc_weakmap();
+    // makes copy of data
+    TackValue::StringType* alloc_string(const std::string& data);
+
+    void pin(TackValue value);
+    void unpin(TackValue value);
+
+    // Captured variables
+    // get the open box for a register, allocating it the first time the register is captured
+    BoxType* capture(TackValue* slot);
+    // close the box for a register going out of scope, if it was captured
+    inline void close_box(TackValue* slot) {
+        if (!open_boxes.empty() && open_boxes.back()->location >= slot) {
+            close_box_at(slot);
+        }
+    }
+    void close_box_at(TackValue* slot);
+    // close the boxes for every register from the given one up, when a stack frame is discarded
+    inline void close_boxes(TackValue* from) {
+        while (!open_boxes.empty() && open_boxes.back()->location >= from) {
+            auto* box = open_boxes.back();
+            box->value = *box->location;
+            box->location = &box->value;
+            open_boxes.pop_back();
+        }
+    }
+
+    // number of cells currently allocated, including garbage that hasn't been swept yet
+    uint32_t alloc_count() const;
+    // bytes allocated in total, cells and payloads
+    uint64_t allocated_bytes() const;
+    // estimated heap size: live bytes at the last collection plus everything allocated since
+    size_t heap_bytes() const;
+    // bytes currently allocated, including garbage that hasn't been swept yet
+    inline size_t current_bytes() const {
+        auto bytes = size_t(0);
+        for_each_pool([&](const auto& pool) { bytes += pool.current_bytes(); });
+        return bytes;
+    }
+    // true if the heap has grown past its maximum size (which may just be garbage; see collect())
+    inline bool over_limit() const {
+        return max_bytes && current_bytes() > max_bytes;
+    }
+
+    TackGCState gc_state() const;
+    void gc_state(TackGCState new_state);
+    double gc_growth_factor() const;
+    void gc_growth_factor(double factor);
+    size_t gc_soft_limit() const;
+    void gc_soft_limit(size_t bytes);
+    size_t max_heap_size() const;
+    void max_heap_size(size_t bytes);
+    TackHeapStats stats() const;
+    size_t alloc_sampling() const;
+    void alloc_sampling(size_t bytes_per_sample);
+    std::vector<TackAllocProfileEntry> alloc_profile() const;
+    void trace_to(std::ostream* stream);
+    // writes the graph of everything reachable from the roots, with retained sizes (see snapshot.cpp)
+    void write_snapshot(std::ostream& file, const std::vector<TackValue>& globals, const std::vector<std::string>& global_names,
+        const Stack& stack, uint32_t stack_end);
+    // collect if the heap has grown enough since the last collection; stack[0, stackbase) are roots
+    void gc(std::vector<TackValue>& globals, const Stack& stack, uint32_t stackbase);
+    // collect now, even if the GC is disabled; with sweep_now the garbage is freed straight away instead of lazily
+    void collect(std::vector<TackValue>& globals, const Stack& stack, uint32_t stack_end, bool sweep_now = true);
+
+    // Scratch scope: until end_scratch(), values are allocated in pages of their own and their payloads in a bump arena.
+    // end_scratch() collects, keeps whatever is still reachable and frees the rest of the scope's pages and the arena
+    // wholesale, without sweeping them
+    bool scratch_active() const;
+    void begin_scratch();
+    void end_scratch(std::vector<TackValue>& globals, const Stack& stack, uint32_t stack_end);
+};
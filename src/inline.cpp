@@ -0,0 +1,98 @@
+#include "compiler.h"
+#include "parsing.h"
+
+#include <unordered_set>
+
+// Inlining of small functions
+// A call to a local function that can't be reassigned (fn f(...) { ... } or const f = fn(...) { ... }) can be compiled
+// as the function's body instead, with the parameters naming the registers the arguments were evaluated into, which
+// saves the CALL and RET (setting up the frame, clearing it on return, the GC check).
+// Only bodies that are a single "return <expression>" are inlined, and the expression can only use the parameters,
+// literals and operators: no calls, closures or other variables. Then the expression means the same thing at the call
+// site as where the function was declared, it can't be recursive, and it can't see that it wasn't called. It also has to
+// be small (MAX_INLINE_SIZE nodes), since it's copied into every call site.
+// The inlined instructions keep the line numbers of the function body, so errors point at the same line they would if
+// the function had been called.
+
+namespace {
+
+struct InlineAnalysis {
+    std::unordered_set<std::string> params = {};
+    uint32_t size = 0;
+    bool ok = true;
+
+    void visit(const AstNode& node) {
+        if (!ok || ++size > MAX_INLINE_SIZE) {
+            ok = false;
+            return;
+        }
+        switch (node.type) {
+            case AstType::Identifier:
+                ok = params.contains(node.data_s);
+                return;
+            case AstType::NumLiteral:
+            case AstType::BoolLiteral:
+            case AstType::NullLiteral:
+            case AstType::StringLiteral:
+                return;
+            case AstType::AccessExp:
+                visit(node.children[0]); // children[1] is the key, not a variable
+                return;
+            case AstType::ObjectLiteral:
+                for (auto& field : node.children) {
+                    visit(field.children[1]); // field.children[0] is the key
+                }
+                return;
+
+            // operators
+            case AstType::OrExp:
+            case AstType::AndExp:
+            case AstType::EqExp:
+            case AstType::NotEqExp:
+            case AstType::LessExp:
+            case AstType::GreaterExp:
+            case AstType::LessEqExp:
+            case AstType::GreaterEqExp:
+            case AstType::InExp:
+            case AstType::ShiftLeftExp:
+            case AstType::ShiftRightExp:
+            case AstType::AddExp:
+            case AstType::SubExp:
+            case AstType::MulExp:
+            case AstType::DivExp:
+            case AstType::ModExp:
+            case AstType::PowExp:
+            case AstType::NegateExp:
+            case AstType::NotExp:
+            case AstType::BitNotExp:
+            case AstType::LenExp:
+            case AstType::IndexExp:
+            case AstType::ArrayLiteral:
+                for (auto& c : node.children) {
+                    visit(c);
+                }
+                return;
+
+            default:
+                ok = false;
+                return;
+        }
+    }
+};
+
+}
+
+bool can_inline(const AstNode* func) {
+    auto& body = func->children[1];
+    if (body.type != AstType::StatList || body.children.size() != 1 || body.children[0].type != AstType::ReturnStat || body.children[0].children.size() != 1) {
+        return false;
+    }
+    auto analysis = InlineAnalysis {};
+    for (auto& param : func->children[0].children) {
+        if (!analysis.params.insert(param.data_s).second) {
+            return false; // duplicate parameter names
+        }
+    }
+    analysis.visit(body.children[0].children[0]);
+    return analysis.ok;
+}
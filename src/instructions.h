@@ -36,7 +36,43 @@
     opcode(AND)\
     opcode(OR)\
     \
+    /* binary operations with a constant number as the second operand: r2 is its index in storage */\
+    opcode(EQUALK)\
+    opcode(NEQUALK)\
+    opcode(GREATERK)\
+    opcode(LESSK)\
+    opcode(GREATEREQK)\
+    opcode(LESSEQK)\
+    opcode(ADDK)\
+    opcode(SUBK)\
+    opcode(DIVK)\
+    opcode(MULK)\
+    opcode(MODK)\
+    \
+    /* the same with operands known to be numbers, so they don't check (see specialize_number_ops) */\
+    opcode(INCREMENT_N)\
+    opcode(GREATER_NN)\
+    opcode(LESS_NN)\
+    opcode(GREATEREQ_NN)\
+    opcode(LESSEQ_NN)\
+    opcode(ADD_NN)\
+    opcode(SUB_NN)\
+    opcode(DIV_NN)\
+    opcode(MUL_NN)\
+    opcode(MOD_NN)\
+    opcode(GREATERK_N)\
+    opcode(LESSK_N)\
+    opcode(GREATEREQK_N)\
+    opcode(LESSEQK_N)\
+    opcode(ADDK_N)\
+    opcode(SUBK_N)\
+    opcode(DIVK_N)\
+    opcode(MULK_N)\
+    opcode(MODK_N)\
+    opcode(FOR_INT_N)\
+    \
     opcode(LOAD_CONST) \
+    opcode(EXTEND) /* prefix for LOAD_CONST or ALLOC_FUNC: u1 is the high 16 bits of its storage index */\
     opcode(LOAD_I_SN)\
     opcode(LOAD_I_BOOL)\
     opcode(LOAD_I_NULL) \
@@ -61,14 +97,20 @@
     opcode(READ_BOX)\
     opcode(WRITE_BOX)\
     opcode(ALLOC_ARRAY)\
+    opcode(ALLOC_SPILL) /* r0 = an array of u1 nulls, for the variables that don't fit in registers */\
     opcode(LOAD_ARRAY)\
+    opcode(LOAD_ARRAY_NUM) /* LOAD_ARRAY where r2 is known to be a number in range, if r1 is an array */\
     opcode(STORE_ARRAY) \
     opcode(ALLOC_OBJECT)\
     opcode(LOAD_OBJECT)\
     opcode(STORE_OBJECT) \
+    opcode(GETFIELD) /* LOAD_OBJECT with the key a string constant: r2 is its index in storage */\
+    opcode(SETFIELD) /* STORE_OBJECT with the key a string constant: r2 is its index in storage */\
     opcode(PRECALL)\
     opcode(CALL)\
+    opcode(CALL_MULTI)\
     opcode(RET)\
+    opcode(COMPILE) /* the only instruction of a function that hasn't been compiled yet (see lazy.cpp) */\
     opcode(PRINT)\
     opcode(CLOCK)\
     opcode(RANDOM) \
@@ -96,3 +138,12 @@ struct Instruction {
         uint16_t u1;
     };
 };
+
+// JUMPF and JUMPB have a 24 bit offset: the high 8 bits in r0 and the low 16 in u1
+static const uint32_t MAX_JUMP = 0xffffff;
+inline uint32_t jump_offset(const Instruction& i) {
+    return (uint32_t(i.r0) << 16) | i.u1;
+}
+inline Instruction make_jump(Opcode op, uint32_t offset) {
+    return Instruction { .opcode = op, .r0 = uint8_t(offset >> 16), .u1 = uint16_t(offset) };
+}
@@ -10,6 +10,7 @@
 #include <cstring>
 #include <filesystem>
 #include <optional>
+#include <fstream>
 
 #include "khash2.h"
 
@@ -22,11 +23,20 @@ std::optional<std::string> read_text_file(const std::string& fname);
 TackVM* TackVM::create() {
     return new Interpreter();
 }
+TackVM* TackVM::create(TackHostAllocator* allocator) {
+    return new Interpreter(allocator);
+}
 
-Interpreter::Interpreter() {
+Interpreter::Interpreter(TackHostAllocator* allocator) :
+    heap(allocator),
+    internal_memory { .host = allocator },
+    key_cache(&internal_memory),
+    fragments(&internal_memory)
+{
     srand(time(nullptr)); // TODO: remove
     next_globalid = 0;
     stackbase = 0;
+    stacktop = 0;
 
     // create the true global scope
     global_scope.compiler = nullptr;
@@ -61,26 +71,98 @@ void Interpreter::set_gc_state(TackGCState state) {
 TackGCState Interpreter::get_gc_state() const {
     return heap.gc_state();
 }
+double Interpreter::get_gc_growth_factor() const {
+    return heap.gc_growth_factor();
+}
+void Interpreter::set_gc_growth_factor(double factor) {
+    heap.gc_growth_factor(factor);
+}
+size_t Interpreter::get_gc_soft_limit() const {
+    return heap.gc_soft_limit();
+}
+void Interpreter::set_gc_soft_limit(size_t bytes) {
+    heap.gc_soft_limit(bytes);
+}
+size_t Interpreter::get_max_heap_size() const {
+    return heap.max_heap_size();
+}
+void Interpreter::set_max_heap_size(size_t bytes) {
+    heap.max_heap_size(bytes);
+}
+void Interpreter::begin_scratch() {
+    if (heap.scratch_active()) {
+        error("begin_scratch(): already in a scratch scope");
+    }
+    heap.begin_scratch();
+}
+void Interpreter::end_scratch() {
+    if (!heap.scratch_active()) {
+        error("end_scratch(): not in a scratch scope");
+    }
+    heap.end_scratch(globals, stack, stacktop); // if called from a cfunction, everything up to its arguments is live
+}
+TackHeapStats Interpreter::get_heap_stats() const {
+    return heap.stats();
+}
+void Interpreter::set_gc_trace(std::ostream* stream) {
+    heap.trace_to(stream);
+}
+void Interpreter::set_alloc_sampling(size_t bytes_per_sample) {
+    heap.alloc_sampling(bytes_per_sample);
+}
+std::vector<TackAllocProfileEntry> Interpreter::get_alloc_profile() const {
+    return heap.alloc_profile();
+}
+void Interpreter::set_optimizer_report(std::ostream* stream) {
+    optimizer_report = stream;
+}
+void Interpreter::write_heap_snapshot(const std::string& path) {
+    auto file = std::ofstream(path, std::ios::binary);
+    if (!file.is_open()) {
+        error("Unable to write heap snapshot: " + path);
+        return;
+    }
+    auto global_names = std::vector<std::string>(globals.size());
+    for (auto m = modules.begin(); m != modules.end(); m = modules.next(m)) {
+        auto& module_name = modules.key_at(m);
+        for (auto& [name, var] : modules.value_at(m)->bindings) {
+            if (var.is_global && var.g_id < global_names.size()) {
+                global_names[var.g_id] = module_name == GLOBAL_NAMESPACE ? name : module_name + ":" + name;
+            }
+        }
+    }
+    heap.write_snapshot(file, globals, global_names, stack, stacktop);
+}
+void Interpreter::pin(TackValue value) {
+    heap.pin(value);
+}
+void Interpreter::unpin(TackValue value) {
+    heap.unpin(value);
+}
 TackValue::ArrayType* Interpreter::alloc_array() {
     return heap.alloc_array();
 }
 TackValue::ObjectType* Interpreter::alloc_object() {
     return heap.alloc_object();
 }
+TackValue::WeakRefType* Interpreter::alloc_weakref(TackValue target) {
+    return heap.alloc_weakref(target);
+}
+TackValue::WeakMapType* Interpreter::alloc_weakmap() {
+    return heap.alloc_weakmap();
+}
 TackValue::FunctionType* Interpreter::alloc_function(CodeFragment* code) {
     return heap.alloc_function(code);
 }
 TackValue::FunctionType* Interpreter::alloc_function(TackValue::CFunctionType func) {
     return heap.alloc_function(func);
 }
-BoxType* Interpreter::alloc_box(TackValue val) {
-    return heap.alloc_box(val);
-}
 TackValue::StringType* Interpreter::intern_string(const std::string& data) {
     auto got = key_cache.find(data);
     if (got == key_cache.end()) {
         auto put = key_cache.put(data);
-        auto str = new TackValue::StringType { data };
+        auto str = heap.alloc_string(data);
+        heap.pin(TackValue::string(str)); // interned strings live as long as the VM
         key_cache.value_at(put) = str;
         return str;
     }
@@ -117,6 +199,8 @@ TackValue Interpreter::get_type_name(TackType type) {
     static auto arraytype   = TackValue::string(intern_string("array"));
     // static auto cftype      = TackValue::string(intern_string("cfunction"));
     static auto ftype       = TackValue::string(intern_string("function"));
+    static auto weakreftype = TackValue::string(intern_string("weakref"));
+    static auto weakmaptype = TackValue::string(intern_string("weakmap"));
     static auto unknown     = TackValue::string(intern_string("unknown"));
 
     switch (type) {
@@ -129,6 +213,8 @@ TackValue Interpreter::get_type_name(TackType type) {
         case TackType::Array:   return arraytype;
         // case TackType::CFunction:return cftype;
         case TackType::Function:return ftype;
+        case TackType::WeakRef: return weakreftype;
+        case TackType::WeakMap: return weakmaptype;
         default: return unknown;
     }
 }
@@ -171,7 +257,7 @@ Compiler::VariableContext* Interpreter::set_global_v(const std::string& name, co
 }
 
 CodeFragment* Interpreter::create_fragment() {
-    return &fragments.emplace_back();
+    return &fragments.emplace_back(&internal_memory);
 }
 
 void Interpreter::add_module_dir_cwd() {
@@ -181,50 +267,74 @@ void Interpreter::add_module_dir(const std::string& dir) {
     module_dirs.push_back(dir);
 }
 
+// the top level scope for a module, created the first time
+Compiler::ScopeContext* Interpreter::module_scope(const std::string& module_name) {
+    auto iter = modules.find(module_name);
+    if (iter != modules.end()) {
+        return modules.value_at(iter);
+    }
+    auto scope = new Compiler::ScopeContext {};
+    scope->compiler = nullptr;
+    scope->parent_scope = &global_scope;
+    scope->is_function_scope = false;
+    modules.value_at(modules.put(module_name)) = scope;
+    return scope;
+}
+
+// find the source of a module, as named or in one of the module directories
+std::string find_module_file(const std::string& module_name, const std::vector<std::string>& module_dirs) {
+    auto path = module_name;
+    if (!std::filesystem::is_regular_file(path)) {
+        for (auto& d : module_dirs) {
+            path = std::filesystem::path(d).append(module_name).string();
+            if (std::filesystem::is_regular_file(path)) {
+                break;
+            }
+        }
+    }
+    return path;
+}
+
 Compiler::ScopeContext* Interpreter::load_module_s(const std::string& module_name) {
     auto iter = modules.find(module_name);
     if (iter == modules.end()) {
-        auto filename = module_name;
-        auto file_data = read_text_file(filename);
-        if (!file_data.has_value()) {
-            for (auto& d : module_dirs) {
-                auto path = std::filesystem::path(d).append(filename).string();
-                file_data = read_text_file(path);
-                if (file_data.has_value()) {
-                    break;
+        auto path = find_module_file(module_name, module_dirs);
+        auto* fragment = bytecode_cache ? load_cached_module(module_name, path) : nullptr;
+        if (fragment) {
+            drop_prefetched(module_name);
+        } else {
+            // parse, unless it already has been on a load thread
+            auto source = std::string {};
+            auto out_ast = AstNode {};
+            if (!take_prefetched(module_name, source, out_ast)) {
+                auto file_data = read_text_file(path);
+                if (!file_data.has_value()) {
+                    error("Unable to load module: " + module_name);
+                    return nullptr;
                 }
+                source = std::move(file_data.value());
+                parse(source, out_ast);
+                fold_constants(out_ast);
+                prefetch_imports(module_name, out_ast);
             }
-            if (!file_data.has_value()) {
-                error("Unable to load module: " + module_name);
-                return nullptr;
+            auto ast = AstNode(AstType::FuncLiteral, AstNode(AstType::ParamDef), out_ast);
+
+            // compile root fragment
+            auto compiler = Compiler { .interpreter = this };
+            fragment = create_fragment();
+            fragment->name = module_name;
+            compiler.compile_func(&ast, fragment, module_scope(module_name));
+            if (bytecode_cache) {
+                write_cached_module(module_name, path, source, ast, fragment);
             }
         }
-    
-        // parse
-        auto out_ast = AstNode {};
-        parse(file_data.value(), out_ast);
-        auto ast = AstNode(AstType::FuncLiteral, AstNode(AstType::ParamDef), out_ast);
-        
-        // create the top level scope for the module
-        auto scope = new Compiler::ScopeContext {};
-        scope->compiler = nullptr;
-        scope->parent_scope = &global_scope;
-        scope->is_function_scope = false;
-        modules.value_at(modules.put(module_name)) = scope;
-
-        // compile root fragment
-        auto compiler = Compiler { .interpreter = this };
-        auto* fragment = create_fragment();
-        fragment->name = module_name;
-        compiler.compile_func(&ast, fragment, scope);
         auto* func = heap.alloc_function(fragment);
 
         // immediately call function
-        func->refcount += 1; // HACK:
+        auto pin = TackHandle(this, TackValue::function(func));
         call(TackValue::function(func), 0, nullptr);
-        func->refcount -= 1;
 
-        return scope;
+        return module_scope(module_name);
 
     } else {
         // already loaded
@@ -246,18 +356,18 @@ void Interpreter::error(const std::string& msg) {
     //     std::cout << std::endl;
     // }
 
-    auto s = stack.base;
+    auto s = stackbase;
     auto stacktrace = std::stringstream {};
     stacktrace << msg << std::endl;
     
     // _pr->bytecode->name + " line " + std::to_string(_pr->bytecode->line_numbers[_pc];
     
-    while (true) {
+    while (s >= STACK_FRAME_OVERHEAD) {
         auto func = ((TackValue::FunctionType*)stack[s-2]._p);
-        if (func) {
-            stacktrace << " in " << func->bytecode->name << std::endl;
-            auto _pc = stack[s-3]._i; // pc
-            s = stack[s-1]._i; // base
+        auto next = stack[s-1]._i; // base
+        if (func && !func->is_cfunction && next < s) {
+            stacktrace << " in " << ((CodeFragment*)func->code_ptr)->name << std::endl;
+            s = next;
         } else {
             break;
         }
@@ -267,10 +377,17 @@ void Interpreter::error(const std::string& msg) {
 }
 
 #define handle(opcode)  break; case Opcode::opcode:
-#define REGISTER_RAW(n) stack[stack.base+n]
-#define REGISTER(n)     (*(value_is_boxed(REGISTER_RAW(n)) ? &value_to_boxed(REGISTER_RAW(n))->value : &REGISTER_RAW(n)))
+#define REGISTER_RAW(n) stack[stackbase+n]
+#define REGISTER(n)     (*(value_is_boxed(REGISTER_RAW(n)) ? value_to_boxed(REGISTER_RAW(n))->location : &REGISTER_RAW(n)))
+#define CONSTANT(n)     (((CodeFragment*)_pr->code_ptr)->storage[n])
 #define check(v, ty)    if (!(v).is_##ty()) error("type error: expected " #ty);
 #define in_error(msg)   error(msg + ((CodeFragment*)_pr->code_ptr)->name + std::to_string(((CodeFragment*)_pr->code_ptr)->line_numbers[_pc]))
+// after an instruction that allocates: if the heap is over its maximum size, collect everything that's unreachable from
+// the live registers and only fail if that didn't bring it back under
+#define check_heap()    if (heap.over_limit()) { \
+                            heap.collect(globals, stack, stackbase + ((CodeFragment*)_pr->code_ptr)->max_register + 1); \
+                            if (heap.over_limit()) in_error("out of memory: heap size exceeds " + std::to_string(heap.max_heap_size()) + " bytes in "); \
+                        }
 
 TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
     if (!fn.is_function()) {
@@ -280,7 +397,7 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
     auto* _pr = fn.function();
     if (_pr->is_cfunction) {
         // error("Interpreter::call() with cfunction");
-        return ((*((TackValue::CFunctionType*)_pr->code_ptr))(this, nargs, args));
+        return ((TackValue::CFunctionType)_pr->code_ptr)(this, nargs, args);
     }
     
     // it's a tack-defined function not a cfunction
@@ -289,11 +406,26 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
 
     // stack/registers
     auto initial_stackbase = stackbase;
-    stackbase += STACK_FRAME_OVERHEAD;
+    stackbase = stacktop + STACK_FRAME_OVERHEAD; // don't clobber the arguments of a calling cfunction
+
+    // boxes are closed as their frames return; if an error unwinds out of here instead, close the ones left open
+    // so closures that outlive the error don't point into abandoned frames
+    struct BoxCloser {
+        Heap& heap;
+        TackValue* from;
+        ~BoxCloser() { heap.close_boxes(from); }
+    } box_closer { heap, &stack[stackbase] };
+
+    // a cfunction calling back into tack carries on allocating at its own call site afterwards, error or not
+    struct SiteRestorer {
+        Heap& heap;
+        AllocSite site;
+        ~SiteRestorer() { heap.site = site; }
+    } site_restorer { heap, heap.site };
 
     // copy arguments to stack
-    if (nargs && args != &stack[stack.base]) {
-        std::memcpy(&stack[stack.base], args, sizeof(TackValue) * nargs);
+    if (nargs && args != &stack[stackbase]) {
+        std::memcpy(&stack[stackbase], args, sizeof(TackValue) * nargs);
     }
 
     // set up initial call frame
@@ -301,15 +433,31 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
     REGISTER_RAW(-2)._p = (void*)_pr;
     REGISTER_RAW(-1)._i = initial_stackbase; // special case
 
+    // create a closure for the function in storage slot index (ALLOC_FUNC, or EXTEND before it)
+    auto alloc_closure = [&](uint32_t index) {
+        auto code = (CodeFragment*)CONSTANT(index).pointer(); // assumed correct type due to compiler
+        heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
+        auto* func = heap.alloc_function(code);
+        // a variable captured from an enclosing function is already boxed; a local gets an open box,
+        // and stays in its register until it goes out of scope
+        auto* captures = func->captures();
+        for (auto n = 0u; n < func->num_captures; n++) {
+            auto& slot = REGISTER_RAW(code->capture_info[n].source_register);
+            captures[n] = value_is_boxed(slot) ? slot : value_from_boxed(heap.capture(&slot));
+        }
+        return TackValue::function(func);
+    };
+
     while (_pc < _pe) {
         auto i = ((CodeFragment*)_pr->code_ptr)->instructions[_pc];
         switch (i.opcode) {
         case Opcode::UNKNOWN: break;
             handle(ZERO_CAPTURE) {
+                heap.close_box(&REGISTER_RAW(i.r0));
                 REGISTER_RAW(i.r0) = TackValue::null();
             }
             handle(LOAD_I_SN) {
-                REGISTER(i.r0) = TackValue::number(i.u1);
+                REGISTER(i.r0) = TackValue::number(i.s1);
             }
             handle(LOAD_I_NULL) {
                 REGISTER(i.r0) = TackValue::null();
@@ -320,6 +468,17 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
             handle(LOAD_CONST) {
                 REGISTER(i.r0) = ((CodeFragment*)_pr->code_ptr)->storage[i.u1];
             }
+            handle(EXTEND) {
+                // the next instruction is a LOAD_CONST or ALLOC_FUNC whose storage index doesn't fit in u1
+                auto next = ((CodeFragment*)_pr->code_ptr)->instructions[++_pc];
+                auto index = (uint32_t(i.u1) << 16) | next.u1;
+                if (next.opcode == Opcode::LOAD_CONST) {
+                    REGISTER(next.r0) = CONSTANT(index);
+                } else {
+                    REGISTER(next.r0) = alloc_closure(index);
+                    check_heap();
+                }
+            }
             handle(INCREMENT) {
                 auto r0 = REGISTER(i.r0);
                 check(r0, number);
@@ -339,16 +498,20 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     auto l = lhs.string();
                     auto r = rhs.string();
                     auto new_str = std::string(l->data) + std::string(r->data);
+                    heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
                     REGISTER(i.r0) = TackValue::string(alloc_string(new_str));
+                    check_heap();
                 } else if (lt == TackType::Array) {
                     // array add
                     check(rhs, array);
                     auto l = lhs.array();
                     auto r = rhs.array();
-                    auto n = alloc_array();
+                    heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
+                    auto n = heap.alloc_array(uint32_t(l->data.size() + r->data.size()));
                     std::copy(l->data.begin(), l->data.end(), std::back_inserter(n->data));
                     std::copy(r->data.begin(), r->data.end(), std::back_inserter(n->data));
                     REGISTER(i.r0) = TackValue::array(n);
+                    check_heap();
                 } else {
                     in_error("operator '+' expected number / array / string");
                 }
@@ -397,6 +560,7 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     arr->data.emplace_back(rhs);
                     // put the appended value into r0
                     REGISTER(i.r0) = rhs;
+                    check_heap();
                 } else if (lhs.is_number()) {
                     check(rhs, number);
                     REGISTER(i.r0) = TackValue::number(
@@ -490,6 +654,131 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                 check(rhs, number);
                 REGISTER(i.r0) = TackValue::boolean(lhs.number() >= rhs.number());
             }
+
+            // constant operand: r2 is the index of a number in storage
+            handle(EQUALK) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1) == CONSTANT(i.u8.r2));
+            }
+            handle(NEQUALK) {
+                REGISTER(i.r0) = TackValue::boolean(!(REGISTER(i.u8.r1) == CONSTANT(i.u8.r2)));
+            }
+            handle(LESSK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::boolean(lhs.number() < CONSTANT(i.u8.r2).number());
+            }
+            handle(LESSEQK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::boolean(lhs.number() <= CONSTANT(i.u8.r2).number());
+            }
+            handle(GREATERK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::boolean(lhs.number() > CONSTANT(i.u8.r2).number());
+            }
+            handle(GREATEREQK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::boolean(lhs.number() >= CONSTANT(i.u8.r2).number());
+            }
+            handle(ADDK) {
+                auto lhs = REGISTER(i.u8.r1);
+                if (lhs.is_number()) {
+                    REGISTER(i.r0) = TackValue::number(lhs.number() + CONSTANT(i.u8.r2).number());
+                } else if (lhs.is_string()) {
+                    error("type error: expected string"); // same as ADD
+                } else if (lhs.is_array()) {
+                    error("type error: expected array");
+                } else {
+                    in_error("operator '+' expected number / array / string");
+                }
+            }
+            handle(SUBK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::number(lhs.number() - CONSTANT(i.u8.r2).number());
+            }
+            handle(MULK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::number(lhs.number() * CONSTANT(i.u8.r2).number());
+            }
+            handle(DIVK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::number(lhs.number() / CONSTANT(i.u8.r2).number());
+            }
+            handle(MODK) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, number);
+                REGISTER(i.r0) = TackValue::number(fmod(lhs.number(), CONSTANT(i.u8.r2).number()));
+            }
+
+            // the compiler has proven the operands are numbers (see specialize_number_ops)
+            handle(INCREMENT_N) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.r0).number() + 1);
+            }
+            handle(GREATER_NN) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() > REGISTER(i.u8.r2).number());
+            }
+            handle(LESS_NN) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() < REGISTER(i.u8.r2).number());
+            }
+            handle(GREATEREQ_NN) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() >= REGISTER(i.u8.r2).number());
+            }
+            handle(LESSEQ_NN) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() <= REGISTER(i.u8.r2).number());
+            }
+            handle(ADD_NN) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() + REGISTER(i.u8.r2).number());
+            }
+            handle(SUB_NN) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() - REGISTER(i.u8.r2).number());
+            }
+            handle(DIV_NN) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() / REGISTER(i.u8.r2).number());
+            }
+            handle(MUL_NN) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() * REGISTER(i.u8.r2).number());
+            }
+            handle(MOD_NN) {
+                REGISTER(i.r0) = TackValue::number(fmod(REGISTER(i.u8.r1).number(), REGISTER(i.u8.r2).number()));
+            }
+            handle(GREATERK_N) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() > CONSTANT(i.u8.r2).number());
+            }
+            handle(LESSK_N) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() < CONSTANT(i.u8.r2).number());
+            }
+            handle(GREATEREQK_N) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() >= CONSTANT(i.u8.r2).number());
+            }
+            handle(LESSEQK_N) {
+                REGISTER(i.r0) = TackValue::boolean(REGISTER(i.u8.r1).number() <= CONSTANT(i.u8.r2).number());
+            }
+            handle(ADDK_N) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() + CONSTANT(i.u8.r2).number());
+            }
+            handle(SUBK_N) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() - CONSTANT(i.u8.r2).number());
+            }
+            handle(DIVK_N) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() / CONSTANT(i.u8.r2).number());
+            }
+            handle(MULK_N) {
+                REGISTER(i.r0) = TackValue::number(REGISTER(i.u8.r1).number() * CONSTANT(i.u8.r2).number());
+            }
+            handle(MODK_N) {
+                REGISTER(i.r0) = TackValue::number(fmod(REGISTER(i.u8.r1).number(), CONSTANT(i.u8.r2).number()));
+            }
+            handle(FOR_INT_N) {
+                if (REGISTER(i.r0).number() < REGISTER(i.u8.r1).number()) {
+                    _pc++;
+                }
+            }
+
             handle(MOVE) {
                 REGISTER(i.r0) = REGISTER(i.u8.r1);
             }
@@ -572,8 +861,8 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     _pc++;
                 }
             }
-            handle(JUMPF) { _pc += i.u1 - 1; }
-            handle(JUMPB) { _pc -= i.u1 + 1; }
+            handle(JUMPF) { _pc += jump_offset(i) - 1; }
+            handle(JUMPB) { _pc -= jump_offset(i) + 1; }
             handle(LEN) {
                 auto val = REGISTER(i.u8.r1);
                 auto type = val.get_type();
@@ -583,8 +872,10 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     REGISTER(i.r0) = TackValue::number(val.string()->data.size());
                 } else if (type == TackType::Object) {
                     REGISTER(i.r0) = TackValue::number(val.object()->data.size());
+                } else if (type == TackType::WeakMap) {
+                    REGISTER(i.r0) = TackValue::number(val.weakmap()->data.size());
                 } else {
-                    in_error("operator '#' expected string / array / object");
+                    in_error("operator '#' expected string / array / object / weakmap");
                 }
             }
             handle(NEGATE) {
@@ -597,33 +888,33 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                 REGISTER(i.r0) = TackValue::boolean(!val.get_truthy());
             }
             handle(READ_CAPTURE) {
-                REGISTER_RAW(i.r0) = _pr->captures[i.u8.r1];
+                REGISTER_RAW(i.r0) = _pr->captures()[i.u8.r1];
             }
             handle(ALLOC_FUNC) {
-                // create closure
-                auto code = (CodeFragment*)((CodeFragment*)_pr->code_ptr)->storage[i.u1].pointer(); // assumed correct type due to compiler
-                auto* func = heap.alloc_function(code);
-                // capture captures; box inplace if necessary
-                for (const auto& c : code->capture_info) {
-                    auto val = REGISTER_RAW(c.source_register);
-                    if (!value_is_boxed(val)) {
-                        val = value_from_boxed(heap.alloc_box(val));
-                        REGISTER_RAW(c.source_register) = val;
-                    }
-                    func->captures.emplace_back(val);
-                }
-                // done
-                REGISTER(i.r0) = TackValue::function(func);
+                REGISTER(i.r0) = alloc_closure(i.u1);
+                check_heap();
             }
             handle(ALLOC_ARRAY) {
-                auto* arr = heap.alloc_array();
+                heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
+                auto* arr = heap.alloc_array(i.u8.r1);
                 // emplace child elements
                 for (auto e = 0; e < i.u8.r1; e++) {
                     arr->data.emplace_back(REGISTER(i.u8.r2 + e));
                 }
                 REGISTER(i.r0) = TackValue::array(arr);
+                check_heap();
+            }
+            handle(ALLOC_SPILL) {
+                heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
+                auto* arr = heap.alloc_array(i.u1);
+                for (auto e = 0; e < i.u1; e++) {
+                    arr->data.emplace_back(TackValue::null());
+                }
+                REGISTER(i.r0) = TackValue::array(arr);
+                check_heap();
             }
             handle(ALLOC_OBJECT) {
+                heap.site = { (CodeFragment*)_pr->code_ptr, _pc };
                 auto* obj = heap.alloc_object();
                 // emplace child elements
                 for (auto e = 0; e < i.u8.r1; e++) {
@@ -632,8 +923,18 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     obj->data.set(key->data, val);
                 }
                 REGISTER(i.r0) = TackValue::object(obj);
+                check_heap();
             }
-            handle(LOAD_ARRAY) {
+            handle(LOAD_ARRAY_NUM) {
+                // the compiler has proven the index is a number within the bounds of the array (see bounds.cpp);
+                // if it isn't an array after all, carry on as LOAD_ARRAY
+                auto arr_val = REGISTER(i.u8.r1);
+                if (arr_val.is_array()) {
+                    REGISTER(i.r0) = arr_val.array()->data[(uint32_t)REGISTER(i.u8.r2).number()];
+                    break;
+                }
+            } [[fallthrough]];
+            case Opcode::LOAD_ARRAY: {
                 auto arr_val = REGISTER(i.u8.r1);
                 auto ind_val = REGISTER(i.u8.r2);
 
@@ -654,8 +955,13 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                         in_error("key not found: " + ind_val.get_string());
                     }
                     REGISTER(i.r0) = obj->data.value_at(f);
+                } else if (arr_val.is_weakmap()) {
+                    // missing keys are null rather than an error, so a weakmap can be used as a cache
+                    auto* map = arr_val.weakmap();
+                    auto f = map->data.find(ind_val._i);
+                    REGISTER(i.r0) = f == map->data.end() ? TackValue::null() : map->data.value_at(f);
                 } else {
-                    in_error("[]: expected array or object");
+                    in_error("[]: expected array, object or weakmap");
                 }
             }
             handle(STORE_ARRAY) {
@@ -675,8 +981,21 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                     auto* obj = arr_val.object();
                     auto* str = ind_val.string();
                     obj->data.value_at(obj->data.put(str->data)) = REGISTER(i.r0);
+                    check_heap();
+                } else if (arr_val.is_weakmap()) {
+                    auto* map = arr_val.weakmap();
+                    auto val = REGISTER(i.r0);
+                    if (val.is_null()) {
+                        map->data.del(map->data.find(ind_val._i)); // storing null removes the key
+                    } else {
+                        if (!ind_val.is_array() && !ind_val.is_object() && !ind_val.is_function()) {
+                            in_error("weakmap key must be an array, object or function");
+                        }
+                        map->data.value_at(map->data.put(ind_val._i)) = val;
+                        check_heap();
+                    }
                 } else {
-                    in_error("[]: expected array or object");
+                    in_error("[]: expected array, object or weakmap");
                 }
             }
             handle(LOAD_OBJECT) {
@@ -746,24 +1065,61 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                 auto* obj = lhs.object();
                 auto key = key_val.string();
                 obj->data.set(key->data, REGISTER(i.r0));
+                check_heap();
             }
-            handle(CALL) {
-                auto r0 = REGISTER(i.r0);
-                auto return_reg = i.u8.r2;
+            // obj.key: the same as LOAD_OBJECT / STORE_OBJECT, with the key in storage (see peephole)
+            handle(GETFIELD) {
+                auto lhs = REGISTER(i.u8.r1);
+                if (lhs.is_number()) {
+                    // nothing yet, as in LOAD_OBJECT
+                } else if (lhs.is_object()) {
+                    auto* key = CONSTANT(i.u8.r2).string();
+                    auto found = false;
+                    auto val = lhs.object()->data.get(key->data, found);
+                    if (!found) {
+                        in_error("key not found: "s + key->data);
+                    } else {
+                        REGISTER(i.r0) = val;
+                    }
+                } else {
+                    in_error("unknown type for LOAD_OBJECT");
+                }
+            }
+            handle(SETFIELD) {
+                auto lhs = REGISTER(i.u8.r1);
+                check(lhs, object);
+                lhs.object()->data.set(CONSTANT(i.u8.r2).string()->data, REGISTER(i.r0));
+                check_heap();
+            }
+            handle(CALL_MULTI) [[fallthrough]];
+            case Opcode::CALL: {
+                // CALL_MULTI wants several results, as many as its r0; the function is in the return register instead
+                auto nresults = i.opcode == Opcode::CALL_MULTI ? i.r0 : 1u;
+                auto r0 = REGISTER((i.opcode == Opcode::CALL_MULTI ? i.u8.r2 : i.r0));
                 if (r0.is_function()) {
                     // TODO: stack overflow checking
                     // TODO: arity checking
-                    stack.push_frame(_pr, _pc, return_reg);
                     auto func = r0.function();
                     if (func->is_cfunction) {
-                        auto cfunc = (TackValue::CFunctionType*)func->code_ptr;
+                        auto cfunc = (TackValue::CFunctionType)func->code_ptr;
                         auto nargs = i.u8.r1;
                             
                         auto old_base = stackbase;
-                        stackbase = stackbase + i.u8.r2 + STACK_FRAME_OVERHEAD;                        
-                        auto retval = (*cfunc)(this, nargs, &stack[stackbase]);
+                        stackbase = stackbase + i.u8.r2 + STACK_FRAME_OVERHEAD;
+                        REGISTER_RAW(-3)._i = _pc;
+                        REGISTER_RAW(-2)._p = (void*)_pr;
+                        REGISTER_RAW(-1)._i = old_base;
+                        auto old_top = stacktop;
+                        stacktop = stackbase + nargs;
+                        heap.site = { (CodeFragment*)_pr->code_ptr, _pc }; // allocations made by the cfunction
+                        auto retval = cfunc(this, nargs, &stack[stackbase]);
+                        stacktop = old_top;
                         stackbase = old_base;
                         REGISTER_RAW(i.u8.r2) = retval;
+                        for (auto n = 1u; n < nresults; n++) {
+                            REGISTER_RAW(i.u8.r2 + n) = TackValue::null(); // cfunctions only return one value
+                        }
+                        check_heap(); // allocations made by the cfunction itself can't collect, its temporaries aren't roots
                     } else {
                         auto bytecode = (CodeFragment*)func->code_ptr;
                         auto nargs = i.u8.r1;
@@ -779,7 +1135,7 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
                         }
 
                         // set up call frame
-                        REGISTER_RAW(new_base - 3)._i = _pc; // push return addr
+                        REGISTER_RAW(new_base - 3)._i = _pc | (uint64_t(nresults) << 32); // push return addr and number of results
                         REGISTER_RAW(new_base - 2)._p = (void*)_pr; // return program
                         REGISTER_RAW(new_base - 1)._i = stackbase; // push return frameptr
 
@@ -794,24 +1150,55 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
             }
             handle(RET) {
                 auto return_val = REGISTER(i.u8.r1);
+                auto return_addr = REGISTER_RAW(-3);
+                auto return_func = REGISTER_RAW(-2);
+                auto return_stack = REGISTER_RAW(-1);
 
-                _pc = return_addr._i;
+                _pc = (uint32_t)return_addr._i;
                 _pr = (TackValue::FunctionType*)return_func._p;
                 _pe = ((CodeFragment*)_pr->code_ptr)->instructions.size();
 
+                // the results go in the caller's registers from the return register up, where the frame header and
+                // this function's registers are, so copy any besides the first out before cleaning up
+                auto nresults = (uint32_t)(return_addr._i >> 32); // set by CALL_MULTI
+                auto nvalues = 1u;
+                TackValue results[MAX_RESULTS];
+                if (nresults > 1) [[unlikely]] {
+                    nvalues = std::min(std::max((uint32_t)i.u8.r2, 1u), nresults);
+                    for (auto n = 1u; n < nvalues; n++) {
+                        results[n] = REGISTER(i.u8.r1 + n);
+                    }
+                }
+
+                heap.close_boxes(&REGISTER_RAW(0));
+
                 // "Clean" the stack - Must not leave any boxes in unused registers or subsequent loads to register will mistakenly write-through
                 std::memset(stack.data() + stackbase, 0xffffffff, MAX_REGISTERS * sizeof(TackValue));
                     
                 REGISTER_RAW(-3) = return_val;
                 REGISTER_RAW(-2) = TackValue::null();
                 REGISTER_RAW(-1) = TackValue::null();
-                heap.gc(globals, stack, stackbase);
+                for (auto n = 1u; n < nvalues; n++) {
+                    REGISTER_RAW(n - 3) = results[n]; // results the function didn't return are left null
+                }
+                heap.gc(globals, stack, stackbase + (nresults > 3 ? nresults - 3 : 0));
                     
                 stackbase = return_stack._i;
                 if (stackbase == initial_stackbase) {
                     return return_val;
                 }
-                _pe = _pr->bytecode->instructions.size();
+                _pe = ((CodeFragment*)_pr->code_ptr)->instructions.size();
+            }
+            handle(COMPILE) {
+                // first call of a function that hasn't been compiled: compile it in place and start again
+                // (compiling can load modules, which run above the arguments)
+                auto* code = (CodeFragment*)_pr->code_ptr;
+                auto old_top = stacktop;
+                stacktop = stackbase + code->max_register + 1;
+                compile_lazy(code);
+                stacktop = old_top;
+                _pe = code->instructions.size();
+                _pc = -1;
             }
         break; default: in_error("unknown instruction: " + to_string(i.opcode));
         }
@@ -826,3 +1213,4 @@ TackValue Interpreter::call(TackValue fn, int nargs, TackValue* args) {
 #undef handle
 #undef REGISTER
 #undef REGISTER_RAW
+#undef CONSTANT
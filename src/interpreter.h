@@ -2,20 +2,11 @@
 
 #include "../include/tack.h"
 #include "compiler.h"
+#include "heap.h"
 
 #include <chrono>
 #include <cstring>
 
-// Hidden box type
-struct BoxType {
-    TackValue value;
-    bool marker = false; // boxes don't need refcount
-};
-#define type_bits_boxed (0x00'0b'00'00'00'00'00'00)
-static inline TackValue value_from_boxed(BoxType* box)             { return { nan_bits | type_bits_boxed | uint64_t(box) }; }
-static inline bool value_is_boxed(TackValue v)                     { return std::isnan(v._d) && (v._i & type_bits) == type_bits_boxed; }
-static inline BoxType* value_to_boxed(TackValue v)                 { return (BoxType*)(v._i & pointer_bits); }
-
 struct Stack : std::array<TackValue, MAX_STACK> {
     uint32_t base = 0;
 
@@ -35,53 +26,33 @@ struct Stack : std::array<TackValue, MAX_STACK> {
         base = return_base;
     }
 };
-struct Heap {
-private:
-    // heap
-    std::list<TackValue::ArrayType> arrays;
-    std::list<TackValue::ObjectType> objects;
-    std::list<TackValue::FunctionType> functions;
-    std::list<BoxType> boxes;
-    std::list<TackValue::StringType> strings; // temp strings - garbage collected
-    
-    // statistics
-    std::chrono::steady_clock::time_point last_gc = std::chrono::steady_clock::now();
-    uint32_t prev_alloc_count = 0;
-    uint32_t alloc_count = 0; // a bit clumsy - counts all allocations
-    float last_gc_ms = 0.f;
-    TackGCState state = TackGCState::Enabled;
-
-public:
-    TackValue::ArrayType* alloc_array();
-    TackValue::ObjectType* alloc_object();
-    TackValue::FunctionType* alloc_function(CodeFragment* code);
-    TackValue::FunctionType* alloc_function(TackValue::CFunctionType cfunction);
-    BoxType* alloc_box(TackValue val);
-    // makes copy of data
-    TackValue::StringType* alloc_string(const std::string& data);
 
-    TackGCState gc_state() const;
-    void gc_state(TackGCState new_state);
-    void gc(std::vector<TackValue>& globals, const Stack& stack, uint32_t stackbase);
-};
+struct ModuleLoader;
 class Interpreter: public TackVM {
     std::vector<std::string> module_dirs;
     
     Heap heap;
     Stack stack;
     uint32_t stackbase;
+    uint32_t stacktop; // end of the arguments of the running cfunction; Interpreter::call() pushes above this
     std::vector<TackValue> globals;
     uint16_t next_globalid;
-    KHash<std::string, TackValue::StringType*> key_cache; // TODO: move this into heap and use the refcount mechanism (and rename it!)
+    TackMemoryAccount internal_memory; // compiled code and the interned string table (the strings themselves are in the heap)
+    KHash<std::string, TackValue::StringType*, std::hash<std::string>, TackAllocator<TackValue::StringType*>> key_cache; // interned strings; allocated in the heap and pinned (TODO: rename it!)
 
     Compiler::ScopeContext global_scope; // c-provided globals go here
     KHash<std::string, Compiler::ScopeContext*> modules; // all loaded modules; "" is global module and is always implicitly imported
-    std::list<CodeFragment> fragments;
+    std::list<CodeFragment, TackAllocator<CodeFragment>> fragments;
 
     void* user_pointer = nullptr;
+    std::ostream* optimizer_report = nullptr;
+    bool bytecode_cache = false;
+    std::string bytecode_cache_dir; // empty to put .tackc files next to the sources
+    bool lazy_compile = false;
+    std::shared_ptr<ModuleLoader> loader; // parses imported modules ahead of time, if there are load threads (see loader.cpp)
 
 public:
-    Interpreter();
+    explicit Interpreter(TackHostAllocator* allocator = nullptr);
     ~Interpreter();
 
     Interpreter(const Interpreter&) = delete;
@@ -93,6 +64,25 @@ public:
     void set_user_pointer(void* ptr) override;
     TackGCState get_gc_state() const override;
     void set_gc_state(TackGCState state) override;
+    double get_gc_growth_factor() const override;
+    void set_gc_growth_factor(double factor) override;
+    size_t get_gc_soft_limit() const override;
+    void set_gc_soft_limit(size_t bytes) override;
+    size_t get_max_heap_size() const override;
+    void set_max_heap_size(size_t bytes) override;
+    void begin_scratch() override;
+    void end_scratch() override;
+    TackHeapStats get_heap_stats() const override;
+    void set_gc_trace(std::ostream* stream) override;
+    void set_alloc_sampling(size_t bytes_per_sample) override;
+    std::vector<TackAllocProfileEntry> get_alloc_profile() const override;
+    void set_optimizer_report(std::ostream* stream) override;
+    void set_bytecode_cache(bool enabled, const std::string& dir) override;
+    void set_lazy_compile(bool enabled) override;
+    void set_load_threads(uint32_t threads) override;
+    void write_heap_snapshot(const std::string& path) override;
+    void pin(TackValue value) override;
+    void unpin(TackValue value) override;
 
     inline void set_global(const std::string& name, TackValue value, bool is_const) override { set_global_v(name, value, is_const); }
     inline void set_global(const std::string& name, const std::string& module_name, TackValue value, bool is_const) override { set_global_v(name, module_name, value, is_const); }
@@ -109,19 +99,36 @@ public:
     
     TackValue::ArrayType* alloc_array() override;
     TackValue::ObjectType* alloc_object() override;
+    TackValue::WeakRefType* alloc_weakref(TackValue target) override;
+    TackValue::WeakMapType* alloc_weakmap() override;
     TackValue::StringType* alloc_string(const std::string& data) override;
     TackValue::StringType* intern_string(const std::string& data) override;
     TackValue::FunctionType* alloc_function(CodeFragment* code);
     TackValue::FunctionType* alloc_function(TackValue::CFunctionType cfunction);
 
     CodeFragment* create_fragment();
-    BoxType* alloc_box(TackValue val);
+    inline std::ostream* get_optimizer_report() const { return optimizer_report; }
     void add_module_dir_cwd();
     Compiler::VariableContext* set_global_v(const std::string& name, TackValue value, bool is_const);
     Compiler::VariableContext* set_global_v(const std::string& name, const std::string& module_name, TackValue value, bool is_const);
     Compiler::ScopeContext* load_module_s(const std::string& filename);
+    Compiler::ScopeContext* module_scope(const std::string& module_name);
 
 private:
     bool parse(const std::string& code, AstNode& out_ast);
     uint16_t next_gid();    
+
+    // bytecode cache (see cache.cpp)
+    std::string cache_path(const std::string& source_path) const;
+    CodeFragment* load_cached_module(const std::string& module_name, const std::string& source_path);
+    void write_cached_module(const std::string& module_name, const std::string& source_path, const std::string& source, const AstNode& ast, CodeFragment* root);
+
+    // lazy compilation (see lazy.cpp)
+    bool parse_lazy_block(const AstNode& lazy, AstNode& out_ast);
+    void compile_lazy(CodeFragment* fragment);
+
+    // parsing modules ahead of loading them (see loader.cpp)
+    void prefetch_imports(const std::string& module_name, const AstNode& ast);
+    bool take_prefetched(const std::string& module_name, std::string& source, AstNode& ast);
+    void drop_prefetched(const std::string& module_name);
 };
@@ -3,6 +3,7 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <memory>
 #include <assert.h>
 
 // Adapted from khash (commit: 5fc2090) to have a more C++-friendly interface
@@ -59,24 +60,26 @@ static inline uint32_t hash_string(const std::string& s) {
     return h;
 }
 
-template<typename KeyType, typename ValType, typename HashFunc = std::hash<KeyType>>
+template<typename KeyType, typename ValType, typename HashFunc = std::hash<KeyType>, typename Alloc = std::allocator<ValType>>
 struct KHash {
     using Iterator = uint32_t;
     
 private:    
+    template<typename T> using Vector = std::vector<T, typename std::allocator_traits<Alloc>::template rebind_alloc<T>>;
+
     uint32_t n_buckets;
     uint32_t size_;
     uint32_t n_occupied;
     uint32_t upper_bound;
     
-    std::vector<uint32_t> flags;
-    std::vector<KeyType> keys;
-    std::vector<ValType> vals;
+    Vector<uint32_t> flags;
+    Vector<KeyType> keys;
+    Vector<ValType> vals;
     HashFunc hash_func;
     #define cmp_func(a, b) ((a) == (b)) // HACK:
 
 public:
-    KHash(): n_buckets(0), size_(0), n_occupied(0), upper_bound(0) {}
+    KHash(const Alloc& alloc = Alloc()): n_buckets(0), size_(0), n_occupied(0), upper_bound(0), flags(alloc), keys(alloc), vals(alloc) {}
     ~KHash() {}
     KHash(const KHash&) = delete;
     KHash& operator=(const KHash&) = delete;
@@ -112,9 +115,14 @@ public:
         }
     }
 
+    // bytes held by the bucket arrays (not counting anything the keys or values point to)
+    size_t memory_usage() const {
+        return flags.capacity() * sizeof(uint32_t) + keys.capacity() * sizeof(KeyType) + vals.capacity() * sizeof(ValType);
+    }
+
     int resize(uint32_t new_n_buckets) {
         auto rehash_needed = true;
-        auto new_flags = std::vector<uint32_t>{};
+        auto new_flags = Vector<uint32_t>(flags.get_allocator());
 
         kroundup32(new_n_buckets);
         if (new_n_buckets < 4) {
@@ -125,7 +133,7 @@ public:
             rehash_needed = false;
         } else {
             // hash table size to be changed (shrink or expand); must rehash
-            new_flags = std::vector<uint32_t>(__ac_fsize(new_n_buckets), 0xaaaaaaaa);
+            new_flags = Vector<uint32_t>(__ac_fsize(new_n_buckets), 0xaaaaaaaa, flags.get_allocator());
             if (n_buckets < new_n_buckets) {
                 // expand
                 keys.resize(new_n_buckets);
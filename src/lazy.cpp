@@ -0,0 +1,99 @@
+#include "interpreter.h"
+#include "parsing.h"
+
+#include <unordered_map>
+#include <unordered_set>
+
+// Lazy compilation
+// With it on, the parser skims over each function body instead of parsing it (see parse_lazy_block), keeping only the text
+// and the names used in it. The function is compiled as a stub: a single COMPILE instruction, and the captures the body
+// could need, which has to be known up front since the enclosing function allocates the closure (and its optimizer
+// works out which registers are captured). Every name in the body that resolves to a variable of an enclosing function
+// is captured, which might be more than the body really uses, but never less
+// On the first call, COMPILE parses the body and compiles it into the stub's fragment, so every closure of it gets the
+// code. The scopes the stub was compiled in are gone by then: what the body's names resolved to is kept instead (the
+// enclosing functions' registers, and globals), along with the literal consts it can see for constant folding
+
+struct LazyFunction {
+    AstNode func; // the FuncLiteral, with the LazyBlock body
+    std::unordered_map<std::string, Compiler::VariableContext> names; // the variables outside the function it can use
+};
+
+void Interpreter::set_lazy_compile(bool enabled) {
+    lazy_compile = enabled;
+}
+
+void Compiler::compile_stub(const AstNode* node, CodeFragment* output, ScopeContext* parent_scope) {
+    this->output = output;
+    this->node = node;
+    push_scope(parent_scope, true);
+    auto nargs = node->children[0].children.size(); // ParamDef
+    for (auto i = 0u; i < nargs; i++) {
+        bind_name(node->children[0].children[i].data_s, i, false);
+    }
+
+    // capture everything the body might use, except the consts that will be substituted
+    auto& body = node->children[1]; // LazyBlock
+    auto consts = std::unordered_set<std::string> {};
+    for (auto& c : body.children) {
+        if (c.type == AstType::ConstDeclStat) {
+            consts.insert(c.children[0].data_s);
+        }
+    }
+    auto lazy = std::make_shared<LazyFunction>();
+    lazy->func = *node;
+    for (auto& c : body.children) {
+        if (c.type != AstType::Identifier || consts.contains(c.data_s) || scopes.back().bindings.contains(c.data_s)) {
+            continue;
+        }
+        auto ncaptures = output->capture_info.size();
+        if (auto var = lookup(c.data_s)) {
+            if (output->capture_info.size() > ncaptures) {
+                lazy->names[c.data_s] = VariableContext {
+                    .reg = output->capture_info.back().source_register, .is_const = var->is_const, .spill = var->spill };
+            } else {
+                lazy->names[c.data_s] = *var; // global
+            }
+        }
+    }
+    pop_scope();
+
+    output->instructions.clear();
+    output->line_numbers.clear();
+    emit_ins(Opcode::COMPILE, 0, 0, 0, body.line_number);
+    output->max_register = nargs ? (uint32_t)nargs - 1 : 0;
+    output->lazy = lazy;
+}
+
+void Interpreter::compile_lazy(CodeFragment* fragment) {
+    auto lazy = fragment->lazy;
+    auto& params = lazy->func.children[0];
+    auto& block = lazy->func.children[1];
+    auto body = AstNode {};
+    parse_lazy_block(block, body);
+
+    // fold as if the consts were declared just before the function
+    auto ast = AstNode(AstType::StatList);
+    for (auto& c : block.children) {
+        if (c.type == AstType::ConstDeclStat) {
+            ast.children.emplace_back(c);
+        }
+    }
+    ast.children.emplace_back(AstType::FuncLiteral, params, std::move(body));
+    ast.children.back().line_number = lazy->func.line_number;
+    fold_constants(ast);
+
+    // compile to the side, so an error leaves the stub as it was
+    auto compiled = CodeFragment { &internal_memory };
+    compiled.name = fragment->name;
+    compiled.capture_info = fragment->capture_info;
+    auto compiler = Compiler { .interpreter = this };
+    auto scope = Compiler::ScopeContext { .compiler = &compiler, .bindings = lazy->names };
+    compiler.compile_func(&ast.children.back(), &compiled, &scope);
+
+    fragment->instructions.swap(compiled.instructions);
+    fragment->line_numbers.swap(compiled.line_numbers);
+    fragment->storage.swap(compiled.storage);
+    fragment->max_register = compiled.max_register;
+    fragment->lazy.reset();
+}
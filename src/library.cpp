@@ -3,6 +3,7 @@
 #include <sstream>
 #include <fstream>
 #include <optional>
+#include <algorithm>
 
 using namespace std::string_literals;
 static const double pi = 3.141592653589793;
@@ -168,6 +169,58 @@ tack_func(gc_enable) {
     vm->set_gc_state(TackGCState::Enabled);
     return TackValue::null();
 }
+tack_func(gc_stats) {
+    auto stats = vm->get_heap_stats();
+    auto* obj = vm->alloc_object();
+    auto type_stats = [&](const char* name, const TackHeapStats::TypeStats& t) {
+        auto* o = vm->alloc_object();
+        o->data.set("count", TackValue::number(t.count));
+        o->data.set("bytes", TackValue::number(t.bytes));
+        obj->data.set(name, TackValue::object(o));
+    };
+    type_stats("strings", stats.strings);
+    type_stats("arrays", stats.arrays);
+    type_stats("objects", stats.objects);
+    type_stats("functions", stats.functions);
+    type_stats("boxes", stats.boxes);
+    type_stats("weakrefs", stats.weakrefs);
+    type_stats("weakmaps", stats.weakmaps);
+    obj->data.set("live_bytes", TackValue::number(stats.live_bytes));
+    obj->data.set("gc_threshold", TackValue::number(stats.gc_threshold));
+    obj->data.set("bytes_allocated", TackValue::number(stats.bytes_allocated));
+    obj->data.set("bytes_reclaimed", TackValue::number(stats.bytes_reclaimed));
+    obj->data.set("collections", TackValue::number(stats.collections));
+    obj->data.set("total_pause_ms", TackValue::number(stats.total_pause_ms));
+    obj->data.set("max_pause_ms", TackValue::number(stats.max_pause_ms));
+    return TackValue::object(obj);
+}
+tack_func(heap_snapshot) {
+    check_args(1);
+    check_arg(0, string);
+    vm->write_heap_snapshot(args[0].string()->data);
+    return TackValue::null();
+}
+tack_func(alloc_sampling) {
+    check_args(1);
+    check_arg(0, number);
+    vm->set_alloc_sampling((size_t)std::max(args[0].number(), 0.0));
+    return TackValue::null();
+}
+tack_func(alloc_profile) {
+    auto profile = vm->get_alloc_profile();
+    auto* arr = vm->alloc_array();
+    for (auto& entry : profile) {
+        auto* obj = vm->alloc_object();
+        obj->data.set("function", TackValue::string(vm->alloc_string(entry.function)));
+        obj->data.set("line", TackValue::number(entry.line));
+        obj->data.set("type", TackValue::string(vm->alloc_string(entry.type)));
+        obj->data.set("samples", TackValue::number((double)entry.samples));
+        obj->data.set("objects", TackValue::number(std::round(entry.objects)));
+        obj->data.set("bytes", TackValue::number(std::round(entry.bytes)));
+        arr->data.push_back(TackValue::object(obj));
+    }
+    return TackValue::array(arr);
+}
 // tack_func(read_file)
 // tack_func(write_file)
 // tack_func(read)
@@ -241,11 +294,10 @@ tack_func(map) {
 
     if (arr->data.size()) {
         retval->data.reserve(arr->data.size());
-        retval->refcount = 1;
+        auto pin = TackHandle(vm, TackValue::array(retval));
         for (auto& val: arr->data) {
             retval->data.emplace_back(vm->call(args[1], 1, &val));
         }
-        retval->refcount = 0;
     }
 
     return TackValue::array(retval);
@@ -258,13 +310,12 @@ tack_func(filter) {
     auto* retval = vm->alloc_array();
     
     if (arr->data.size()) {
-        retval->refcount = 1;
+        auto pin = TackHandle(vm, TackValue::array(retval));
         for (auto& val: arr->data) {
             if (vm->call(args[1], 1, &val).get_truthy()) {
                 retval->data.emplace_back(val);
             }
         }
-        retval->refcount = 0;
     }
 
     return TackValue::array(retval);
@@ -292,7 +343,7 @@ TackValue tack_sort_default(TackVM* vm, TackValue::ArrayType* arr) {
     // behaviour will be undefined for sort called with a mixed-type array and no custom predicate
     auto retval = vm->alloc_array();
     if (arr->data.size()) {
-        retval->refcount = 1;
+        auto pin = TackHandle(vm, TackValue::array(retval));
         std::copy(arr->data.begin(), arr->data.end(), std::back_inserter(retval->data));
         auto type = arr->data.at(0).get_type();
         if (type == TackType::Number) {
@@ -312,7 +363,6 @@ TackValue tack_sort_default(TackVM* vm, TackValue::ArrayType* arr) {
         } else {
             vm->error("sort: expects an array of number or an array of string");
         }
-        retval->refcount = 0;
     }
     return TackValue::array(retval);
 }
@@ -320,13 +370,12 @@ TackValue tack_sort_custom(TackVM* vm, TackValue::ArrayType* arr, TackValue func
     auto retval = vm->alloc_array();
 
     if (arr->data.size()) {
-        retval->refcount = 1;
+        auto pin = TackHandle(vm, TackValue::array(retval));
         std::copy(arr->data.begin(), arr->data.end(), std::back_inserter(retval->data));
         std::sort(retval->data.begin(), retval->data.end(), [&](TackValue l, TackValue r) {
             auto lr = std::array<TackValue, 2> { l, r };
-            return vm->call(func, 1, lr.data()).get_truthy();
+            return vm->call(func, 2, lr.data()).get_truthy();
         });
-        retval->refcount = 0;
     }
 
     return TackValue::array(retval);
@@ -771,6 +820,21 @@ tack_func(values) {
     return TackValue::array(arr);
 }
 
+// weak references
+tack_func(weakref) {
+    check_args(1);
+    return TackValue::weakref(vm->alloc_weakref(args[0]));
+}
+tack_func(deref) {
+    check_args(1);
+    check_arg(0, weakref);
+    return args[0].weakref()->target;
+}
+tack_func(weakmap) {
+    check_args(0);
+    return TackValue::weakmap(vm->alloc_weakmap());
+}
+
 // math
 tack_func(radtodeg) {
     check_args(1);
@@ -831,6 +895,10 @@ void Interpreter::add_libs() {
     tack_bind(clock);
     tack_bind(gc_disable);
     tack_bind(gc_enable);
+    tack_bind(gc_stats);
+    tack_bind(heap_snapshot);
+    tack_bind(alloc_sampling);
+    tack_bind(alloc_profile);
     // tack_bind(read_file);
     // tack_bind(write_file);
     // tack_bind(getline);
@@ -881,6 +949,11 @@ void Interpreter::add_libs() {
     tack_bind(keys);
     tack_bind(values);
 
+    // weak references
+    tack_bind(weakref);
+    tack_bind(deref);
+    tack_bind(weakmap);
+
     // math
     tack_bind(radtodeg);
     tack_bind(degtorad);
@@ -0,0 +1,205 @@
+#include "interpreter.h"
+#include "parsing.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Parsing modules ahead of time
+// A module is compiled and run as its import is compiled, so the order modules are loaded in (and their global ids) is
+// down to the interpreter's thread. Reading and parsing a module doesn't depend on anything else though: as soon as one
+// is parsed, the modules its import statements name are read and parsed on a pool of threads (and then theirs, and so on
+// down the import graph) while the interpreter compiles it. By the time an import is compiled, the module is usually
+// parsed already; if it hasn't been started yet the interpreter parses it itself rather than wait
+// Nothing on the threads touches the interpreter: strings are interned and globals declared by the compiler, later.
+// Errors are kept until the module is imported, so they happen in the same place they would without the threads
+
+std::optional<std::string> read_text_file(const std::string& fname);
+std::string find_module_file(const std::string& module_name, const std::vector<std::string>& module_dirs);
+
+namespace {
+
+struct ParsedModule {
+    std::string source;
+    AstNode ast;
+    std::string error; // if the module couldn't be read or parsed
+};
+
+// the modules named by the import statements in a module
+void find_imports(const AstNode& node, std::vector<std::string>& out) {
+    if (node.type == AstType::ImportStat) {
+        out.emplace_back(node.children[0].data_s + ".tack");
+        return;
+    }
+    for (auto& c : node.children) {
+        find_imports(c, out);
+    }
+}
+
+}
+
+struct ModuleLoader {
+    struct Task {
+        std::string module_name;
+        std::function<void()> run;
+    };
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Task> tasks;
+    bool stopping = false;
+    std::unordered_set<std::string> seen; // modules that have been parsed (or started), here or by the interpreter
+    std::unordered_map<std::string, std::future<ParsedModule>> parsed;
+
+    explicit ModuleLoader(uint32_t num_threads) {
+        for (auto i = 0u; i < num_threads; i++) {
+            threads.emplace_back([this] { work(); });
+        }
+    }
+    ~ModuleLoader() {
+        {
+            auto lock = std::lock_guard { mutex };
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void work() {
+        while (true) {
+            auto task = Task {};
+            {
+                auto lock = std::unique_lock { mutex };
+                wake.wait(lock, [&] { return stopping || !tasks.empty(); });
+                if (stopping) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task.run();
+        }
+    }
+
+    // start parsing a module on the pool, unless it's been seen already
+    void prefetch(const std::string& module_name, const std::vector<std::string>& module_dirs, bool lazy_bodies) {
+        auto lock = std::lock_guard { mutex };
+        if (!seen.insert(module_name).second) {
+            return;
+        }
+        auto result = std::make_shared<std::promise<ParsedModule>>();
+        parsed.emplace(module_name, result->get_future());
+        tasks.emplace_back(Task { module_name, [=, this] {
+            result->set_value(parse(module_name, module_dirs, lazy_bodies));
+        } });
+        wake.notify_one();
+    }
+
+    // read and parse a module, then start on the modules it imports
+    ParsedModule parse(const std::string& module_name, const std::vector<std::string>& module_dirs, bool lazy_bodies) {
+        auto module = ParsedModule {};
+        auto file_data = read_text_file(find_module_file(module_name, module_dirs));
+        if (!file_data.has_value()) {
+            module.error = "Unable to load module: " + module_name;
+            return module;
+        }
+        try {
+            parse_module_source(file_data.value(), module.ast, lazy_bodies);
+            fold_constants(module.ast);
+        } catch (const std::exception& e) {
+            module.error = e.what();
+            return module;
+        }
+        module.source = std::move(file_data.value());
+
+        auto imports = std::vector<std::string> {};
+        find_imports(module.ast, imports);
+        for (auto& name : imports) {
+            prefetch(name, module_dirs, lazy_bodies);
+        }
+        return module;
+    }
+
+    // the parsed module, parsing it now if no thread has started on it or waiting for the one that has;
+    // false if it was never prefetched
+    bool take(const std::string& module_name, ParsedModule& out) {
+        auto result = std::future<ParsedModule> {};
+        auto task = Task {};
+        {
+            auto lock = std::lock_guard { mutex };
+            auto iter = parsed.find(module_name);
+            if (iter == parsed.end()) {
+                return false;
+            }
+            result = std::move(iter->second);
+            parsed.erase(iter);
+            auto queued = std::find_if(tasks.begin(), tasks.end(), [&](const Task& t) { return t.module_name == module_name; });
+            if (queued != tasks.end()) {
+                task = std::move(*queued);
+                tasks.erase(queued);
+            }
+        }
+        if (task.run) {
+            task.run();
+        }
+        out = result.get();
+        return true;
+    }
+
+    // a module the interpreter has parsed or loaded itself
+    void loaded(const std::string& module_name) {
+        auto lock = std::lock_guard { mutex };
+        seen.insert(module_name);
+        parsed.erase(module_name);
+    }
+};
+
+void Interpreter::set_load_threads(uint32_t threads) {
+    loader.reset(); // waits for the threads to finish what they're parsing
+    if (threads) {
+        loader = std::make_shared<ModuleLoader>(threads);
+    }
+}
+
+void Interpreter::prefetch_imports(const std::string& module_name, const AstNode& ast) {
+    if (!loader) {
+        return;
+    }
+    loader->loaded(module_name);
+    auto imports = std::vector<std::string> {};
+    find_imports(ast, imports);
+    for (auto& name : imports) {
+        if (modules.find(name) == modules.end()) {
+            loader->prefetch(name, module_dirs, lazy_compile && !bytecode_cache);
+        }
+    }
+}
+
+bool Interpreter::take_prefetched(const std::string& module_name, std::string& source, AstNode& ast) {
+    auto module = ParsedModule {};
+    if (!loader || !loader->take(module_name, module)) {
+        return false;
+    }
+    if (module.error.size()) {
+        error(module.error);
+    }
+    source = std::move(module.source);
+    ast = std::move(module.ast);
+    return true;
+}
+
+void Interpreter::drop_prefetched(const std::string& module_name) {
+    if (loader) {
+        loader->loaded(module_name);
+    }
+}
@@ -0,0 +1,947 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+
+// r0 = f(r1, r2), reading both before writing r0
+bool is_binary(Opcode op) {
+    switch (op) {
+        case Opcode::EQUAL: case Opcode::NEQUAL: case Opcode::GREATER: case Opcode::LESS: case Opcode::GREATEREQ:
+        case Opcode::LESSEQ: case Opcode::ADD: case Opcode::SUB: case Opcode::DIV: case Opcode::MUL: case Opcode::MOD:
+        case Opcode::POW: case Opcode::SHL: case Opcode::SHR: case Opcode::BITAND: case Opcode::BITOR: case Opcode::BITXOR:
+        case Opcode::IN: case Opcode::AND: case Opcode::OR: case Opcode::LOAD_ARRAY: case Opcode::LOAD_ARRAY_NUM:
+        case Opcode::LOAD_OBJECT: case Opcode::GREATER_NN: case Opcode::LESS_NN: case Opcode::GREATEREQ_NN:
+        case Opcode::LESSEQ_NN: case Opcode::ADD_NN: case Opcode::SUB_NN: case Opcode::DIV_NN: case Opcode::MUL_NN:
+        case Opcode::MOD_NN:
+            return true;
+        default:
+            return false;
+    }
+}
+// r0 = f(r1, constant), r2 being the index of the constant in storage
+bool is_binary_k(Opcode op) {
+    switch (op) {
+        case Opcode::EQUALK: case Opcode::NEQUALK: case Opcode::GREATERK: case Opcode::LESSK: case Opcode::GREATEREQK:
+        case Opcode::LESSEQK: case Opcode::ADDK: case Opcode::SUBK: case Opcode::DIVK: case Opcode::MULK: case Opcode::MODK:
+        case Opcode::GREATERK_N: case Opcode::LESSK_N: case Opcode::GREATEREQK_N: case Opcode::LESSEQK_N:
+        case Opcode::ADDK_N: case Opcode::SUBK_N: case Opcode::DIVK_N: case Opcode::MULK_N: case Opcode::MODK_N:
+            return true;
+        default:
+            return false;
+    }
+}
+// r0 = f(r1)
+bool is_unary(Opcode op) {
+    return op == Opcode::MOVE || op == Opcode::NEGATE || op == Opcode::NOT || op == Opcode::BITNOT || op == Opcode::LEN;
+}
+// r0 = something that doesn't depend on any register
+bool is_load(Opcode op) {
+    return op == Opcode::LOAD_CONST || op == Opcode::LOAD_I_SN || op == Opcode::LOAD_I_BOOL || op == Opcode::LOAD_I_NULL
+        || op == Opcode::READ_GLOBAL;
+}
+bool is_call(Opcode op) {
+    return op == Opcode::CALL || op == Opcode::CALL_MULTI;
+}
+// skips the next instruction (always a JUMPF) on some condition
+bool is_conditional_skip(Opcode op) {
+    return op == Opcode::CONDSKIP || op == Opcode::FOR_INT || op == Opcode::FOR_INT_N || op == Opcode::FOR_ITER
+        || op == Opcode::FOR_ITER2;
+}
+
+// the result only depends on the operand values, and if it succeeds once it will again with the same operands
+// (not ADD: adding arrays or strings makes a new one every time; not LEN/LOAD_*: arrays and objects can change)
+bool is_pure(Opcode op) {
+    switch (op) {
+        case Opcode::EQUAL: case Opcode::NEQUAL: case Opcode::GREATER: case Opcode::LESS: case Opcode::GREATEREQ:
+        case Opcode::LESSEQ: case Opcode::SUB: case Opcode::DIV: case Opcode::MUL: case Opcode::MOD: case Opcode::POW:
+        case Opcode::AND: case Opcode::OR: case Opcode::NEGATE: case Opcode::NOT: case Opcode::GREATER_NN:
+        case Opcode::LESS_NN: case Opcode::GREATEREQ_NN: case Opcode::LESSEQ_NN: case Opcode::ADD_NN: case Opcode::SUB_NN:
+        case Opcode::DIV_NN: case Opcode::MUL_NN: case Opcode::MOD_NN:
+            return true;
+        default:
+            return is_binary_k(op);
+    }
+}
+// no effect besides writing r0, and can't fail, so it can go if r0 is never read
+bool is_removable(Opcode op) {
+    switch (op) {
+        case Opcode::MOVE: case Opcode::NOT: case Opcode::EQUAL: case Opcode::NEQUAL: case Opcode::EQUALK:
+        case Opcode::NEQUALK: case Opcode::AND: case Opcode::OR:
+            return true;
+        default:
+            return is_load(op);
+    }
+}
+// writes r0 through REGISTER() after it's done reading its operands, and nothing else, so it can write somewhere else
+// (not LOAD_OBJECT: looking something up on a number leaves r0 as it was, for now)
+bool is_retargetable(Opcode op) {
+    return (is_binary(op) && op != Opcode::LOAD_OBJECT) || is_binary_k(op) || is_unary(op) || is_load(op)
+        || op == Opcode::ALLOC_ARRAY || op == Opcode::ALLOC_OBJECT || op == Opcode::ALLOC_FUNC;
+}
+
+void set_range(RegisterSet& set, uint32_t first, uint32_t count) {
+    for (auto r = first; r < first + count && r < MAX_REGISTERS; r++) {
+        set.set(r);
+    }
+}
+
+// call f on each operand that is a plain read of a single register, so it can be replaced with another register
+template<typename F> void for_each_register_read(Instruction& ins, F f) {
+    auto op = ins.opcode;
+    if (is_binary(op)) {
+        f(ins.u8.r1);
+        f(ins.u8.r2);
+    } else if (is_binary_k(op) || is_unary(op)) {
+        f(ins.u8.r1);
+    } else if (op == Opcode::STORE_ARRAY || op == Opcode::STORE_OBJECT) {
+        f(ins.r0);
+        f(ins.u8.r1);
+        f(ins.u8.r2);
+    } else if (op == Opcode::GETFIELD) {
+        f(ins.u8.r1);
+    } else if (op == Opcode::SETFIELD) {
+        f(ins.r0);
+        f(ins.u8.r1);
+    } else if (op == Opcode::WRITE_GLOBAL || op == Opcode::CONDSKIP || op == Opcode::CALL) {
+        f(ins.r0);
+    } else if (op == Opcode::RET && ins.r0 && ins.u8.r2 <= 1) {
+        f(ins.u8.r1);
+    }
+}
+
+}
+
+FlowGraph::FlowGraph(CodeFragment* fragment, const RegisterSet& variables): fragment(fragment), variables(variables) {
+    auto& code = fragment->instructions;
+    auto size = (uint32_t)code.size();
+
+    // registers that can hold boxes or raw loop state
+    for (auto& ins : code) {
+        switch (ins.opcode) {
+            case Opcode::READ_CAPTURE: case Opcode::ZERO_CAPTURE:
+            case Opcode::FOR_ITER_INIT: case Opcode::FOR_ITER: case Opcode::FOR_ITER2: case Opcode::FOR_ITER_NEXT:
+                pinned.set(ins.r0);
+                break;
+            case Opcode::ALLOC_FUNC: {
+                auto* func = (CodeFragment*)fragment->storage[ins.u1].pointer();
+                for (auto& capture : func->capture_info) {
+                    pinned.set(capture.source_register);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // split into blocks: a block starts at a jump target or after a jump, and ends at a jump
+    auto leaders = std::vector<bool>(size + 1, false);
+    leaders[0] = true;
+    for (auto pc = 0u; pc < size; pc++) {
+        auto& ins = code[pc];
+        if (ins.opcode == Opcode::JUMPF) {
+            leaders[pc + jump_offset(ins)] = true;
+            leaders[pc + 1] = true;
+        } else if (ins.opcode == Opcode::JUMPB) {
+            leaders[pc - jump_offset(ins)] = true;
+            leaders[pc + 1] = true;
+        } else if (is_conditional_skip(ins.opcode)) {
+            leaders[pc + 1] = true;
+            leaders[std::min(pc + 2, size)] = true;
+        } else if (ins.opcode == Opcode::RET) {
+            leaders[pc + 1] = true;
+        }
+    }
+    block_of.resize(size);
+    for (auto pc = 0u; pc < size; pc++) {
+        if (leaders[pc]) {
+            blocks.emplace_back(BasicBlock { .begin = pc });
+        }
+        blocks.back().end = pc + 1;
+        block_of[pc] = (uint32_t)blocks.size() - 1;
+    }
+
+    // link them up
+    auto link = [&](uint32_t from, uint32_t to_pc) {
+        if (to_pc < size) {
+            blocks[from].successors.emplace_back(block_of[to_pc]);
+            blocks[block_of[to_pc]].predecessors.emplace_back(from);
+        }
+    };
+    for (auto b = 0u; b < blocks.size(); b++) {
+        auto last = blocks[b].end - 1;
+        auto& ins = code[last];
+        if (ins.opcode == Opcode::JUMPF) {
+            link(b, last + jump_offset(ins));
+        } else if (ins.opcode == Opcode::JUMPB) {
+            link(b, last - jump_offset(ins));
+        } else if (is_conditional_skip(ins.opcode)) {
+            link(b, last + 1);
+            link(b, last + 2);
+        } else if (ins.opcode != Opcode::RET) {
+            link(b, last + 1);
+        }
+    }
+}
+
+Operands FlowGraph::operands(uint32_t pc) const {
+    auto& ins = fragment->instructions[pc];
+    auto op = ins.opcode;
+    auto res = Operands {};
+    if (op == Opcode::UNKNOWN) {
+        return res;
+    }
+    if (is_binary(op)) {
+        res.reads.set(ins.u8.r1);
+        res.reads.set(ins.u8.r2);
+        res.writes.set(ins.r0);
+        res.may_skip_write = op == Opcode::LOAD_OBJECT;
+    } else if (is_binary_k(op) || is_unary(op)) {
+        res.reads.set(ins.u8.r1);
+        res.writes.set(ins.r0);
+    } else if (is_load(op) || op == Opcode::READ_CAPTURE) {
+        res.writes.set(ins.r0);
+    } else {
+        switch (op) {
+            case Opcode::INCREMENT: case Opcode::INCREMENT_N: case Opcode::ZERO_CAPTURE:
+                res.reads.set(ins.r0);
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::WRITE_GLOBAL: case Opcode::CONDSKIP:
+                res.reads.set(ins.r0);
+                break;
+            case Opcode::FOR_INT: case Opcode::FOR_INT_N:
+                res.reads.set(ins.r0);
+                res.reads.set(ins.u8.r1);
+                break;
+            case Opcode::FOR_ITER_INIT:
+                res.reads.set(ins.u8.r1);
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::FOR_ITER_NEXT:
+                res.reads.set(ins.r0);
+                res.reads.set(ins.u8.r1);
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::FOR_ITER: case Opcode::FOR_ITER2:
+                res.reads.set(ins.r0);
+                res.reads.set(ins.u8.r1);
+                set_range(res.writes, ins.u8.r2, op == Opcode::FOR_ITER2 ? 2 : 1);
+                res.may_skip_write = true;
+                break;
+            case Opcode::JUMPF: case Opcode::JUMPB:
+                break;
+            case Opcode::ALLOC_FUNC: {
+                auto* func = (CodeFragment*)fragment->storage[ins.u1].pointer();
+                for (auto& capture : func->capture_info) {
+                    res.reads.set(capture.source_register);
+                }
+                res.writes.set(ins.r0);
+                break;
+            }
+            case Opcode::ALLOC_ARRAY:
+                set_range(res.reads, ins.u8.r2, ins.u8.r1);
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::ALLOC_SPILL:
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::ALLOC_OBJECT:
+                set_range(res.reads, ins.u8.r2, ins.u8.r1 * 2u);
+                res.writes.set(ins.r0);
+                break;
+            case Opcode::STORE_ARRAY: case Opcode::STORE_OBJECT:
+                res.reads.set(ins.r0);
+                res.reads.set(ins.u8.r1);
+                res.reads.set(ins.u8.r2);
+                break;
+            case Opcode::GETFIELD:
+                res.reads.set(ins.u8.r1);
+                res.writes.set(ins.r0);
+                res.may_skip_write = true; // as LOAD_OBJECT
+                break;
+            case Opcode::SETFIELD:
+                res.reads.set(ins.r0);
+                res.reads.set(ins.u8.r1);
+                break;
+            case Opcode::CALL: case Opcode::CALL_MULTI:
+                // the callee's frame starts above the return register, so everything from there up is overwritten
+                res.reads.set(op == Opcode::CALL ? ins.r0 : ins.u8.r2);
+                set_range(res.reads, ins.u8.r2 + STACK_FRAME_OVERHEAD, ins.u8.r1);
+                set_range(res.writes, ins.u8.r2, MAX_REGISTERS);
+                break;
+            case Opcode::RET:
+                if (ins.r0) {
+                    set_range(res.reads, ins.u8.r1, std::max(ins.u8.r2, (uint8_t)1));
+                }
+                break;
+            default:
+                // not something the compiler emits; assume it could do anything
+                res.reads.set();
+                res.writes.set();
+                res.may_skip_write = true;
+                break;
+        }
+    }
+    return res;
+}
+
+void FlowGraph::compute_liveness() {
+    for (auto& block : blocks) {
+        block.live_in.reset();
+        block.live_out.reset();
+    }
+    auto changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b = blocks.size(); b-- > 0;) {
+            auto& block = blocks[b];
+            auto live = pinned | variables;
+            for (auto s : block.successors) {
+                live |= blocks[s].live_in;
+            }
+            block.live_out = live;
+            for (auto pc = block.end; pc-- > block.begin;) {
+                step_back(live, pc);
+            }
+            if (live != block.live_in) {
+                block.live_in = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+RegisterSet FlowGraph::live_after(uint32_t pc) const {
+    auto& block = blocks[block_of[pc]];
+    auto live = block.live_out;
+    for (auto p = block.end - 1; p > pc; p--) {
+        step_back(live, p);
+    }
+    return live;
+}
+
+void FlowGraph::step_back(RegisterSet& live, uint32_t pc) const {
+    auto ops = operands(pc);
+    if (!ops.may_skip_write) {
+        live &= ~ops.writes;
+    }
+    live |= ops.reads | pinned | variables;
+}
+
+void FlowGraph::remove(uint32_t pc) {
+    fragment->instructions[pc] = Instruction { .opcode = Opcode::UNKNOWN, .r0 = 0, .u8 = { 0, 0 } };
+}
+
+void FlowGraph::compact() {
+    auto& code = fragment->instructions;
+    auto size = (uint32_t)code.size();
+
+    // new position of each instruction; a removed one maps to the next one that's kept, so jumps to it still work
+    auto new_pc = std::vector<uint32_t>(size + 1);
+    auto n = 0u;
+    for (auto pc = 0u; pc < size; pc++) {
+        new_pc[pc] = n;
+        n += code[pc].opcode != Opcode::UNKNOWN;
+    }
+    new_pc[size] = n;
+
+    for (auto pc = 0u; pc < size; pc++) {
+        auto& ins = code[pc];
+        if (ins.opcode == Opcode::JUMPF) {
+            ins = make_jump(ins.opcode, new_pc[pc + jump_offset(ins)] - new_pc[pc]);
+        } else if (ins.opcode == Opcode::JUMPB) {
+            ins = make_jump(ins.opcode, new_pc[pc] - new_pc[pc - jump_offset(ins)]);
+        }
+    }
+    for (auto pc = 0u; pc < size; pc++) {
+        if (code[pc].opcode != Opcode::UNKNOWN) {
+            code[new_pc[pc]] = code[pc];
+            fragment->line_numbers[new_pc[pc]] = fragment->line_numbers[pc];
+        }
+    }
+    code.resize(n);
+    fragment->line_numbers.resize(n);
+    *this = FlowGraph(fragment, variables);
+}
+
+void FlowGraph::hoist(uint32_t pc, uint32_t top, uint32_t bottom) {
+    auto& code = fragment->instructions;
+    auto size = (uint32_t)code.size();
+
+    // where every jump goes, before anything moves
+    auto targets = std::vector<uint32_t>(size);
+    for (auto p = 0u; p < size; p++) {
+        if (code[p].opcode == Opcode::JUMPF) {
+            targets[p] = p + jump_offset(code[p]);
+        } else if (code[p].opcode == Opcode::JUMPB) {
+            targets[p] = p - jump_offset(code[p]);
+        }
+    }
+
+    // pc goes to top, and top..pc-1 move down one
+    auto new_pc = [&](uint32_t p) {
+        return p < top || p > pc ? p : p == pc ? top : p + 1;
+    };
+    std::rotate(code.begin() + top, code.begin() + pc, code.begin() + pc + 1);
+    std::rotate(fragment->line_numbers.begin() + top, fragment->line_numbers.begin() + pc, fragment->line_numbers.begin() + pc + 1);
+    for (auto p = 0u; p < size; p++) {
+        auto& ins = code[new_pc(p)];
+        if (ins.opcode != Opcode::JUMPF && ins.opcode != Opcode::JUMPB) {
+            continue;
+        }
+        // coming into the loop runs the hoisted instruction, going round it again doesn't
+        auto inside = p >= top && p <= bottom;
+        auto target = targets[p] == top ? (inside ? top + 1 : top) : new_pc(targets[p]);
+        ins = make_jump(ins.opcode, ins.opcode == Opcode::JUMPF ? target - new_pc(p) : new_pc(p) - target);
+    }
+    *this = FlowGraph(fragment, variables);
+}
+
+
+bool propagate_copies(FlowGraph& graph) {
+    auto& code = graph.fragment->instructions;
+    auto changed = false;
+    for (auto& block : graph.blocks) {
+        // copy_of[a] = b after "MOVE a, b", while neither has been written since
+        auto copy_of = std::array<int16_t, MAX_REGISTERS> {};
+        copy_of.fill(-1);
+        for (auto pc = block.begin; pc < block.end; pc++) {
+            auto& ins = code[pc];
+            for_each_register_read(ins, [&](uint8_t& r) {
+                if (copy_of[r] >= 0) {
+                    r = (uint8_t)copy_of[r];
+                    changed = true;
+                }
+            });
+            auto ops = graph.operands(pc);
+            if (ops.writes.any()) {
+                for (auto r = 0u; r < MAX_REGISTERS; r++) {
+                    if (copy_of[r] >= 0 && (ops.writes[r] || ops.writes[copy_of[r]])) {
+                        copy_of[r] = -1;
+                    }
+                }
+            }
+            if (ins.opcode == Opcode::MOVE && ins.r0 != ins.u8.r1 && !graph.pinned[ins.r0] && !graph.pinned[ins.u8.r1]) {
+                copy_of[ins.r0] = ins.u8.r1;
+            }
+        }
+    }
+    return changed;
+}
+
+bool eliminate_common_subexpressions(FlowGraph& graph) {
+    struct Expression {
+        Opcode op;
+        uint8_t r1, r2;
+        uint8_t result;
+    };
+    auto& code = graph.fragment->instructions;
+    auto changed = false;
+    for (auto& block : graph.blocks) {
+        auto available = std::vector<Expression> {};
+        for (auto pc = block.begin; pc < block.end; pc++) {
+            auto& ins = code[pc];
+            auto op = ins.opcode;
+            auto binary = is_binary(op);
+            auto candidate = is_pure(op) && !graph.pinned[ins.u8.r1] && !(binary && graph.pinned[ins.u8.r2]);
+            auto r2 = (uint8_t)(is_unary(op) ? 0 : ins.u8.r2);
+            if (candidate) {
+                for (auto& e : available) {
+                    if (e.op == op && e.r1 == ins.u8.r1 && e.r2 == r2) {
+                        if (e.result != ins.r0) {
+                            ins = Instruction { .opcode = Opcode::MOVE, .r0 = ins.r0, .u8 = { e.result, 0 } };
+                            changed = true;
+                        }
+                        candidate = false;
+                        break;
+                    }
+                }
+            }
+
+            auto ops = graph.operands(pc);
+            std::erase_if(available, [&](const Expression& e) {
+                return ops.writes[e.result] || ops.writes[e.r1] || (is_binary(e.op) && ops.writes[e.r2]);
+            });
+            if (candidate && ins.r0 != ins.u8.r1 && !(binary && ins.r0 == ins.u8.r2) && !graph.pinned[ins.r0]) {
+                available.emplace_back(Expression { op, ins.u8.r1, r2, ins.r0 });
+            }
+        }
+    }
+    return changed;
+}
+
+bool eliminate_dead_code(FlowGraph& graph) {
+    graph.compute_liveness();
+    auto& code = graph.fragment->instructions;
+    auto changed = false;
+    for (auto& block : graph.blocks) {
+        auto live = block.live_out;
+        for (auto pc = block.end; pc-- > block.begin;) {
+            auto ops = graph.operands(pc);
+            if (is_removable(code[pc].opcode) && (ops.writes & live).none()) {
+                graph.remove(pc);
+                changed = true;
+                continue;
+            }
+            graph.step_back(live, pc);
+        }
+    }
+    return changed;
+}
+
+bool coalesce_moves(FlowGraph& graph) {
+    graph.compute_liveness();
+    auto& code = graph.fragment->instructions;
+    auto changed = false;
+    for (auto& block : graph.blocks) {
+        auto live = block.live_out;
+        for (auto pc = block.end; pc-- > block.begin;) {
+            auto& move = code[pc];
+            auto dest = move.r0;
+            auto temp = move.u8.r1;
+            if (move.opcode == Opcode::MOVE && dest != temp && !live[temp] && !graph.pinned[temp] && !graph.pinned[dest]) {
+                // find where temp was computed; nothing in between can touch either register, or call anything
+                for (auto p = pc; p-- > block.begin;) {
+                    auto ops = graph.operands(p);
+                    if (ops.writes[temp]) {
+                        if (is_retargetable(code[p].opcode) && ops.writes.count() == 1) {
+                            code[p].r0 = dest;
+                            graph.remove(pc);
+                            graph.fragment->max_register = std::max(graph.fragment->max_register, (uint32_t)dest);
+                            changed = true;
+                        }
+                        break;
+                    }
+                    if (ops.reads[temp] || ops.reads[dest] || ops.writes[dest] || is_call(code[p].opcode)) {
+                        break;
+                    }
+                }
+            }
+            graph.step_back(live, pc);
+        }
+    }
+    return changed;
+}
+
+bool peephole(FlowGraph& graph) {
+    auto& code = graph.fragment->instructions;
+    auto& storage = graph.fragment->storage;
+    auto size = (uint32_t)code.size();
+    auto changed = false;
+
+    // code that can't be reached from the start of the function, eg. the jump over an else when the if returns
+    // (the last RET stays, so the function always ends with one)
+    auto reached = std::vector<bool>(graph.blocks.size(), false);
+    auto pending = std::vector<uint32_t> { 0 };
+    while (!pending.empty()) {
+        auto b = pending.back();
+        pending.pop_back();
+        if (!reached[b]) {
+            reached[b] = true;
+            pending.insert(pending.end(), graph.blocks[b].successors.begin(), graph.blocks[b].successors.end());
+        }
+    }
+    for (auto b = 0u; b < graph.blocks.size(); b++) {
+        for (auto pc = graph.blocks[b].begin; !reached[b] && pc < graph.blocks[b].end && pc + 1 < size; pc++) {
+            if (code[pc].opcode != Opcode::UNKNOWN) {
+                graph.remove(pc);
+                changed = true;
+            }
+        }
+    }
+
+    // where a jump to pc ends up, following any jumps forward from there
+    auto follow = [&](uint32_t pc) {
+        for (auto n = 0u; pc < size && n < size; n++) {
+            if (code[pc].opcode == Opcode::UNKNOWN) {
+                pc++;
+            } else if (code[pc].opcode == Opcode::JUMPF) {
+                pc += jump_offset(code[pc]);
+            } else {
+                break;
+            }
+        }
+        return pc;
+    };
+    for (auto pc = 0u; pc < size; pc++) {
+        auto& ins = code[pc];
+        if (ins.opcode == Opcode::MOVE && ins.r0 == ins.u8.r1) {
+            graph.remove(pc);
+            changed = true;
+        } else if (ins.opcode == Opcode::JUMPF) {
+            auto target = follow(pc + jump_offset(ins));
+            if (target != pc + jump_offset(ins)) {
+                ins = make_jump(Opcode::JUMPF, target - pc);
+                changed = true;
+            }
+            // a jump to the next instruction does nothing, unless something skips it
+            auto prev = pc;
+            while (prev > 0 && code[prev - 1].opcode == Opcode::UNKNOWN) {
+                prev--;
+            }
+            if (follow(pc + 1) == target && !(prev > 0 && is_conditional_skip(code[prev - 1].opcode))) {
+                graph.remove(pc);
+                changed = true;
+            }
+        }
+    }
+
+    // LOAD_CONST k, "key"; LOAD_OBJECT x, obj, k becomes GETFIELD x, obj, "key" (and the same for STORE_OBJECT), then
+    // the LOAD_CONST goes if k isn't needed for anything else
+    for (auto& block : graph.blocks) {
+        auto constant = std::array<int32_t, MAX_REGISTERS> {}; // index in storage of what each register was loaded with
+        constant.fill(-1);
+        for (auto pc = block.begin; pc < block.end; pc++) {
+            auto& ins = code[pc];
+            auto key = constant[ins.u8.r2];
+            if ((ins.opcode == Opcode::LOAD_OBJECT || ins.opcode == Opcode::STORE_OBJECT) && key >= 0 && key < 256
+                && storage[key].is_string()) {
+                ins.opcode = ins.opcode == Opcode::LOAD_OBJECT ? Opcode::GETFIELD : Opcode::SETFIELD;
+                ins.u8.r2 = (uint8_t)key;
+                changed = true;
+            }
+            auto ops = graph.operands(pc);
+            for (auto r = 0u; r < MAX_REGISTERS && ops.writes.any(); r++) {
+                if (ops.writes[r]) {
+                    constant[r] = -1;
+                }
+            }
+            if (ins.opcode == Opcode::LOAD_CONST && !graph.pinned[ins.r0]) {
+                constant[ins.r0] = ins.u1;
+            }
+        }
+    }
+    return changed;
+}
+
+bool hoist_loop_invariants(FlowGraph& graph) {
+    auto& code = graph.fragment->instructions;
+    auto changed = false;
+    for (auto bottom = 0u; bottom < code.size(); bottom++) {
+        if (code[bottom].opcode != Opcode::JUMPB) {
+            continue;
+        }
+        auto top = bottom - jump_offset(code[bottom]);
+
+        // what the loop changes
+        auto writers = std::array<uint32_t, MAX_REGISTERS> {}; // instructions writing each register
+        auto calls = false;
+        auto writes_heap = false;
+        auto allocates = false;
+        auto writes_globals = false;
+        for (auto pc = top; pc <= bottom; pc++) {
+            auto ops = graph.operands(pc);
+            for (auto r = 0u; r < MAX_REGISTERS; r++) {
+                writers[r] += ops.writes[r];
+            }
+            switch (code[pc].opcode) {
+                case Opcode::STORE_ARRAY: case Opcode::STORE_OBJECT: case Opcode::SETFIELD:
+                case Opcode::SHL: case Opcode::SHR: // SHL appends to an array, SHR pops one
+                    writes_heap = allocates = true;
+                    break;
+                case Opcode::ADD: case Opcode::ALLOC_ARRAY: case Opcode::ALLOC_SPILL: case Opcode::ALLOC_OBJECT: case Opcode::ALLOC_FUNC:
+                    allocates = true;
+                    break;
+                case Opcode::WRITE_GLOBAL:
+                    writes_globals = true;
+                    break;
+                default:
+                    if (is_call(code[pc].opcode) || ops.reads.all()) {
+                        calls = writes_heap = allocates = writes_globals = true;
+                    }
+                    break;
+            }
+        }
+        auto is_invariant_op = [&](Opcode op) {
+            switch (op) {
+                // a weak map can lose entries whenever something is allocated (if that collects garbage)
+                case Opcode::LEN: case Opcode::LOAD_ARRAY: case Opcode::LOAD_ARRAY_NUM: return !writes_heap && !allocates;
+                case Opcode::LOAD_OBJECT: case Opcode::GETFIELD: return !writes_heap;
+                case Opcode::READ_GLOBAL: return !writes_globals;
+                default: return is_pure(op) || is_load(op) || op == Opcode::MOVE;
+            }
+        };
+
+        // a hoisted value needs a register that nothing else in the loop writes; if the compiler reused its register
+        // for something else, move it to a new one, as long as all its uses are in the same block
+        // (and there are no calls in the loop: a callee's frame would start below the new register)
+        auto rename = [&](uint32_t pc) {
+            auto& ins = code[pc];
+            if (calls || graph.fragment->max_register + 1 >= MAX_REGISTERS) {
+                return false;
+            }
+            auto old_reg = ins.r0;
+            auto uses = std::vector<uint8_t*> {};
+            auto end = graph.blocks[graph.block_of[pc]].end;
+            auto q = pc + 1;
+            for (; q < end; q++) {
+                auto ops = graph.operands(q);
+                if (ops.reads[old_reg]) {
+                    auto n = uses.size();
+                    for_each_register_read(code[q], [&](uint8_t& r) {
+                        if (r == old_reg) {
+                            uses.emplace_back(&r);
+                        }
+                    });
+                    if (uses.size() == n) {
+                        return false; // read some other way, eg. as part of a range of call arguments
+                    }
+                }
+                if (ops.writes[old_reg]) {
+                    if (ops.may_skip_write) {
+                        return false;
+                    }
+                    break;
+                }
+            }
+            if (q == end) {
+                graph.compute_liveness();
+                if (graph.blocks[graph.block_of[pc]].live_out[old_reg]) {
+                    return false;
+                }
+            }
+            auto new_reg = (uint8_t)++graph.fragment->max_register;
+            for (auto* r : uses) {
+                *r = new_reg;
+            }
+            ins.r0 = new_reg;
+            writers[old_reg]--;
+            writers[new_reg] = 1;
+            return true;
+        };
+
+        // go through the top of the loop up to the first branch, or the first thing that could fail or have an effect
+        // that isn't hoisted (then the hoisted instructions run exactly when they would have, on the first iteration)
+        for (auto pc = top; pc < bottom && graph.block_of[pc] == graph.block_of[top]; pc++) {
+            auto& ins = code[pc];
+            auto ops = graph.operands(pc);
+            auto hoist = is_invariant_op(ins.opcode) && ops.writes.count() == 1 && !graph.pinned[ins.r0]
+                && !(calls && (ops.reads & graph.pinned).any());
+            for (auto r = 0u; hoist && r < MAX_REGISTERS; r++) {
+                hoist = !(ops.reads[r] && writers[r]);
+            }
+            if (hoist && writers[ins.r0] == 1) {
+                for (auto p = top; hoist && p < pc; p++) {
+                    hoist = !graph.operands(p).reads[ins.r0]; // has to be the value from this iteration
+                }
+            }
+            if (hoist && (writers[ins.r0] == 1 || rename(pc))) {
+                writers[ins.r0] = 0;
+                graph.hoist(pc, top, bottom);
+                top++;
+                changed = true;
+            } else if (!is_removable(ins.opcode) && ins.opcode != Opcode::READ_CAPTURE && ins.opcode != Opcode::UNKNOWN) {
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+namespace {
+
+// the types a register might hold at some point in the code, as a set of these bits (none: the code can't get there)
+using TypeSet = uint8_t;
+constexpr TypeSet TYPE_NUMBER = 1;
+constexpr TypeSet TYPE_STRING = 2;
+constexpr TypeSet TYPE_ARRAY = 4;
+constexpr TypeSet TYPE_OTHER = 8;
+constexpr TypeSet TYPE_ANY = 15;
+using RegisterTypes = std::array<TypeSet, MAX_REGISTERS>;
+
+TypeSet type_of(TackValue value) {
+    return value.is_number() ? TYPE_NUMBER : value.is_string() ? TYPE_STRING : value.is_array() ? TYPE_ARRAY : TYPE_OTHER;
+}
+
+// the version of op that doesn't check that its operands are numbers
+Opcode number_op(Opcode op) {
+    switch (op) {
+        case Opcode::INCREMENT: return Opcode::INCREMENT_N;
+        case Opcode::GREATER: return Opcode::GREATER_NN;
+        case Opcode::LESS: return Opcode::LESS_NN;
+        case Opcode::GREATEREQ: return Opcode::GREATEREQ_NN;
+        case Opcode::LESSEQ: return Opcode::LESSEQ_NN;
+        case Opcode::ADD: return Opcode::ADD_NN;
+        case Opcode::SUB: return Opcode::SUB_NN;
+        case Opcode::DIV: return Opcode::DIV_NN;
+        case Opcode::MUL: return Opcode::MUL_NN;
+        case Opcode::MOD: return Opcode::MOD_NN;
+        case Opcode::GREATERK: return Opcode::GREATERK_N;
+        case Opcode::LESSK: return Opcode::LESSK_N;
+        case Opcode::GREATEREQK: return Opcode::GREATEREQK_N;
+        case Opcode::LESSEQK: return Opcode::LESSEQK_N;
+        case Opcode::ADDK: return Opcode::ADDK_N;
+        case Opcode::SUBK: return Opcode::SUBK_N;
+        case Opcode::DIVK: return Opcode::DIVK_N;
+        case Opcode::MULK: return Opcode::MULK_N;
+        case Opcode::MODK: return Opcode::MODK_N;
+        case Opcode::FOR_INT: return Opcode::FOR_INT_N;
+        default: return Opcode::UNKNOWN;
+    }
+}
+
+// turn the types before instruction pc into the types after it
+void step_types(const FlowGraph& graph, RegisterTypes& types, uint32_t pc) {
+    auto& ins = graph.fragment->instructions[pc];
+    auto known = [&](uint8_t r, TypeSet type) {
+        types[r] = graph.pinned[r] ? TYPE_ANY : type;
+    };
+    // most of the operators fail unless their operands are numbers, so if they didn't, those are numbers from here on
+    // arithmetic results aren't though: one might be NaN (0 / 0, x % 0, inf - inf), which doesn't read as a number
+    auto result = TYPE_ANY;
+    switch (ins.opcode) {
+        case Opcode::GREATER: case Opcode::LESS: case Opcode::GREATEREQ: case Opcode::LESSEQ:
+        case Opcode::GREATER_NN: case Opcode::LESS_NN: case Opcode::GREATEREQ_NN: case Opcode::LESSEQ_NN:
+            known(ins.u8.r1, TYPE_NUMBER);
+            known(ins.u8.r2, TYPE_NUMBER);
+            result = TYPE_OTHER;
+            break;
+        case Opcode::SUB: case Opcode::DIV: case Opcode::MUL: case Opcode::MOD: case Opcode::POW:
+        case Opcode::ADD_NN: case Opcode::SUB_NN: case Opcode::DIV_NN: case Opcode::MUL_NN: case Opcode::MOD_NN:
+            known(ins.u8.r1, TYPE_NUMBER);
+            known(ins.u8.r2, TYPE_NUMBER);
+            break;
+        case Opcode::ADD:
+            // numbers, strings or arrays, going by the left hand side; the right hand side has to match
+            result = types[ins.u8.r1] & (TYPE_NUMBER | TYPE_STRING | TYPE_ARRAY);
+            if (result == TYPE_NUMBER) {
+                known(ins.u8.r2, TYPE_NUMBER);
+            }
+            if (result & TYPE_NUMBER) {
+                result = TYPE_ANY;
+            }
+            break;
+        case Opcode::GREATERK: case Opcode::LESSK: case Opcode::GREATEREQK: case Opcode::LESSEQK:
+        case Opcode::GREATERK_N: case Opcode::LESSK_N: case Opcode::GREATEREQK_N: case Opcode::LESSEQK_N:
+            known(ins.u8.r1, TYPE_NUMBER);
+            result = TYPE_OTHER;
+            break;
+        case Opcode::ADDK: case Opcode::SUBK: case Opcode::DIVK: case Opcode::MULK: case Opcode::MODK: case Opcode::NEGATE:
+        case Opcode::ADDK_N: case Opcode::SUBK_N: case Opcode::DIVK_N: case Opcode::MULK_N: case Opcode::MODK_N:
+            known(ins.u8.r1, TYPE_NUMBER);
+            result = ins.opcode == Opcode::NEGATE ? TYPE_NUMBER : TYPE_ANY;
+            break;
+        case Opcode::FOR_INT: case Opcode::FOR_INT_N:
+            known(ins.r0, TYPE_NUMBER);
+            known(ins.u8.r1, TYPE_NUMBER);
+            break;
+        case Opcode::EQUAL: case Opcode::NEQUAL: case Opcode::EQUALK: case Opcode::NEQUALK: case Opcode::AND: case Opcode::OR:
+        case Opcode::NOT: case Opcode::IN: case Opcode::LOAD_I_BOOL: case Opcode::LOAD_I_NULL: case Opcode::ALLOC_OBJECT:
+        case Opcode::ALLOC_FUNC:
+            result = TYPE_OTHER;
+            break;
+        case Opcode::INCREMENT: case Opcode::INCREMENT_N: case Opcode::LEN: case Opcode::LOAD_I_SN:
+            result = TYPE_NUMBER;
+            break;
+        case Opcode::LOAD_CONST:
+            result = type_of(graph.fragment->storage[ins.u1]);
+            break;
+        case Opcode::ALLOC_ARRAY: case Opcode::ALLOC_SPILL:
+            result = TYPE_ARRAY;
+            break;
+        case Opcode::MOVE:
+            result = types[ins.u8.r1];
+            break;
+        default:
+            break;
+    }
+    auto ops = graph.operands(pc);
+    if (ops.writes.any()) {
+        for (auto r = 0u; r < MAX_REGISTERS; r++) {
+            if (ops.writes[r]) {
+                types[r] = TYPE_ANY;
+            }
+        }
+        if (ops.writes.count() == 1 && ops.writes[ins.r0] && !ops.may_skip_write) {
+            known(ins.r0, result);
+        }
+    }
+}
+
+}
+
+bool specialize_number_ops(FlowGraph& graph) {
+    auto& code = graph.fragment->instructions;
+    auto& blocks = graph.blocks;
+    if (blocks.empty()) {
+        return false;
+    }
+
+    // types at the start of each block: anything at the start of the function, and the union over whatever can jump
+    // there, which only grows until nothing changes
+    auto block_in = std::vector<RegisterTypes>(blocks.size(), RegisterTypes {});
+    auto block_out = block_in;
+    block_in[0].fill(TYPE_ANY);
+    auto changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b = 0u; b < blocks.size(); b++) {
+            auto types = block_in[b];
+            for (auto p : blocks[b].predecessors) {
+                for (auto r = 0u; r < MAX_REGISTERS; r++) {
+                    types[r] |= block_out[p][r];
+                }
+            }
+            block_in[b] = types;
+            for (auto pc = blocks[b].begin; pc < blocks[b].end; pc++) {
+                step_types(graph, types, pc);
+            }
+            if (types != block_out[b]) {
+                block_out[b] = types;
+                changed = true;
+            }
+        }
+    }
+
+    auto specialized = false;
+    for (auto b = 0u; b < blocks.size(); b++) {
+        auto types = block_in[b];
+        for (auto pc = blocks[b].begin; pc < blocks[b].end; pc++) {
+            auto& ins = code[pc];
+            auto op = number_op(ins.opcode);
+            if (op != Opcode::UNKNOWN) {
+                auto numbers = is_binary(ins.opcode) ? types[ins.u8.r1] == TYPE_NUMBER && types[ins.u8.r2] == TYPE_NUMBER
+                    : is_binary_k(ins.opcode) ? types[ins.u8.r1] == TYPE_NUMBER
+                    : ins.opcode == Opcode::FOR_INT ? types[ins.r0] == TYPE_NUMBER && types[ins.u8.r1] == TYPE_NUMBER
+                    : types[ins.r0] == TYPE_NUMBER; // INCREMENT
+                if (numbers) {
+                    ins.opcode = op;
+                    specialized = true;
+                }
+            }
+            step_types(graph, types, pc);
+        }
+    }
+    return specialized;
+}
+
+void optimize(CodeFragment* fragment, const RegisterSet& variables) {
+    // storage indexes past u1 (see EXTEND) only come from huge generated tables; leave those as they are
+    for (auto& ins : fragment->instructions) {
+        if (ins.opcode == Opcode::EXTEND) {
+            return;
+        }
+    }
+    auto graph = FlowGraph(fragment, variables);
+    auto clean_up = [&]() {
+        for (auto round = 0; round < 4; round++) {
+            auto changed = propagate_copies(graph);
+            changed |= eliminate_common_subexpressions(graph);
+            changed |= eliminate_dead_code(graph);
+            changed |= coalesce_moves(graph);
+            changed |= peephole(graph);
+            if (!changed) {
+                break;
+            }
+        }
+        graph.compact();
+    };
+    clean_up();
+    if (hoist_loop_invariants(graph)) {
+        clean_up();
+    }
+    specialize_number_ops(graph);
+}
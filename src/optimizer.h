@@ -0,0 +1,89 @@
+#pragma once
+
+#include <bitset>
+#include <vector>
+
+#include "compiler.h"
+
+// Bytecode optimizer
+// The compiler goes straight from the AST to register bytecode, one node at a time, which leaves a lot of temporaries
+// that are computed only to be MOVEd somewhere else, copies of variables, repeated expressions and so on.
+// Once a function is compiled, FlowGraph splits its instructions into basic blocks and works out which registers each
+// instruction reads and writes, so passes can clean up the bytecode with proper dataflow information (liveness etc).
+//
+// Registers keep their meaning throughout: a variable captured by a closure stays raw in its register, with the closure's
+// open box pointing at that stack slot until ZERO_CAPTURE or RET closes it, and a call's frame starts just above its
+// return register. So the compiler's register assignment is left as it is: captured registers are pinned (never renamed,
+// coalesced or copy-propagated through, since any call can change them behind the bytecode's back), and the passes only
+// rewrite instructions to read/write different registers where that's safe.
+
+using RegisterSet = std::bitset<MAX_REGISTERS>;
+
+// registers read and written by an instruction
+struct Operands {
+    RegisterSet reads;
+    RegisterSet writes;
+    bool may_skip_write = false; // eg FOR_ITER only writes the loop variable if there's another element
+};
+
+struct BasicBlock {
+    uint32_t begin = 0; // first instruction
+    uint32_t end = 0;   // one past the last instruction
+    std::vector<uint32_t> successors = {};
+    std::vector<uint32_t> predecessors = {};
+    RegisterSet live_in = {};
+    RegisterSet live_out = {};
+};
+
+struct FlowGraph {
+    CodeFragment* fragment;
+    std::vector<BasicBlock> blocks = {};
+    std::vector<uint32_t> block_of = {}; // index of the block each instruction is in
+
+    // registers that passes must leave alone: variables captured by closures (an open box points at the register, so
+    // any call can change it), mirrors of captures from an enclosing function, and for loop state (not a TackValue)
+    RegisterSet pinned = {};
+    // registers of local variables: they count as live for the whole function, so whatever a variable refers to
+    // stays reachable while it's in scope (weak references can tell the difference) and only temporaries get rewritten
+    RegisterSet variables = {};
+
+    FlowGraph(CodeFragment* fragment, const RegisterSet& variables);
+
+    Operands operands(uint32_t pc) const;
+    // which registers are live (might be read before being written) at the start and end of each block
+    void compute_liveness();
+    // registers live just after instruction pc
+    RegisterSet live_after(uint32_t pc) const;
+    // turn the registers live after instruction pc into those live before it
+    void step_back(RegisterSet& live, uint32_t pc) const;
+
+    // passes delete instructions by turning them into UNKNOWN (a no-op), then compact() removes them, fixes the jumps
+    // and splits the blocks again
+    void remove(uint32_t pc);
+    void compact();
+    // move instruction pc to just before the loop from top to bottom (which is only entered at the top);
+    // jumps to the top from inside the loop go to the instruction after it instead
+    void hoist(uint32_t pc, uint32_t top, uint32_t bottom);
+};
+
+// forward copies: after "MOVE a, b", read b instead of a until either changes (within a block)
+bool propagate_copies(FlowGraph& graph);
+// repeated pure expressions in a block become a MOVE from the first result
+bool eliminate_common_subexpressions(FlowGraph& graph);
+// instructions without side effects whose result is never read
+bool eliminate_dead_code(FlowGraph& graph);
+// "op t, ...; MOVE d, t" becomes "op d, ..." when t isn't needed afterwards
+bool coalesce_moves(FlowGraph& graph);
+// small rewrites: drops unreachable code, MOVEs to the same register and jumps to the next instruction, sends jumps
+// to a jump straight to its target, and loads/stores with a constant key become GETFIELD/SETFIELD
+bool peephole(FlowGraph& graph);
+// instructions at the top of a loop that compute the same thing every iteration go in front of it instead; a for loop
+// is only tested at the bottom once it's running, so the top of the loop is only reached if it runs
+bool hoist_loop_invariants(FlowGraph& graph);
+// works out which registers can only hold numbers at each instruction (from constants, lengths, increments, and operands
+// that would have failed otherwise; not arithmetic results, which can be NaN), and swaps the operators that only take
+// numbers for versions that don't check
+bool specialize_number_ops(FlowGraph& graph);
+
+// run all the passes on a compiled function, given the registers the compiler bound to variables
+void optimize(CodeFragment* fragment, const RegisterSet& variables);
@@ -2,15 +2,16 @@
 #include "interpreter.h"
 
 #include <stdexcept>
+#include <unordered_set>
 
 // parsing utils
 using namespace std::string_literals;
 
 struct ParseContext : private std::string_view {
     uint32_t line_number = 1;
-    Interpreter* vm;
+    bool lazy_bodies = false; // skip function bodies, to be parsed when they're first called (see lazy.cpp)
     
-    ParseContext(const std::string& s, Interpreter* vm) : std::string_view(s), vm(vm) {}
+    ParseContext(const std::string& s) : std::string_view(s) {}
     void remove_prefix(std::string_view::size_type s) noexcept {
         for (auto i = 0u; i < s; i++) {
             if ((*this)[i] == '\n') {
@@ -31,7 +32,9 @@ struct ParseContext : private std::string_view {
 #ifdef ERROR
 #undef ERROR
 #endif
-#define ERROR(msg) code.vm->error("parsing error: "s + msg + " | line: " + std::to_string(code.line_number) + "\n'" + std::string(code.substr(0, 32))  + "... '");
+// errors are thrown as they are, so parsing doesn't need the interpreter (modules can be parsed on other threads, see
+// loader.cpp); the interpreter passes them on to error()
+#define ERROR(msg) throw std::runtime_error("parsing error: "s + msg + " | line: " + std::to_string(code.line_number) + "\n'" + std::string(code.substr(0, 32))  + "... '");
 #define EXPECT(s) if (!parse_raw_string(code, s)) { FAIL(); }
 #define EXPECT_WS(s) if (!(parse_raw_string(code, s) && (isspace(code[0]) || !code.size()))) { FAIL(); }
 
@@ -196,13 +199,66 @@ DEFPARSER(param_def, {
     }
     SUCCESS(p);
 });
+// a function body that's left for when the function is first called: only the text and the names used in it are kept,
+// which is all it can capture. Short bodies are cheap to compile (and might be inlined), so they're parsed as usual
+static const auto keywords = std::unordered_set<std::string_view> {
+    "fn", "let", "const", "export", "import", "if", "else", "while", "for", "in", "return", "and", "or", "true", "false", "null"
+};
+DEFPARSER(lazy_block, {
+    if (!code.lazy_bodies || !code.size() || code[0] != '{') {
+        FAIL();
+    }
+    auto res = AstNode(AstType::LazyBlock);
+    auto names = std::unordered_set<std::string_view> {};
+    auto depth = 0u;
+    auto after_dot = false; // the name after '.' is a key
+    auto n = 0u;
+    for (; n < code.size(); n++) {
+        auto c = code[n];
+        if (c == '"') {
+            while (++n < code.size() && code[n] != '"') {}
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth == 0) {
+                break;
+            }
+        } else if (isdigit(c)) {
+            while (n + 1 < code.size() && (is_identifier_char(code[n + 1]) || code[n + 1] == '.')) {
+                n++;
+            }
+        } else if (is_identifier_start_char(c)) {
+            auto start = n;
+            while (n + 1 < code.size() && is_identifier_char(code[n + 1])) {
+                n++;
+            }
+            auto name = std::string_view(code.data() + start, n + 1 - start);
+            if (!after_dot && !keywords.contains(name) && names.insert(name).second) {
+                res.children.emplace_back(AstType::Identifier, std::string(name));
+            }
+        }
+        if (!isspace(c)) {
+            after_dot = c == '.';
+        }
+    }
+    if (n >= code.size() || n + 1 < MIN_LAZY_BODY) {
+        FAIL(); // unterminated (the usual parser reports it) or short
+    }
+    res.data_s = code.substr(0, n + 1);
+    code.remove_prefix(n + 1);
+    SUCCESS(res);
+});
+DEFPARSER(func_body, {
+    TRY(lazy_block) SUCCESS(lazy_block);
+    TRY(block) SUCCESS(block);
+});
 DEFPARSER(func_literal, {
     EXPECT("fn")
     TRYs('(') {} else ERROR("expected parameter definition after 'fn'");
     TRY(param_def) {
         TRYs(')') {} else ERROR("expected ')' after parameter definition");
-        TRY(block) {
-            SUCCESS(AstType::FuncLiteral, param_def, block);
+        TRY(func_body) {
+            SUCCESS(AstType::FuncLiteral, param_def, func_body);
         } else ERROR("expected block after parameter definition");
     }
 });
@@ -403,11 +459,33 @@ DEFPARSER(exp, { TRY(or_exp) SUCCESS(or_exp); });
 // or, and, in, |, ^, &, cmp, <<, >>, +, -, *, /, %, **
 
 
+// "let x, y = f()" declares several variables at once from the results of a call
+// the identifiers are the children, followed by the expression; data_d is 1 for const
+// (the first identifier and its ',' have already been parsed)
+DEFPARSER(multi_decl_rest, {
+    do {
+        TRY(identifier) {
+            out.children.emplace_back(identifier);
+        } else ERROR("expected identifier after ','");
+    } while (parse_raw_string(code, ','));
+    EXPECT('=')
+    TRY(exp) {
+        out.children.emplace_back(exp);
+        return true;
+    } else ERROR("expected expression after '='");
+});
+
 DEFPARSER(const_decl_stat, {
     auto is_export = parse_raw_string(code, "export") && skip_whitespace(code);
     EXPECT_WS("const")
     TRY(identifier) {
         identifier.data_d = is_export;
+        TRYs(',') {
+            auto decl = AstNode(AstType::MultiDeclStat, identifier);
+            decl.data_d = 1;
+            if (parse_multi_decl_rest(code, decl)) { SUCCESS(decl) }
+            FAIL();
+        }
         EXPECT('=')
         TRY(exp) { SUCCESS(AstType::ConstDeclStat, identifier, exp) }
     }
@@ -417,6 +495,11 @@ DEFPARSER(var_decl_stat, {
     EXPECT_WS("let")
     TRY(identifier) {
         identifier.data_d = is_export;
+        TRYs(',') {
+            auto decl = AstNode(AstType::MultiDeclStat, identifier);
+            if (parse_multi_decl_rest(code, decl)) { SUCCESS(decl) }
+            FAIL();
+        }
         EXPECT('=')
         TRY(exp) {
             SUCCESS(AstType::VarDeclStat, identifier, exp)
@@ -430,9 +513,9 @@ DEFPARSER(func_decl_stat, {
     TRYs('(') {} else ERROR("expected parameter definition after identifier");
     TRY(param_def) {
         TRYs(')') {} else ERROR("expected ')' after parameter definition");
-        TRY(block) {
+        TRY(func_body) {
             SUCCESS(AstType::FuncDeclStat, identifier,
-                AstNode(AstType::FuncLiteral, param_def, block)
+                AstNode(AstType::FuncLiteral, param_def, func_body)
             );
         }
     }
@@ -457,7 +540,14 @@ DEFPARSER(block, {
 DEFPARSER(return_stat, {
     TRYs("return") {
         TRY(exp) {
-            SUCCESS(AstType::ReturnStat, exp);
+            // "return a, b" returns several values
+            auto ret = AstNode(AstType::ReturnStat, exp);
+            while (parse_raw_string(code, ',')) {
+                TRY(exp) {
+                    ret.children.emplace_back(std::move(exp));
+                } else ERROR("expected expression after ','");
+            }
+            SUCCESS(ret);
         }
         SUCCESS(AstType::ReturnStat);
     }
@@ -579,15 +669,38 @@ DEFPARSER(module, {
 });
 
 
-bool Interpreter::parse(const std::string& code, AstNode& out_ast) {
-    auto s_code = ParseContext(code, this);
+void parse_module_source(const std::string& code, AstNode& out_ast, bool lazy_bodies) {
+    auto s_code = ParseContext(code);
+    s_code.lazy_bodies = lazy_bodies;
     out_ast = AstNode { AstType::Unknown };
     auto res = parse_module(s_code, out_ast);
     if (!res) {
-        error("parser error: "s + std::string(s_code.substr(0, 100)));
+        throw std::runtime_error("parser error: "s + std::string(s_code.substr(0, 100)));
     }
     if (s_code.size()) {
-        error("parser error: expected end of file: "s + std::string(s_code.substr(0, 100)));
+        throw std::runtime_error("parser error: expected end of file: "s + std::string(s_code.substr(0, 100)));
+    }
+}
+
+bool Interpreter::parse(const std::string& code, AstNode& out_ast) {
+    try {
+        parse_module_source(code, out_ast, lazy_compile && !bytecode_cache); // a cached module is compiled all at once
+    } catch (const std::runtime_error& e) {
+        error(e.what());
+    }
+    return true;
+}
+
+bool Interpreter::parse_lazy_block(const AstNode& lazy, AstNode& out_ast) {
+    auto s_code = ParseContext(lazy.data_s);
+    s_code.line_number = lazy.line_number;
+    s_code.lazy_bodies = lazy_compile;
+    try {
+        if (!parse_block(s_code, out_ast)) {
+            throw std::runtime_error("parser error: "s + std::string(s_code.substr(0, 100)));
+        }
+    } catch (const std::runtime_error& e) {
+        error(e.what());
     }
     return true;
 }
@@ -12,6 +12,7 @@
     ast(ConstDeclStat)\
     ast(VarDeclStat)\
     ast(FuncDeclStat)\
+    ast(MultiDeclStat)\
     ast(AssignStat)\
     ast(IfStat)\
     ast(WhileStat)\
@@ -59,6 +60,7 @@
     ast(StringLiteral)\
     ast(FuncLiteral)\
     ast(ParamDef)\
+    ast(LazyBlock)\
     ast(ArrayLiteral)\
     ast(ObjectLiteral)\
     \
@@ -108,3 +110,7 @@ struct AstNode {
         return s;
     }
 };
+
+// parse the source of a module, with function bodies left unparsed if lazy_bodies (see lazy.cpp)
+// errors are thrown as std::runtime_error; this doesn't touch the interpreter, so it's safe on any thread
+void parse_module_source(const std::string& code, AstNode& out_ast, bool lazy_bodies);
@@ -0,0 +1,349 @@
+#include "interpreter.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+
+// Heap snapshots
+// The graph is found by walking from the GC roots, and written out as JSON with the nodes and edges in flat arrays
+// (like V8's .heapsnapshot) so that even a large heap makes a reasonably small file that's quick to write and parse
+// Retained sizes come from the dominator tree, computed with the Cooper-Harvey-Kennedy algorithm
+// Weak references have no edge to their target, and weak maps have an edge to each value but not to the keys
+// (this ignores whether the key is still reachable, which it always is right after a collection)
+
+namespace {
+
+enum NodeType : uint32_t { NodeRoots = 0, NodeString, NodeArray, NodeObject, NodeFunction, NodeBox, NodeWeakRef, NodeWeakMap };
+const char* node_type_names[] = { "(roots)", "string", "array", "object", "function", "box", "weakref", "weakmap" };
+
+enum EdgeType : uint32_t { EdgeGlobal = 0, EdgeStack, EdgePinned, EdgeElement, EdgeProperty, EdgeCapture, EdgeValue, EdgeEphemeron };
+const char* edge_type_names[] = { "global", "stack", "pinned", "element", "property", "capture", "value", "ephemeron" };
+
+const uint32_t MAX_STRING_PREVIEW = 64;
+const uint32_t NUM_LARGEST_RETAINERS = 20;
+const uint32_t UNDEFINED_NODE = UINT32_MAX;
+
+struct Node {
+    NodeType type;
+    uint32_t name; // index in the string table
+    uint32_t line; // 0 if unknown
+    size_t self_size;
+    TackValue value;
+};
+struct Edge {
+    EdgeType type;
+    uint32_t name; // index in the string table for globals and properties, otherwise an index
+    uint32_t to;
+};
+
+// buffered output; numbers are formatted with to_chars rather than through the stream
+struct Writer {
+    std::ostream& out;
+    std::string buf;
+
+    Writer(std::ostream& out) : out(out) { buf.reserve(1 << 20); }
+    ~Writer() { flush(); }
+    void flush() { out.write(buf.data(), buf.size()); buf.clear(); }
+    Writer& operator<<(const char* s) { buf += s; return check(); }
+    Writer& operator<<(char c) { buf += c; return check(); }
+    template<typename T> Writer& operator<<(T n) {
+        char tmp[32];
+        auto end = std::to_chars(tmp, tmp + sizeof(tmp), n).ptr;
+        buf.append(tmp, end);
+        return check();
+    }
+    Writer& quoted(const std::string& s) {
+        buf += '"';
+        for (auto c : s) {
+            switch (c) {
+                case '"': buf += "\\\""; break;
+                case '\\': buf += "\\\\"; break;
+                case '\n': buf += "\\n"; break;
+                case '\r': buf += "\\r"; break;
+                case '\t': buf += "\\t"; break;
+                default:
+                    if ((unsigned char)c < 0x20) {
+                        char tmp[8];
+                        std::snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+                        buf += tmp;
+                    } else {
+                        buf += c;
+                    }
+            }
+        }
+        buf += '"';
+        return check();
+    }
+    Writer& check() {
+        if (buf.size() >= (1 << 20)) {
+            flush();
+        }
+        return *this;
+    }
+};
+
+}
+
+void Heap::write_snapshot(std::ostream& file, const std::vector<TackValue>& globals, const std::vector<std::string>& global_names,
+    const Stack& stack, uint32_t stack_end) {
+
+    auto strings_table = std::vector<std::string> { "" };
+    auto string_ids = KHash<std::string, uint32_t> {};
+    auto intern = [&](const std::string& s) {
+        auto ret = 0;
+        auto i = string_ids.put(s, &ret);
+        if (ret) {
+            string_ids.value_at(i) = (uint32_t)strings_table.size();
+            strings_table.push_back(s);
+        }
+        return string_ids.value_at(i);
+    };
+
+    // find the nodes breadth first, so that the edges of each node are contiguous and in the same order as the nodes
+    auto nodes = std::vector<Node> { Node { NodeRoots, intern("(roots)"), 0, 0, TackValue::null() } };
+    auto edges = std::vector<Edge> {};
+    auto first_edge = std::vector<uint32_t> {};
+    auto node_ids = KHash<uint64_t, uint32_t, RootHash> {};
+
+    auto add_edge = [&](EdgeType type, uint32_t name, TackValue value) {
+        auto node_type = NodeRoots;
+        switch ((uint64_t)value.get_type()) {
+            case (uint64_t)TackType::String: node_type = NodeString; break;
+            case (uint64_t)TackType::Array: node_type = NodeArray; break;
+            case (uint64_t)TackType::Object: node_type = NodeObject; break;
+            case (uint64_t)TackType::Function: node_type = NodeFunction; break;
+            case type_bits_boxed: node_type = NodeBox; break;
+            case (uint64_t)TackType::WeakRef: node_type = NodeWeakRef; break;
+            case (uint64_t)TackType::WeakMap: node_type = NodeWeakMap; break;
+            default: return;
+        }
+        auto ret = 0;
+        auto i = node_ids.put(value._i, &ret);
+        if (ret) {
+            node_ids.value_at(i) = (uint32_t)nodes.size();
+            nodes.push_back(Node { node_type, 0, 0, 0, value });
+        }
+        edges.push_back(Edge { type, name, node_ids.value_at(i) });
+    };
+
+    first_edge.push_back(0);
+    for (auto i = 0u; i < globals.size(); i++) {
+        add_edge(EdgeGlobal, intern(i < global_names.size() ? global_names[i] : ""), globals[i]);
+    }
+    for (auto i = 0u; i < stack_end; i++) {
+        add_edge(EdgeStack, i, stack[i]);
+    }
+    for (auto i = roots.begin(); i != roots.end(); i = roots.next(i)) {
+        add_edge(EdgePinned, roots.value_at(i), TackValue { roots.key_at(i) });
+    }
+
+    for (auto n = 1u; n < nodes.size(); n++) {
+        first_edge.push_back((uint32_t)edges.size());
+        auto value = nodes[n].value; // nodes may be reallocated by add_edge
+        switch (nodes[n].type) {
+            case NodeString: {
+                auto* str = value.string();
+                nodes[n].name = intern(str->data.substr(0, MAX_STRING_PREVIEW));
+                nodes[n].self_size = sizeof(*str) + payload_size(*str);
+                break;
+            }
+            case NodeArray: {
+                auto* arr = value.array();
+                nodes[n].self_size = sizeof(*arr) + payload_size(*arr);
+                for (auto i = 0u; i < arr->data.size(); i++) {
+                    add_edge(EdgeElement, i, arr->data[i]);
+                }
+                break;
+            }
+            case NodeObject: {
+                auto* obj = value.object();
+                nodes[n].self_size = sizeof(*obj) + payload_size(*obj);
+                for (auto i = obj->data.begin(); i != obj->data.end(); i = obj->data.next(i)) {
+                    add_edge(EdgeProperty, intern(obj->data.key_at(i)), obj->data.value_at(i));
+                }
+                break;
+            }
+            case NodeFunction: {
+                auto* func = value.function();
+                nodes[n].self_size = sizeof(*func) + payload_size(*func);
+                if (func->is_cfunction) {
+                    nodes[n].name = intern("(cfunction)");
+                } else {
+                    auto* code = (CodeFragment*)func->code_ptr;
+                    nodes[n].name = intern(code->name);
+                    nodes[n].line = code->line_numbers.size() ? code->line_numbers[0] : 0;
+                }
+                for (auto i = 0u; i < func->num_captures; i++) {
+                    add_edge(EdgeCapture, i, func->captures()[i]);
+                }
+                break;
+            }
+            case NodeBox: {
+                auto* box = value_to_boxed(value);
+                nodes[n].self_size = sizeof(*box);
+                add_edge(EdgeValue, 0, *box->location);
+                break;
+            }
+            case NodeWeakRef: {
+                nodes[n].self_size = sizeof(TackValue::WeakRefType);
+                break;
+            }
+            case NodeWeakMap: {
+                auto* map = value.weakmap();
+                nodes[n].self_size = sizeof(*map) + payload_size(*map);
+                auto e = 0u;
+                for (auto i = map->data.begin(); i != map->data.end(); i = map->data.next(i)) {
+                    add_edge(EdgeEphemeron, e++, map->data.value_at(i));
+                }
+                break;
+            }
+            default: break;
+        }
+    }
+    first_edge.push_back((uint32_t)edges.size());
+    auto num_nodes = (uint32_t)nodes.size();
+
+    // reverse postorder, by iterative depth first search
+    auto rpo = std::vector<uint32_t> {};
+    auto rpo_index = std::vector<uint32_t>(num_nodes, UNDEFINED_NODE);
+    {
+        rpo.reserve(num_nodes);
+        auto visited = std::vector<bool>(num_nodes, false);
+        auto dfs = std::vector<std::pair<uint32_t, uint32_t>> { { 0, first_edge[0] } }; // node, next edge
+        visited[0] = true;
+        while (dfs.size()) {
+            auto& [n, e] = dfs.back();
+            if (e == first_edge[n + 1]) {
+                rpo.push_back(n);
+                dfs.pop_back();
+                continue;
+            }
+            auto to = edges[e++].to;
+            if (!visited[to]) {
+                visited[to] = true;
+                dfs.emplace_back(to, first_edge[to]);
+            }
+        }
+        std::reverse(rpo.begin(), rpo.end());
+        for (auto i = 0u; i < num_nodes; i++) {
+            rpo_index[rpo[i]] = i;
+        }
+    }
+
+    // predecessors
+    auto first_pred = std::vector<uint32_t>(num_nodes + 1, 0);
+    auto preds = std::vector<uint32_t>(edges.size());
+    for (auto& e : edges) {
+        first_pred[e.to + 1]++;
+    }
+    for (auto i = 0u; i < num_nodes; i++) {
+        first_pred[i + 1] += first_pred[i];
+    }
+    {
+        auto fill = std::vector<uint32_t>(first_pred.begin(), first_pred.end() - 1);
+        for (auto n = 0u; n < num_nodes; n++) {
+            for (auto e = first_edge[n]; e < first_edge[n + 1]; e++) {
+                preds[fill[edges[e].to]++] = n;
+            }
+        }
+    }
+
+    // dominators
+    auto idom = std::vector<uint32_t>(num_nodes, UNDEFINED_NODE);
+    idom[0] = 0;
+    auto intersect = [&](uint32_t a, uint32_t b) {
+        while (a != b) {
+            while (rpo_index[a] > rpo_index[b]) a = idom[a];
+            while (rpo_index[b] > rpo_index[a]) b = idom[b];
+        }
+        return a;
+    };
+    for (auto changed = true; changed; ) {
+        changed = false;
+        for (auto i = 1u; i < num_nodes; i++) {
+            auto n = rpo[i];
+            auto new_idom = UNDEFINED_NODE;
+            for (auto p = first_pred[n]; p < first_pred[n + 1]; p++) {
+                auto pred = preds[p];
+                if (idom[pred] != UNDEFINED_NODE) {
+                    new_idom = new_idom == UNDEFINED_NODE ? pred : intersect(pred, new_idom);
+                }
+            }
+            if (idom[n] != new_idom) {
+                idom[n] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // retained sizes: a node's dominators always come before it in reverse postorder
+    auto retained = std::vector<size_t>(num_nodes);
+    for (auto n = 0u; n < num_nodes; n++) {
+        retained[n] = nodes[n].self_size;
+    }
+    for (auto i = num_nodes; i-- > 1; ) {
+        retained[idom[rpo[i]]] += retained[rpo[i]];
+    }
+
+    // write it out
+    auto w = Writer(file);
+    w << "{\"snapshot\":{\"meta\":{";
+    w << "\"node_fields\":[\"type\",\"name\",\"self_size\",\"retained_size\",\"edge_count\",\"line\",\"dominator\"],";
+    w << "\"node_types\":[";
+    for (auto i = 0u; i < std::size(node_type_names); i++) {
+        w << (i ? "," : "") << '"' << node_type_names[i] << '"';
+    }
+    w << "],\"edge_fields\":[\"type\",\"name_or_index\",\"to_node\"],";
+    w << "\"edge_types\":[";
+    for (auto i = 0u; i < std::size(edge_type_names); i++) {
+        w << (i ? "," : "") << '"' << edge_type_names[i] << '"';
+    }
+    w << "]},\"node_count\":" << num_nodes << ",\"edge_count\":" << edges.size() << "},\n";
+
+    w << "\"nodes\":[";
+    for (auto n = 0u; n < num_nodes; n++) {
+        auto& node = nodes[n];
+        w << (n ? ",\n" : "") << (uint32_t)node.type << ',' << node.name << ',' << node.self_size << ',' << retained[n]
+            << ',' << (first_edge[n + 1] - first_edge[n]) << ',' << node.line << ',' << idom[n];
+    }
+    w << "],\n\"edges\":[";
+    for (auto e = 0u; e < edges.size(); e++) {
+        w << (e ? ",\n" : "") << (uint32_t)edges[e].type << ',' << edges[e].name << ',' << edges[e].to;
+    }
+    w << "],\n\"strings\":[";
+    for (auto i = 0u; i < strings_table.size(); i++) {
+        if (i) w << ",\n";
+        w.quoted(strings_table[i]);
+    }
+    w << "],\n";
+
+    // summary
+    w << "\"summary\":{\"total_size\":" << retained[0] << ",\"by_type\":{";
+    for (auto t = (uint32_t)NodeString; t < std::size(node_type_names); t++) {
+        auto count = 0u;
+        auto size = size_t(0);
+        for (auto& node : nodes) {
+            if (node.type == t) {
+                count++;
+                size += node.self_size;
+            }
+        }
+        w << (t == NodeString ? "" : ",") << '"' << node_type_names[t] << "\":{\"count\":" << count << ",\"self_size\":" << size << '}';
+    }
+    auto largest = std::vector<uint32_t> {};
+    for (auto n = 1u; n < num_nodes; n++) {
+        largest.push_back(n);
+    }
+    auto num_largest = std::min<size_t>(NUM_LARGEST_RETAINERS, largest.size());
+    std::partial_sort(largest.begin(), largest.begin() + num_largest, largest.end(), [&](uint32_t a, uint32_t b) {
+        return retained[a] > retained[b];
+    });
+    w << "},\"largest_retainers\":[";
+    for (auto i = 0u; i < num_largest; i++) {
+        auto n = largest[i];
+        w << (i ? ",\n" : "\n") << "{\"node\":" << n << ",\"type\":\"" << node_type_names[nodes[n].type] << "\",\"name\":";
+        w.quoted(strings_table[nodes[n].name]);
+        w << ",\"retained_size\":" << retained[n] << ",\"line\":" << nodes[n].line << '}';
+    }
+    w << "]}}\n";
+}
@@ -27,7 +27,7 @@ std::string TackValue::get_string() {
         case (uint64_t)TackType::Boolean:   { s << (boolean() ? "true" : "false"); break; }
         case (uint64_t)TackType::String:    { s << string()->data; break; }
         case (uint64_t)TackType::Pointer:   { s << pointer(); break; }
-        case type_bits_boxed:               { s << "box:      " << std::hex << _p << "(" << std::hex << value_to_boxed(*this)->value._p << ")"; break; }
+        case type_bits_boxed:               { s << "box:      " << std::hex << _p << "(" << std::hex << value_to_boxed(*this)->location->_p << ")"; break; }
         // case (uint64_t)TackType::CFunction: { s << "c-func:   " << std::hex << _p; break; }
         case (uint64_t)TackType::Function:  { 
             auto* func = function();
@@ -56,6 +56,8 @@ std::string TackValue::get_string() {
             s << '}';
             break;
         }
+        case (uint64_t)TackType::WeakRef: { s << "weakref: " << weakref()->target.get_string(); break; }
+        case (uint64_t)TackType::WeakMap: { s << "weakmap: " << weakmap()->data.size() << " entries"; break; }
         case (uint64_t)TackType::Array: {
             auto* arr = array();
             s << "array [";